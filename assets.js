@@ -0,0 +1,115 @@
+// Embeds the web files in data/ into the firmware
+// Every file is gzipped when it gets smaller, and gets a content hash
+// used both as ETag and in a hashed file name that can be cached forever.
+// References in index.html are rewritten to the hashed names.
+//
+// Usage: node assets.js > src/assets.inc
+
+var fs     = require('fs');
+var path   = require('path');
+var zlib   = require('zlib');
+var crypto = require('crypto');
+
+var dataDir = path.join(__dirname, 'data');
+
+var contentTypes = {
+  '.html': 'text/html',
+  '.js':   'text/javascript',
+  '.css':  'text/css',
+  '.gif':  'image/gif',
+  '.png':  'image/png',
+  '.woff': 'application/font-woff',
+};
+
+// Entry page is always revalidated and keeps its name
+var entryPage = 'index.html';
+
+function hashOf(content) {
+  return crypto.createHash('sha256').update(content).digest('hex').substr(0, 8);
+}
+
+function hashedName(name, hash) {
+  var ext = path.extname(name);
+  return name.substr(0, name.length - ext.length) + '.' + hash + ext;
+}
+
+// Read all files, already gzipped files are served without the .gz
+var assets = fs.readdirSync(dataDir).sort().map(function (file) {
+  var content = fs.readFileSync(path.join(dataDir, file));
+  var name = file;
+
+  if (path.extname(file) === '.gz') {
+    name = file.substr(0, file.length - 3);
+    content = zlib.gunzipSync(content);
+  }
+
+  return { name: name, content: content };
+});
+
+// Hash all files except the entry page
+assets.forEach(function (asset) {
+  if (asset.name === entryPage)
+    return;
+
+  asset.hash = hashOf(asset.content);
+  asset.hashedName = hashedName(asset.name, asset.hash);
+});
+
+// Point the entry page to the hashed names
+assets.forEach(function (asset) {
+  if (asset.name !== entryPage)
+    return;
+
+  var html = asset.content.toString('utf8');
+  assets.forEach(function (other) {
+    if (!other.hashedName)
+      return;
+
+    var escaped = other.name.replace(/[.]/g, '\\.');
+    html = html.replace(new RegExp('(["\'(])(\\./)?' + escaped + '(["\')])', 'g'), '$1' + other.hashedName + '$3');
+  });
+
+  asset.content = Buffer.from(html, 'utf8');
+  asset.hash = hashOf(asset.content);
+});
+
+// Compress when it saves at least 10%
+assets.forEach(function (asset) {
+  var gzipped = zlib.gzipSync(asset.content, { level: 9 });
+  asset.isGzip = gzipped.length < asset.content.length * 0.9;
+  asset.data = asset.isGzip ? gzipped : asset.content;
+});
+
+
+process.stdout.write('// Generated by assets.js from data/, do not edit\n');
+
+assets.forEach(function (asset, index) {
+  process.stdout.write('\n// ' + asset.name + ', ' + asset.content.length + ' bytes' +
+                       (asset.isGzip ? ', ' + asset.data.length + ' gzipped' : '') + '\n');
+  process.stdout.write('static const uint8_t s_asset' + index + '[] PROGMEM = {');
+
+  for (var i = 0; i < asset.data.length; i++) {
+    if (i > 0)
+      process.stdout.write(',');
+    if ((i & 15) == 0)
+      process.stdout.write('\n ');
+    process.stdout.write(' 0x' + ('0' + asset.data[i].toString(16)).substr(-2));
+  }
+  process.stdout.write('\n};\n');
+});
+
+process.stdout.write('\nstatic const H801_Asset s_assets[] = {\n');
+assets.forEach(function (asset, index) {
+  var contentType = contentTypes[path.extname(asset.name)] || 'application/octet-stream';
+
+  process.stdout.write('  { ' + [
+    '"/' + asset.name + '"',
+    asset.hashedName ? '"/' + asset.hashedName + '"' : 'NULL',
+    '"' + contentType + '"',
+    '"\\"' + asset.hash + '\\""',
+    's_asset' + index,
+    asset.data.length,
+    asset.isGzip ? 'true' : 'false',
+  ].join(', ') + ' },\n');
+});
+process.stdout.write('};\n');
@@ -0,0 +1,76 @@
+// Sends a test pattern as E1.31 or Art-Net, used to check the realtime DMX input
+// Usage: node dmx.js <e131|artnet> <host> [universe] [fps] [address]
+//   node dmx.js e131 192.168.1.50 1 44 1
+
+var dgram = require('dgram');
+
+var protocol = process.argv[2] || 'e131';
+var host     = process.argv[3] || '127.0.0.1';
+var universe = parseInt(process.argv[4] || '1', 10);
+var fps      = parseInt(process.argv[5] || '44', 10);
+var address  = parseInt(process.argv[6] || '1', 10);
+
+var socket   = dgram.createSocket('udp4');
+var sequence = 0;
+var frame    = 0;
+
+// Fixed source id
+var cid = Buffer.from('48383031444d58746573747061747465', 'hex');
+
+function e131Packet(data) {
+  var packet = Buffer.alloc(126 + data.length);
+
+  // Root layer
+  packet.writeUInt16BE(0x0010, 0);
+  packet.write('ASC-E1.17', 4, 'ascii');
+  packet.writeUInt16BE(0x7000 | (packet.length - 16), 16);
+  packet.writeUInt32BE(0x00000004, 18);
+  cid.copy(packet, 22);
+
+  // Framing layer
+  packet.writeUInt16BE(0x7000 | (packet.length - 38), 38);
+  packet.writeUInt32BE(0x00000002, 40);
+  packet.write('dmx.js', 44, 'ascii');
+  packet.writeUInt8(100, 108);
+  packet.writeUInt8(sequence, 111);
+  packet.writeUInt16BE(universe, 113);
+
+  // DMP layer
+  packet.writeUInt16BE(0x7000 | (packet.length - 115), 115);
+  packet.writeUInt8(0x02, 117);
+  packet.writeUInt8(0xA1, 118);
+  packet.writeUInt16BE(0x0001, 121);
+  packet.writeUInt16BE(data.length + 1, 123);
+  data.copy(packet, 126);
+  return packet;
+}
+
+function artNetPacket(data) {
+  var packet = Buffer.alloc(18 + data.length);
+
+  packet.write('Art-Net', 0, 'ascii');
+  packet.writeUInt16LE(0x5000, 8);
+  packet.writeUInt16BE(14, 10);
+  packet.writeUInt8(sequence, 12);
+  packet.writeUInt16LE(universe, 14);
+  packet.writeUInt16BE(data.length, 16);
+  data.copy(packet, 18);
+  return packet;
+}
+
+setInterval(function () {
+  // Sequence 0 means disabled, skip it
+  sequence = (sequence % 255) + 1;
+  frame++;
+
+  // Phase shifted triangle wave on each channel
+  var data = Buffer.alloc(512);
+  for (var i = 0; i < 5; i++) {
+    var pos = (frame * 4 + i * 51) % 510;
+    data[address - 1 + i] = pos < 255 ? pos : 510 - pos;
+  }
+
+  var packet = protocol === 'artnet' ? artNetPacket(data) : e131Packet(data);
+  var port   = protocol === 'artnet' ? 6454 : 5568;
+  socket.send(packet, port, host);
+}, 1000 / fps);
@@ -0,0 +1,99 @@
+// Uploads firmware in pieces that are resumed after a failure
+// The image is gzipped unless it already is, the bootloader unpacks it.
+// Usage: node ota.js <host> <firmware.bin|firmware.bin.gz> [piece size]
+//   node ota.js 192.168.1.50 .pio/build/h801/firmware.bin
+
+var fs     = require('fs');
+var http   = require('http');
+var zlib   = require('zlib');
+var crypto = require('crypto');
+
+var host      = process.argv[2];
+var file      = process.argv[3];
+var pieceSize = parseInt(process.argv[4] || '32768', 10);
+
+// Attempts for each piece before giving up
+var maxRetries = 10;
+
+if (!host || !file) {
+  console.error('Usage: node ota.js <host> <firmware.bin|firmware.bin.gz> [piece size]');
+  process.exit(1);
+}
+
+var image = fs.readFileSync(file);
+if (image[0] !== 0x1f || image[1] !== 0x8b)
+  image = zlib.gzipSync(image, { level: 9 });
+
+var md5 = crypto.createHash('md5').update(image).digest('hex');
+
+function request(range, body, callback) {
+  var req = http.request({
+    host:    host,
+    path:    '/update',
+    method:  'POST',
+    timeout: 10000,
+    headers: {
+      'Content-Type':   'application/octet-stream',
+      'Content-Length': body.length,
+      'Content-Range':  'bytes ' + range + '/' + image.length,
+      'X-MD5':          md5,
+    },
+  }, function (res) {
+    var data = '';
+    res.on('data', function (chunk) { data += chunk; });
+    res.on('end', function () { callback(null, res.statusCode, data); });
+  });
+
+  req.on('timeout', function () { req.destroy(new Error('timeout')); });
+  req.on('error', function (err) { callback(err); });
+  req.end(body);
+}
+
+// Bytes stored on the device
+function received(data) {
+  try {
+    return JSON.parse(data).received;
+  }
+  catch (e) {
+    return 0;
+  }
+}
+
+function send(offset, retries) {
+  var end = Math.min(offset + pieceSize, image.length);
+
+  request(offset + '-' + (end - 1), image.slice(offset, end), function (err, status, data) {
+    if (!err && status === 200) {
+      console.log('Done, ' + data);
+      return;
+    }
+
+    if (!err && (status === 202 || status === 416)) {
+      var next = received(data);
+      if (next > offset)
+        retries = maxRetries;
+
+      process.stdout.write('\r' + next + ' / ' + image.length + ' bytes');
+      send(next, retries);
+      return;
+    }
+
+    if (!retries) {
+      console.error('\nUpload failed: ' + (err ? err.message : status + ' ' + data));
+      process.exit(1);
+    }
+
+    // Ask where to continue
+    console.error('\nRetrying: ' + (err ? err.message : status));
+    setTimeout(function () {
+      request('*', Buffer.alloc(0), function (err, status, data) {
+        send(!err && status === 202 ? received(data) : offset, retries - 1);
+      });
+    }, 2000);
+  });
+}
+
+console.log('Uploading ' + image.length + ' bytes, md5 ' + md5);
+request('*', Buffer.alloc(0), function (err, status, data) {
+  send(!err && status === 202 ? received(data) : 0, maxRetries);
+});
@@ -1,7 +1,13 @@
 
 #include <FS.h>
+#ifdef H801_LITTLEFS
+# include <LittleFS.h>
+#endif
 
 #include <string>
+#include <new>
+#include <climits>
+#include <cstdarg>
 
 #include <ESP8266WiFi.h>
 #include <WiFiManager.h>
@@ -10,9 +16,13 @@
 
 #include <ArduinoJson.h>
 
-#include <ESP8266HTTPUpdateServer.h>
-#include <ESP8266WebServer.h>
 #include <ESP8266mDNS.h>
+#include <Updater.h>
+#include <WebSocketsServer.h>
+
+extern "C"{
+  #include "gpio.h"
+}
 
 #ifdef NEW_PWM
 extern "C"{
@@ -27,46 +37,53 @@ constexpr std::size_t countof(T const (&)[N]) noexcept {
 }
 
 
-#ifndef HWMODEL
-# error Missing HWMODEL define
-#endif 
-
-#define HWMODEL_H801        1
-#define HWMODEL_MAGIC_RGB   2
-#define HWMODEL_MAGIC_RGBW  3
-
-
-const char* getHWModelName() {
-  static const char *modelName = NULL;
-
-  if (modelName != NULL)
-    return modelName;
-
-// Check model type
-#if   HWMODEL==HWMODEL_H801
-  modelName = "H801";
-#elif HWMODEL==HWMODEL_MAGIC_RGB
-  modelName = "Magic RGB";
-#elif HWMODEL==HWMODEL_MAGIC_RGBW
-  modelName = "Magic RGBW";
-#else
-# error Unknown HWMODEL 
-#endif
-
-  return modelName;
-}
-
 // Forward declaration
 bool stringToUnsignedLong(const char *psz, unsigned long *dest);
+uint32_t calcCRC32(const void *data, size_t size);
+bool jsonToDuration(const JsonVariant &json, unsigned long *fadeTime);
 const char * statusToJSONString(const char *eventSource, unsigned long fadeTime);
-bool jsonToLight(JsonObject& json, unsigned long fadeTime);
+void inboxSet(size_t index, uint8_t bri, uint32_t fadeSteps, uint8_t cmdIndex);
+void inboxCommit(void);
+bool jsonToScene(JsonObject& json);
+void scheduleRun(unsigned long time);
+void infoInit(void);
+void infoInvalidate(bool isStorageChanged);
+void infoRefresh(unsigned long time);
 void startWifiManager(bool resetWifiSettings);
+void wifiConnected(void);
 void printSystemInfo(void);
+bool powerIsIdle(unsigned long time);
+bool powerCanLightSleep(void);
+unsigned long scheduleNextDue(unsigned long time);
+void taskButton(unsigned long time);
+void taskFade(unsigned long time);
+void taskWiFi(unsigned long time);
+void taskHTTP(unsigned long time);
+void taskWebSocket(unsigned long time);
+void taskMQTT(unsigned long time);
+void taskMQTTReconnect(unsigned long time);
+void taskMQTTPing(unsigned long time);
+void taskDMX(unsigned long time);
+void taskMirror(unsigned long time);
+void taskCommit(unsigned long time);
+void taskConfig(unsigned long time);
+void taskRestore(unsigned long time);
+void taskMetrics(unsigned long time);
+void pwmCommit(void);
 const char* getHostname(void);
 
+// Fade completion tracking
+void fadeTrackStart(uint32_t pending, uint32_t done, const char *id);
+void fadeTrackSupersede(uint32_t mask);
+void fadeTrackDone(uint32_t mask);
+bool fadeAdvance(uint32_t steps);
+uint32_t fadeNextChange(void);
+void fadeCatchUp(unsigned long time);
+
 // Set/Get Status
 const char *funcSetStatus(const char *eventSource, JsonObject&);
 const char *funcGetStatus(void);
+const char *funcGetCurrent(void);
 
 // Set/Get Config
 const char *funcSetConfig(const char *eventSource, JsonObject&);
@@ -79,6 +96,21 @@ void funcResetConfirmTimeout(void);
 // Get Info
 const char *funcGetInfo(void);
 
+// Get Metrics
+const char *funcGetMetrics(void);
+
+// Get Scenes
+const char *funcGetScenes(void);
+
+// Time beacon
+void funcSetTime(double serverTime, unsigned long localTime);
+
+// Realtime channel values
+void funcSetChannels(const char *eventSource, const uint8_t *values, size_t count);
+
+// Mirrored channel targets
+void funcSetTargets(const char *eventSource, uint32_t mask, const uint8_t *bri, const uint32_t *fadeSteps, unsigned long fadeTime);
+
 
 typedef const char* (*H801_FunctionSet)(const char *eventSource, JsonObject& json);
 typedef const char* (*H801_FunctionGet)(void);
@@ -87,6 +119,7 @@ typedef struct tagH801_Functions {
   // Led status
   H801_FunctionSet set_Status;
   H801_FunctionGet get_Status;
+  H801_FunctionGet get_Current;
 
   // Configuration
   H801_FunctionSet set_Config;
@@ -97,6 +130,21 @@ typedef struct tagH801_Functions {
   // Information
   H801_FunctionGet get_Info;
 
+  // Metrics, Prometheus text format
+  H801_FunctionGet get_Metrics;
+
+  // Scenes
+  H801_FunctionGet get_Scenes;
+
+  // Time synchronization
+  void (*set_Time)(double serverTime, unsigned long localTime);
+
+  // Realtime channel values, applied directly without publishing
+  void (*set_Channels)(const char *eventSource, const uint8_t *values, size_t count);
+
+  // Channel targets from group leader
+  void (*set_Targets)(const char *eventSource, uint32_t mask, const uint8_t *bri, const uint32_t *fadeSteps, unsigned long fadeTime);
+
 } H801_Functions, *PH801_Functions;
 
 
@@ -104,6 +152,7 @@ typedef struct tagH801_Functions {
 H801_Functions callbackFunctions = {
   .set_Status = funcSetStatus,
   .get_Status = funcGetStatus,
+  .get_Current = funcGetCurrent,
 
   .set_Config = funcSetConfig,
   .get_Config = funcGetConfig,
@@ -111,13 +160,37 @@ H801_Functions callbackFunctions = {
   .reset_Config = funcResetConfirmTimeout,
 
   .get_Info = funcGetInfo,
+
+  .get_Metrics = funcGetMetrics,
+
+  .get_Scenes = funcGetScenes,
+
+  .set_Time = funcSetTime,
+
+  .set_Channels = funcSetChannels,
+
+  .set_Targets = funcSetTargets,
 };
 
 
+#include "h801_board.h"
+#include "h801_scratch.h"
+#include "h801_metrics.h"
+#include "h801_scheduler.h"
+#include "h801_storage.h"
 #include "h801_config.h"
+#include "h801_wifi.h"
+#include "h801_scenes.h"
+#include "h801_timesync.h"
 #include "h801_led.h"
+#include "h801_button.h"
+#include "h801_restore.h"
 #include "h801_mqtt.h"
+#include "h801_dmx.h"
+#include "h801_mirror.h"
 #include "h801_http.h"
+#include "h801_websocket.h"
+#include "h801_power.h"
 
 // Led pins
 #define H801_LED_PIN_G  1
@@ -130,67 +203,261 @@ H801_Functions callbackFunctions = {
 // Number of steps to to fade each second
 #define H801_DURATION_FADE_STEPS 10
 
+// Time between fade steps
+#define H801_FADE_PERIOD (100/H801_DURATION_FADE_STEPS)
+
+// Fade task interval while nothing fades, fades wake it when started
+#define H801_FADE_IDLE_PERIOD 1000
+
+// Number of commands with outstanding fades that can be tracked
+#define H801_FADE_TRACK_MAX 4
+
+// Max length of the command correlation id
+#define H801_FADE_ID_LEN 40
+
+// Number of commands that can be merged into a single inbox commit
+#define H801_INBOX_CMD_MAX 4
+
+// Number of commands that can wait for their "at" time
+#define H801_SCHEDULE_MAX 4
+
+// Max time a command can be scheduled ahead
+#define H801_SCHEDULE_MAX_AHEAD (24UL*60*60*1000)
+
+// Interval between /info snapshot rebuilds
+#define H801_INFO_REFRESH 5000
+
+// Interval between filesystem usage reads, also read after each write
+#define H801_INFO_STORAGE_REFRESH (60UL*1000)
+
+// Size of the /metrics text
+#define H801_METRICS_SIZE 3584
+
+// Size of the /info text, the worst case with every section reported,
+// a 127 character name and all counters at 10 digits is 3296 bytes
+#define H801_INFO_SIZE 3584
+
+// JSON nodes of the /info snapshot, each section with its most members
+#define H801_INFO_JSON_SIZE (                                   \
+    JSON_OBJECT_SIZE(20) +                    /* root */       \
+    JSON_OBJECT_SIZE(9) +                     /* wifi */       \
+    JSON_OBJECT_SIZE(5) +                     /* system */     \
+    JSON_OBJECT_SIZE(4) +                     /* storage */    \
+    JSON_OBJECT_SIZE(5) +                     /* boot */       \
+    JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(7) + /* restore */  \
+    JSON_OBJECT_SIZE(4) +                     /* mqtt */       \
+    JSON_OBJECT_SIZE(5) +                     /* time */       \
+    JSON_OBJECT_SIZE(7) +                     /* dmx */        \
+    JSON_OBJECT_SIZE(6) + JSON_OBJECT_SIZE(3) + /* mirror */   \
+    JSON_OBJECT_SIZE(4) +                     /* http */       \
+    JSON_OBJECT_SIZE(3) +                     /* websocket */  \
+    JSON_OBJECT_SIZE(3) +                     /* scratch */    \
+    JSON_OBJECT_SIZE(3) +                     /* button */     \
+    JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(countof(s_tasks)) + \
+    countof(s_tasks) * JSON_ARRAY_SIZE(5) +   /* scheduler */  \
+    JSON_OBJECT_SIZE(6) +                     /* power */      \
+    JSON_OBJECT_SIZE(4) +                     /* inbox */      \
+    JSON_OBJECT_SIZE(4))                      /* fade */
+
+/**
+ * Command with outstanding fade, used to emit fade_done events
+ */
+typedef struct tagH801_FadeCommand {
+  uint32_t pending;   // Channels still fading
+  uint32_t done;      // Channels that reached their target
+  char     id[H801_FADE_ID_LEN]; // Correlation id echoed in the event
+} H801_FadeCommand;
+
 // Global variables
 static bool s_isFading = false;
 static bool s_shouldSaveConfig = false;
-
-static H801_Config s_config;
+static H801_FadeCommand s_fadeCommands[H801_FADE_TRACK_MAX];
+
+// Fade steps are only taken when an output changes, the steps
+// in between are skipped and taken together with the change
+static struct {
+  unsigned long lastStep;  // millis() of the last fade run
+  uint32_t      skip;      // Steps taken by the next fade run
+
+  // Counters
+  struct {
+    uint32_t runs;         // Fade task runs that took steps
+    uint32_t steps;        // Fade steps taken
+    uint32_t writes;       // Channel outputs written
+    uint32_t commits;      // PWM commits
+  } stats;
+} s_fade = { 0, 1, { 0, 0, 0, 0 } };
+
+static H801_Scratch s_scratch;
+static H801_Metrics s_metrics;
+static H801_Storage s_storage;
+static H801_Config s_config(s_scratch);
+static H801_WiFi s_wifi(s_config);
+static H801_Scenes s_scenes(s_storage);
+static H801_TimeSync s_timeSync;
 static WiFiClient s_wifiClient;
-static H801_MQTT s_mqttClient(s_wifiClient, s_config, &callbackFunctions);
-static H801_HTTP s_httpServer(              s_config, &callbackFunctions);
-
-uint32_t H801_PWM_GPIO_Mux_Table[] = {
-  PERIPHS_IO_MUX_GPIO0_U, // GPIO0
-  PERIPHS_IO_MUX_U0TXD_U, // GPIO1
-  PERIPHS_IO_MUX_GPIO2_U, // GPIO2
-  PERIPHS_IO_MUX_U0RXD_U, // GPIO3
-  PERIPHS_IO_MUX_GPIO4_U, // GPIO4
-  PERIPHS_IO_MUX_GPIO5_U, // GPIO5
-  PERIPHS_IO_MUX_SD_CLK_U, // GPIO6
-  PERIPHS_IO_MUX_SD_DATA0_U, // GPIO7
-  PERIPHS_IO_MUX_SD_DATA1_U, // GPIO8
-  PERIPHS_IO_MUX_SD_DATA2_U, // GPIO9
-  PERIPHS_IO_MUX_SD_DATA3_U, // GPIO10
-  PERIPHS_IO_MUX_SD_CMD_U, // GPIO11
-  PERIPHS_IO_MUX_MTDI_U, // GPIO12
-  PERIPHS_IO_MUX_MTCK_U, // GPIO13
-  PERIPHS_IO_MUX_MTMS_U, // GPIO14
-  PERIPHS_IO_MUX_MTDO_U, // GPIO15
+static H801_MQTT s_mqttClient(s_wifiClient, s_config, s_scratch,   &callbackFunctions);
+static H801_HTTP s_httpServer(              s_config, s_scratch,   &callbackFunctions);
+static H801_DMX  s_dmx(                     s_config,              &callbackFunctions);
+static H801_Mirror s_mirror(                s_config, s_timeSync,  &callbackFunctions);
+static H801_WebSocket s_webSocket(                    s_scratch,   &callbackFunctions);
+static H801_Restore s_restore;
+static H801_Button s_button(H801_GPIO_PIN0);
+
+// Loop tasks, run in this order each tick. Fades and the button come
+// first and are never postponed, network tasks wait for the next tick
+// when the tick is over budget
+static H801_Task s_tasks[] = {
+  //        name              function           period ms                        priority               budget us
+  H801_TASK("button",         taskButton,        10,                              H801_TASK_CRITICAL,    200),
+  H801_TASK("fade",           taskFade,          H801_FADE_PERIOD,                H801_TASK_CRITICAL,    500),
+  H801_TASK("schedule",       scheduleRun,       0,                               H801_TASK_CRITICAL,    100),
+  H801_TASK("wifi",           taskWiFi,          100,                             H801_TASK_NORMAL,      500),
+  H801_TASK("http",           taskHTTP,          0,                               H801_TASK_NORMAL,      H801_HTTP_LOOP_BUDGET),
+  H801_TASK("websocket",      taskWebSocket,     0,                               H801_TASK_NORMAL,      1000),
+  H801_TASK("mqtt",           taskMQTT,          0,                               H801_TASK_NORMAL,      2000),
+  H801_TASK("dmx",            taskDMX,           0,                               H801_TASK_NORMAL,      500),
+  H801_TASK("mirror",         taskMirror,        0,                               H801_TASK_NORMAL,      500),
+  H801_TASK("commit",         taskCommit,        0,                               H801_TASK_CRITICAL,    1000),
+  H801_TASK("mqtt_reconnect", taskMQTTReconnect, 1000,                            H801_TASK_BACKGROUND,  1000),
+  H801_TASK("mqtt_ping",      taskMQTTPing,      H801_MQTT_PING_INTERVAL,         H801_TASK_BACKGROUND,  1000),
+  H801_TASK("info",           infoRefresh,       100,                             H801_TASK_BACKGROUND,  2000),
+  H801_TASK("config",         taskConfig,        100,                             H801_TASK_BACKGROUND,  1000),
+  H801_TASK("restore",        taskRestore,       100,                             H801_TASK_BACKGROUND,  500),
+  H801_TASK("metrics",        taskMetrics,       1000,                            H801_TASK_BACKGROUND,  2000),
 };
+static H801_Scheduler s_scheduler(s_tasks, countof(s_tasks));
+static H801_Power s_power(s_config, s_button);
 
-#define H801_PWM_GPIO(_num_) H801_PWM_GPIO_Mux_Table[_num_], FUNC_GPIO ##_num_, _num_
-
-#if HWMODEL==HWMODEL_MAGIC_RGBW
-// Magic RGBW led configuration
-H801_Led LedStatus[] = {
-  H801_Led("R",   0, H801_PWM_GPIO(5)),
-  H801_Led("G",   1, H801_PWM_GPIO(14)),
-  H801_Led("B",   2, H801_PWM_GPIO(12)),
-  H801_Led("W",   3, H801_PWM_GPIO(13)),
-};
+// Button hold fade, started by a long press
+static bool s_isButtonFading = false;
+static bool s_buttonFadeDirUp = false;
+void buttonGesture(H801_Button::Event event);
 
-#elif HWMODEL==HWMODEL_MAGIC_RGB
-// Magic RGB led configuration
-H801_Led LedStatus[] = {
-  H801_Led("R",   0, H801_PWM_GPIO(5)),
-  H801_Led("G",   1, H801_PWM_GPIO(14)),
-  H801_Led("B",   2, H801_PWM_GPIO(12)),
-};
+// Boot phases, millis() when each phase was done
+static struct {
+  unsigned long restore;  // Channels restored
+  unsigned long config;   // Configuration loaded
+  unsigned long ready;    // Setup done, WiFi connects in the background
+  unsigned long wifi;     // WiFi connected
+} s_boot;
 
-#elif HWMODEL==HWMODEL_H801
-// H801 led configuration
-H801_Led LedStatus[] = {
-  H801_Led("R",   0, H801_PWM_GPIO(15)),
-  H801_Led("G",   1, H801_PWM_GPIO(13)),
-  H801_Led("B",   2, H801_PWM_GPIO(12)),
-  H801_Led("W1",  3, H801_PWM_GPIO(14)),
-  H801_Led("W2",  4, H801_PWM_GPIO(4)),
-};
-#endif
+// Channels of the board, set up from the board descriptor
+H801_Led LedStatus[H801_BOARD_CHANNELS];
 
 // Array with all leds to fade on button press
 H801_Led* LedButtonFade[countof(LedStatus)] = {0};
 
+/**
+ * Name of the hardware model
+ */
+const char* getHWModelName() {
+  return H801_Board::name;
+}
+
+
+/**
+ * Apply the changed duties to the outputs
+ */
+void pwmCommit() {
+  H801_PWM::commit();
+  s_metrics.countPWMCommit();
+}
+
+
+/**
+ * Select leds faded by the button from the config
+ */
+void buttonFadeSetup() {
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    LedButtonFade[i] = s_config.m_ButtonFade[i] ? &LedStatus[i] : NULL;
+  }
+}
+
+// Ensure scenes can hold all channels
+static_assert(countof(LedStatus) <= H801_SCENE_CHANNELS, "Scene must hold all channels");
+
+// Ensure mirror packets can hold all channels
+static_assert(countof(LedStatus) <= H801_MIRROR_CHANNELS, "Mirror packet must hold all channels");
+
+/**
+ * Parsed light command
+ */
+typedef struct tagH801_Command {
+  uint32_t      mask;                           // Channels set by the command
+  uint8_t       bri[countof(LedStatus)];        // Target brightness
+  uint32_t      fadeSteps[countof(LedStatus)];  // Number of steps to fade over
+  unsigned long fadeTime;                       // Command duration
+  char          id[H801_FADE_ID_LEN];           // Correlation id
+} H801_Command;
+
+/**
+ * Commands waiting for their "at" time
+ */
+static struct {
+  H801_Command  cmd;
+  const char   *eventSource;
+  unsigned long due;        // Local millis() time
+  bool          isActive;
+} s_schedule[H801_SCHEDULE_MAX];
+
+/**
+ * Commands received during a loop tick, merged per channel (latest wins)
+ * and applied once by inboxCommit()
+ */
+static struct {
+  // Pending target per channel
+  struct {
+    uint8_t  bri;
+    uint8_t  cmdIndex;
+    uint32_t fadeSteps;
+  } channels[countof(LedStatus)];
+  uint32_t mask;
+
+  // Commands merged into this commit
+  uint8_t numCmds;
+  char    cmdIds[H801_INBOX_CMD_MAX][H801_FADE_ID_LEN];
+
+  // Latest command, used for the published state
+  const char   *eventSource;
+  unsigned long fadeTime;
+
+  // Counters
+  struct {
+    uint32_t commands;     // Commands received
+    uint32_t commits;      // Times the inbox was applied
+    uint32_t merged;       // Commands merged into an already pending commit
+    uint32_t overwritten;  // Channel values replaced before being applied
+  } stats;
+} s_inbox;
+
+/**
+ * Snapshot served by /info, rebuilt in the loop on change or timer
+ */
+static struct {
+  char buffer[H801_INFO_SIZE];
+  bool isChanged;
+  unsigned long lastBuild;
+
+  // Read once at boot
+  char     mac[18];
+  uint32_t chipSize;
+  uint32_t chipRealSize;
+
+  // Formatted when the address changes
+  uint32_t lastIP;
+  char     ip[16];
+  char     subnet[16];
+  char     gateway[16];
+  char     ssid[33];
+
+  // Filesystem usage
+  bool          isStorageChanged;
+  unsigned long lastStorage;
+  uint32_t      fsUsed;
+  uint32_t      fsFree;
+} s_info;
+
 /**
  * Setup H801 and connect to the WiFi
  */
@@ -204,35 +471,35 @@ void setup() {
   pinMode(H801_LED_PIN_R, OUTPUT);
   pinMode(H801_LED_PIN_G, OUTPUT);
 
-#ifdef NEW_PWM
-  // PWM resolution, take max value of gamma table 1000
-  const uint32_t h801_pwm_period = s_gammaTable[countof(s_gammaTable) - 1]; // * 200ns ^= 200 Mhz
-
-  // Initial pwm values
-  uint32_t h801_pwm_initval[countof(LedStatus)] = {0};
-
-  // PWM setup
-  uint32_t h801_pwm_io_info[countof(LedStatus)][3] = {0};
+  // Outputs of the board, off until restored
   for (size_t i = 0; i < countof(LedStatus); i++) {
-    LedStatus[i].get_IO(h801_pwm_io_info[i]);
+    LedStatus[i].setup(i, H801_Board::channels[i]);
   }
 
-  // Init pwm and start it
-  pwm_init(h801_pwm_period, h801_pwm_initval, countof(LedStatus), h801_pwm_io_info);
-  pwm_start();
-#endif//NEW_PWM
+  // PWM resolution, take max value of gamma table
+  H801_PWM::begin(H801_Board::channels, countof(LedStatus), s_gammaTable[countof(s_gammaTable) - 1]);
+
 
+  // Restore last state before anything else, from RTC memory after
+  // a soft reset and from flash after a power loss
+  uint8_t restoreBri[countof(LedStatus)];
+  if (s_restore.load(restoreBri, countof(LedStatus))) {
+    for (size_t i = 0; i < countof(LedStatus); i++) {
+      LedStatus[i].set_Bri(restoreBri[i], 0);
+    }
+    pwmCommit();
+  }
+  s_boot.restore = millis();
 
-#if HWMODEL == HWMODEL_H801
-  // red: off, green: on
-  digitalWrite(H801_LED_PIN_R, 1);
-  digitalWrite(H801_LED_PIN_G, 1);
-#endif // HWMODEL
-  // GPIO0 as input
-  pinMode(H801_GPIO_PIN0, INPUT);
+  if (H801_Board::hasStatusLeds) {
+    // red: off, green: on
+    digitalWrite(H801_LED_PIN_R, 1);
+    digitalWrite(H801_LED_PIN_G, 1);
+  }
+  // GPIO0 button, a press during boot is ignored until released
+  s_button.begin();
 
-  // Delay to allow starting serial monitor
-  delay(1000);
+  Serial1.printf("Restore: Channels restored from %s at %lums\n", s_restore.source(), s_boot.restore);
 
   // Display system information
   printSystemInfo();
@@ -244,52 +511,70 @@ void setup() {
   bool resetWifiSettings = false;
   Serial1.println("Config: Loading config");
 
-  // Try to read the configuration file 
+  // Try to read the configuration record
   if (!s_config.load()) {
     Serial1.println("Config: failed to read config, settings was cleared");
     resetWifiSettings = true;
   }
   else {
-    Serial1.print("Config: ");
-    Serial1.println(funcGetConfig());
+    Serial1.printf("Config: Name \"%s\", MQTT server \"%s\"\n", s_config.m_name, s_config.m_MQTT.server);
   }
 
-  // Starts the wifi manager
-  startWifiManager(resetWifiSettings);
+  // Load stored scenes
+  s_scenes.load();
+  s_boot.config = millis();
+
+#ifdef H801_STORAGE_BENCH
+  // Filesystem backend benchmark, a config sized file and the largest web asset
+  {
+    H801_ScratchScope scope(s_scratch);
+    const char *config = s_config.toJSONString(true);
+    if (config)
+      s_storage.benchmark("config", config, strlen(config), 20);
+
+    const H801_Asset *largest = &s_assets[0];
+    for (const H801_Asset &asset : s_assets) {
+      if (asset.length > largest->length)
+        largest = &asset;
+    }
+    s_storage.benchmark("serve", (PGM_P)largest->data, largest->length, 10);
+  }
+#endif//H801_STORAGE_BENCH
 
-  // Setup MQTT client if we have configured one
-  if (*s_config.m_MQTT.server) {
-    // Print MQTT
-    Serial1.printf("  %15s \"%s\":%s\n", "MQTT:", s_config.m_MQTT.server, s_config.m_MQTT.port);
+  // Config was unreadable, WiFi has to be configured again
+  if (resetWifiSettings)
+    startWifiManager(true);
 
-    // init the MQTT connection
-    s_mqttClient.setup();
+  // Start connecting, services using the network are started by the loop
+  // once connected so the button and fades run in the meantime
+  s_wifi.begin();
 
-  }
+  // Static values for /info
+  infoInit();
 
   // Setup HTTP server
   s_httpServer.setup();
 
-  //save the custom parameters to FS
-  if (s_shouldSaveConfig) {
-    s_config.save();
-  }
+  // Setup WebSocket server
+  s_webSocket.setup();
 
   // Setup button fading
-  LedButtonFade[0] = s_config.m_ButtonFade.R ? &LedStatus[0] : NULL;
-  LedButtonFade[1] = s_config.m_ButtonFade.G ? &LedStatus[1] : NULL;
-  LedButtonFade[2] = s_config.m_ButtonFade.B ? &LedStatus[2] : NULL;
-#if HWMODEL==HWMODEL_H801
-  LedButtonFade[3] = s_config.m_ButtonFade.W1 ? &LedStatus[3] : NULL;
-  LedButtonFade[4] = s_config.m_ButtonFade.W2 ? &LedStatus[4] : NULL;
-#elif HWMODEL==HWMODEL_MAGIC_RGBW
-  LedButtonFade[3] = s_config.m_ButtonFade.W ? &LedStatus[3] : NULL;
-#endif
+  buttonFadeSetup();
 
   // Green light on
   digitalWrite(H801_LED_PIN_G, false);
 
+  s_boot.ready = millis();
+  Serial1.printf("Boot: restore %lums, config %lums, ready %lums\n",
+                 s_boot.restore, s_boot.config, s_boot.ready);
+
   Serial1.println("\nSystem: Running");
+
+  // Idle power saving
+  s_power.setup();
+
+  // Start loop tasks
+  s_scheduler.begin(millis());
 }
 
 
@@ -298,17 +583,6 @@ void setup() {
  */
 void loop() {
   static unsigned long lastTime = 0;
-  static unsigned long lastFade = 0;
-  static unsigned int fadingLedIndex = 0;
-
-  // De-bounce the button on startup
-  static bool buttonInit = false;
-
-  // What direction are we fading with the button
-  static bool buttonFadeDirUp = false;
-
-  // Gpio 0 counter
-  static unsigned long gpioCount = 0;
 
   //
   unsigned long time = millis();
@@ -319,110 +593,273 @@ void loop() {
   }
   lastTime = time;
 
-  // process HTTP
-  s_httpServer.loop();
-  
-  // process MQTT
-  s_mqttClient.loop(time);
+  // Strings returned during the previous loop are no longer used
+  s_scratch.reset();
 
-  // Check if GPIO i pressed
-  if (!digitalRead(H801_GPIO_PIN0)) {
-    gpioCount++;
-  }
+  // Run due tasks
+  s_scheduler.loop(time);
 
-  // de-bounce
-  else if (gpioCount < 100) {
-    // Clear counter
-    gpioCount = 0;
-    buttonInit = true;
-  }
+  // Sleep until the next task when nothing is going on
+  if (powerIsIdle(time))
+    s_power.idle(min(s_scheduler.nextDue(time), scheduleNextDue(time)), powerCanLightSleep());
+  else
+    s_power.busy();
+}
 
-  // Button click
-  else if (gpioCount < 700) {
-    // Clear counter
-    gpioCount = 0;
 
-    Serial1.println("Button pressed: click");
-    s_mqttClient.publishButtonPress();
-  }
+/**
+ * Nothing to do until the next task is due: no fades, no pending
+ * commands or button gestures and no HTTP, WebSocket or DMX traffic
+ * @param time Current millis() time
+ */
+bool powerIsIdle(unsigned long time) {
+  return !s_isFading && !s_isButtonFading && !s_inbox.mask &&
+         s_button.isIdle() && s_wifi.isConnected() &&
+         !s_httpServer.isBusy() && !s_webSocket.hasClients() && !s_dmx.isReceiving(time);
+}
 
-  // Button fading done, publish new value
-  else {
-    // Clear counter
-    gpioCount = 0;
 
-    const char *jsonString = statusToJSONString("button", 0);
+/**
+ * Outputs hold during light sleep, every channel is fully off or on
+ */
+bool powerCanLightSleep() {
+  if (!H801_PWM::canLightSleep)
+    return false;
 
-    Serial1.print("State: ");
-    Serial1.println(jsonString);
+  for (H801_Led &led : LedStatus) {
+    if (!led.is_Static())
+      return false;
+  }
+  return true;
+}
 
-    // Publish change  
-    s_mqttClient.publishConfigUpdate(jsonString);
 
-    // Green light on
-    digitalWrite(H801_LED_PIN_G, false);
+/**
+ * Button gestures, timed by the interrupt so a slow loop doesn't change them
+ * @param time Current millis() time
+ */
+void taskButton(unsigned long time) {
+  H801_Button::Event buttonEvent;
+  while ((buttonEvent = s_button.loop(time)) != H801_Button::EVENT_NONE) {
+    buttonGesture(buttonEvent);
   }
+}
 
 
-  // Button pressed for 700ms
-  if (gpioCount >= 700 && buttonInit) {
-    // First time we enter
-    if (gpioCount == 700) {
-      s_isFading = true;
-      buttonFadeDirUp = !buttonFadeDirUp;
-      Serial1.printf("Button pressed: fading %s\n", buttonFadeDirUp? "up":"down");
-    }
+/**
+ * Fade step, button fade while the button is held
+ * @param time Current millis() time
+ */
+void taskFade(unsigned long time) {
+  static unsigned int fadingLedIndex = 0;
 
-    if (time >= lastFade + (100/H801_DURATION_FADE_STEPS) || time < lastFade) {
-      lastFade = time;
-      fadingLedIndex++;
+  // Button held after a long press
+  if (s_isButtonFading) {
+    fadingLedIndex++;
 
-      if (s_isFading) {
-        digitalWrite(H801_LED_PIN_G, (fadingLedIndex & 0x7) != 0x7);
+    if (s_isFading) {
+      digitalWrite(H801_LED_PIN_G, (fadingLedIndex & 0x7) != 0x7);
 
-        s_isFading = false;
-        // For each led
-        for (H801_Led* led : LedButtonFade) {
-          if (led)
-            s_isFading = led->do_ButtonFade(buttonFadeDirUp) || s_isFading;
-        }
-#ifdef NEW_PWM
-        pwm_start();
-#endif//NEW_PWM
-      }
-      else {
-        digitalWrite(H801_LED_PIN_G, false);
+      s_isFading = false;
+      // For each led
+      for (H801_Led* led : LedButtonFade) {
+        if (led)
+          s_isFading = led->do_ButtonFade(s_buttonFadeDirUp) || s_isFading;
       }
+      pwmCommit();
+    }
+    else {
+      digitalWrite(H801_LED_PIN_G, false);
     }
-    // Ensure that gpioCount don't overflow
-    gpioCount = 0x0FFFFFFF;
+    return;
   }
 
-  // Are we fading light
-  else if (s_isFading && (time >= lastFade + (100/H801_DURATION_FADE_STEPS) || time < lastFade)) {
-    lastFade = time;
-    s_isFading = false;
+  // Are we fading light, the commit wakes the task for a new fade
+  if (!s_isFading) {
+    s_scheduler.defer("fade", H801_FADE_IDLE_PERIOD - H801_FADE_PERIOD);
+    return;
+  }
 
-    // Fade each light
-    for (H801_Led& led : LedStatus) {
-      s_isFading = led.do_Fade() || s_isFading;
-    }
+  // Steps up to the next output change, found by the previous run
+  s_fade.lastStep = time;
+  s_fade.stats.runs++;
+  if (fadeAdvance(s_fade.skip)) {
+    pwmCommit();
+    s_fade.stats.commits++;
+  }
 
-    // Blink leds during fading, ensure led is green when done
-    fadingLedIndex++;
-    if (s_isFading) {
-#ifdef NEW_PWM
-      pwm_start();
-#endif//NEW_PWM
-      digitalWrite(H801_LED_PIN_G, (fadingLedIndex & 0x7) != 0x00);
-      //digitalWrite(H801_LED_PIN_R, (fadingLedIndex&(0x04)) != );
-    }
-    else {
-      // Inverted values
-      digitalWrite(H801_LED_PIN_G, false); 
-      //digitalWrite(H801_LED_PIN_R, true);
-    }
+  // Blink leds during fading, ensure led is green when done
+  fadingLedIndex++;
+  if (s_isFading) {
+    // Skip the steps that don't change any output
+    s_fade.skip = fadeNextChange();
+    s_scheduler.defer("fade", (s_fade.skip - 1) * H801_FADE_PERIOD);
+
+    digitalWrite(H801_LED_PIN_G, (fadingLedIndex & 0x7) != 0x00);
+    //digitalWrite(H801_LED_PIN_R, (fadingLedIndex&(0x04)) != );
+  }
+  else {
+    // Inverted values
+    digitalWrite(H801_LED_PIN_G, false); 
+    //digitalWrite(H801_LED_PIN_R, true);
+  }
+}
+
+
+/**
+ * WiFi connection
+ * @param time Current millis() time
+ */
+void taskWiFi(unsigned long time) {
+  switch (s_wifi.loop(time)) {
+    case H801_WiFi::EVENT_CONNECTED:
+      wifiConnected();
+      break;
+
+    case H801_WiFi::EVENT_PORTAL:
+      // Blocks until configured, resets on timeout
+      startWifiManager(false);
+      s_wifi.endPortal();
+      break;
+
+    default:
+      break;
+  }
+}
+
+
+/**
+ * Process HTTP
+ * @param time Current millis() time
+ */
+void taskHTTP(unsigned long time) {
+  s_httpServer.loop();
+}
+
+
+/**
+ * Process WebSocket
+ * @param time Current millis() time
+ */
+void taskWebSocket(unsigned long time) {
+  s_webSocket.loop(time, s_isFading);
+}
+
+
+/**
+ * Process received MQTT messages
+ * @param time Current millis() time
+ */
+void taskMQTT(unsigned long time) {
+  s_mqttClient.loop(time);
+}
+
+
+/**
+ * Keep MQTT connected
+ * @param time Current millis() time
+ */
+void taskMQTTReconnect(unsigned long time) {
+  s_mqttClient.reconnect(time);
+}
+
+
+/**
+ * Publish MQTT ping
+ * @param time Current millis() time
+ */
+void taskMQTTPing(unsigned long time) {
+  s_mqttClient.ping(time);
+}
+
+
+/**
+ * Realtime DMX input
+ * @param time Current millis() time
+ */
+void taskDMX(unsigned long time) {
+  s_dmx.loop(time);
+}
+
+
+/**
+ * State from group leader
+ * @param time Current millis() time
+ */
+void taskMirror(unsigned long time) {
+  s_mirror.loop(time);
+}
+
+
+/**
+ * Apply commands received during this tick
+ * @param time Current millis() time
+ */
+void taskCommit(unsigned long time) {
+  inboxCommit();
+}
+
+
+/**
+ * Deferred config write
+ * @param time Current millis() time
+ */
+void taskConfig(unsigned long time) {
+  s_config.loop(time);
+}
+
+
+/**
+ * Keep last state for restore after reset, a fade is kept as its
+ * end value so the record doesn't change on every fade step
+ * @param time Current millis() time
+ */
+void taskRestore(unsigned long time) {
+  uint8_t restoreBri[countof(LedStatus)];
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    restoreBri[i] = LedStatus[i].get_TargetBri();
   }
+  s_restore.loop(time, restoreBri, countof(LedStatus));
+}
+
+
+/**
+ * Task publishing the metrics to MQTT, at the configured interval
+ * @param time current millis time
+ */
+void taskMetrics(unsigned long time) {
+  static unsigned long lastPublish = 0;
+
+  if (!s_config.m_Metrics.interval || time - lastPublish < s_config.m_Metrics.interval * 1000UL)
+    return;
+  lastPublish = time;
+
+  // Only needed while the message is built
+  H801_ScratchScope scope(s_scratch);
+
+  StaticJsonBuffer<512> *jsonBuffer = s_scratch.jsonBuffer<512>();
+  if (!jsonBuffer)
+    return;
+
+  JsonObject& root = jsonBuffer->createObject();
+
+  // Summary of /metrics, the histograms as average and max
+  const H801_Histogram &tickTime = s_scheduler.tickTime();
+  const H801_Histogram &httpLatency = s_httpServer.latency();
+  root["commands"]        = s_metrics.commands();
+  root["parse_failed"]    = s_httpServer.parseFailures() + s_mqttClient.parseFailures() + s_webSocket.parseFailures();
+  root["fade_steps"]      = s_fade.stats.steps;
+  root["pwm_commits"]     = s_metrics.pwmCommits();
+  root["loop_avg_us"]     = tickTime.count() ? (uint32_t)(tickTime.sum() / tickTime.count()) : 0;
+  root["mqtt_reconnects"] = s_mqttClient.reconnects();
+  root["publish_failed"]  = s_mqttClient.publishFailures();
+  root["http_requests"]   = s_httpServer.requests();
+  root["http_avg_us"]     = httpLatency.count() ? (uint32_t)(httpLatency.sum() / httpLatency.count()) : 0;
+  root["free_heap"]       = ESP.getFreeHeap();
+  root["heap_frag"]       = ESP.getHeapFragmentation();
+  root["uptime"]          = time;
+
+  s_mqttClient.publishMetrics(s_scratch.printTo(root));
 }
 
 
@@ -431,6 +868,9 @@ void loop() {
  * @param resetWifiSettings Should we reset setting before starting
  */
 void startWifiManager(bool resetWifiSettings) {
+  // Credentials entered in the portal are stored by the SDK
+  WiFi.persistent(true);
+
   //WiFiManager
   //Local intialization. Once its business is done, there is no need to keep it around
   WiFiManager wifiManager;
@@ -506,16 +946,9 @@ void startWifiManager(bool resetWifiSettings) {
   }
 
 
-  //if you get here you have connected to the WiFi
-  Serial1.println("\nWiFi: Connected");
-
-  Serial1.printf("  %15s %s\n", "IP:",      WiFi.localIP().toString().c_str());
-  Serial1.printf("  %15s %s\n", "Subnet:",  WiFi.subnetMask().toString().c_str());
-  Serial1.printf("  %15s %s\n", "Gateway:", WiFi.gatewayIP().toString().c_str());
-  Serial1.printf("  %15s %s\n", "MAC:",     WiFi.macAddress().c_str());
-  Serial1.printf("  %15s %s\n", "SSID:",    WiFi.SSID().c_str());
-
   if (s_shouldSaveConfig) {
+    s_shouldSaveConfig = false;
+
     //read updated parameters
     strlcpy(s_config.m_MQTT.server, customMQTTServer.getValue(),  countof(s_config.m_MQTT.server));
     strlcpy(s_config.m_MQTT.port,   customMQTTPort.getValue(),    countof(s_config.m_MQTT.port));
@@ -523,40 +956,75 @@ void startWifiManager(bool resetWifiSettings) {
     strlcpy(s_config.m_MQTT.alias,  customMQTTAlias.getValue(),   countof(s_config.m_MQTT.alias));
     strlcpy(s_config.m_MQTT.login,  customMQTTLogin.getValue(),   countof(s_config.m_MQTT.login));
     strlcpy(s_config.m_MQTT.passw,  customMQTTPassw.getValue(),   countof(s_config.m_MQTT.passw));    
+
+    s_config.save();
   }
 }
 
 
 /**
- * Prints system and SPIFFS information
+ * WiFi connected or reconnected, (re)start services using the network
  */
-void printSystemInfo(void) {
-  Serial1.println("\nSystem: Information");
-  Serial1.printf("%20s: %08X\n", "ChipId",         ESP.getChipId());
-  Serial1.printf("%20s: %08X\n", "FlashChipId",    ESP.getFlashChipId());
-  Serial1.printf("%20s: %u\n",   "BootMode",       ESP.getBootMode());
-  Serial1.printf("%20s: %s\n",   "SdkVersion",     ESP.getSdkVersion());
-  Serial1.printf("%20s: %u\n",   "BootVersion",    ESP.getBootVersion());
-  Serial1.printf("%20s: %u\n",   "FlashChipSize",  ESP.getFlashChipSize());
-  Serial1.printf("%20s: %u\n",   "FlashChipRealSize",      ESP.getFlashChipRealSize());
-  Serial1.printf("%20s: %u\n",   "FlashChipSizeByChipId",  ESP.getFlashChipSizeByChipId());
-  Serial1.printf("%20s: %u\n",   "FreeHeap",       ESP.getFreeHeap());
-  Serial1.printf("%20s: \"%s\"\n", "ResetReason",  ESP.getResetReason().c_str());
-  Serial1.printf("%20s: \"%s\"\n", "SketchMD5",    ESP.getSketchMD5().c_str());
-  
-  if (SPIFFS.begin()) {
-    Serial1.println("\nSPIFFS: Information");
-    Dir dir = SPIFFS.openDir("");
-    while (dir.next()) {
-      File f = dir.openFile("r");
-      if (f) {
-        Serial1.printf("%20s: %ukb (%u)\n", dir.fileName().c_str(), f.size()>>10, f.size());
-        f.close();
-      }
-    }
+void wifiConnected(void) {
+  if (!s_boot.wifi)
+    s_boot.wifi = millis();
+
+  Serial1.println("\nWiFi: Connected");
+
+  Serial1.printf("  %15s %s\n", "IP:",      WiFi.localIP().toString().c_str());
+  Serial1.printf("  %15s %s\n", "Subnet:",  WiFi.subnetMask().toString().c_str());
+  Serial1.printf("  %15s %s\n", "Gateway:", WiFi.gatewayIP().toString().c_str());
+  Serial1.printf("  %15s %s\n", "MAC:",     WiFi.macAddress().c_str());
+  Serial1.printf("  %15s %s\n", "SSID:",    WiFi.SSID().c_str());
+
+  // Setup MQTT client if we have configured one
+  if (*s_config.m_MQTT.server) {
+    // Print MQTT
+    Serial1.printf("  %15s \"%s\":%s\n", "MQTT:", s_config.m_MQTT.server, s_config.m_MQTT.port);
+
+    // init the MQTT connection, connect in the next tick
+    s_mqttClient.setup();
+    s_scheduler.wake("mqtt_reconnect");
+  }
+
+  // Multicast groups are joined on the current address
+  s_dmx.setup();
+  s_mirror.setup();
+
+  infoInvalidate(false);
+}
+
+
+/**
+ * Prints system and filesystem information
+ */
+void printSystemInfo(void) {
+  Serial1.println("\nSystem: Information");
+  Serial1.printf("%20s: %08X\n", "ChipId",         ESP.getChipId());
+  Serial1.printf("%20s: %08X\n", "FlashChipId",    ESP.getFlashChipId());
+  Serial1.printf("%20s: %u\n",   "BootMode",       ESP.getBootMode());
+  Serial1.printf("%20s: %s\n",   "SdkVersion",     ESP.getSdkVersion());
+  Serial1.printf("%20s: %u\n",   "BootVersion",    ESP.getBootVersion());
+  Serial1.printf("%20s: %u\n",   "FlashChipSize",  ESP.getFlashChipSize());
+  Serial1.printf("%20s: %u\n",   "FlashChipRealSize",      ESP.getFlashChipRealSize());
+  Serial1.printf("%20s: %u\n",   "FlashChipSizeByChipId",  ESP.getFlashChipSizeByChipId());
+  Serial1.printf("%20s: %u\n",   "FreeHeap",       ESP.getFreeHeap());
+  Serial1.printf("%20s: \"%s\"\n", "ResetReason",  ESP.getResetReason().c_str());
+  Serial1.printf("%20s: \"%s\"\n", "SketchMD5",    ESP.getSketchMD5().c_str());
+  
+  if (s_storage.begin()) {
+    Serial1.printf("\n%s: Information\n", s_storage.name());
+    Dir dir = s_storage.openDir("/");
+    while (dir.next()) {
+      File f = dir.openFile("r");
+      if (f) {
+        Serial1.printf("%20s: %ukb (%u)\n", dir.fileName().c_str(), f.size()>>10, f.size());
+        f.close();
+      }
+    }
 
     FSInfo fs_info;
-    if (SPIFFS.info(fs_info)) {
+    if (s_storage.info(fs_info)) {
       Serial1.println("-----------------------");
       Serial1.printf("%20s: %ukb (%u)\n", "Used space", fs_info.usedBytes>>10, fs_info.usedBytes);
       Serial1.printf("%20s: %ukb (%u)\n", "Free space",
@@ -564,9 +1032,6 @@ void printSystemInfo(void) {
                      (fs_info.totalBytes - fs_info.usedBytes));
       Serial1.println("");
     }
-
-
-    SPIFFS.end();
   }
   Serial1.println("");
 }
@@ -601,36 +1066,649 @@ bool stringToUnsignedLong(const char *psz, unsigned long *dest) {
 
 
 /**
- * Update light values using JSON values
- * @param  json     JSON object
- * @param  fadeTime Time to use to reach new state
- * @return Did any LED values change
+ * Calculate CRC32 for records stored in flash and RTC memory
+ * @param  data Input data
+ * @param  size Size of data
+ * @return CRC
+ */
+uint32_t calcCRC32(const void *data, size_t size) {
+  const uint8_t *psz = (const uint8_t*)data;
+  uint32_t crc = 0xFFFFFFFF;
+
+  while (size--) {
+    crc ^= *psz++;
+    for (int i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+
+/**
+ * Convert JSON duration value to milliseconds
+ * @param  json     JSON value, number or string
+ * @param  fadeTime Output duration
+ * @return false if value could not be converted
  */
-bool jsonToLight(JsonObject& json, unsigned long fadeTime) {
+bool jsonToDuration(const JsonVariant &json, unsigned long *fadeTime) {
+  // Number value
+  if (json.is<long>()) {
+    *fadeTime = (unsigned long)constrain(json.as<long>(), 0, 100000000);
+    return true;
+  }
+
+  //String value
+  if (json.is<char*>() && stringToUnsignedLong(json.as<char*>(), fadeTime)) {
+    *fadeTime = (unsigned long)constrain(*fadeTime, 0, 100000000);
+    return true;
+  }
+
+  *fadeTime = 0;
+  return false;
+}
+
+
+/**
+ * Parse light values from JSON into command
+ * Channel value is either a brightness or an object with
+ * brightness "v" and optional duration "d" for that channel
+ * @param  json JSON object
+ * @param  cmd  Command to update
+ * @return Was any channel value found
+ */
+bool jsonToCommand(JsonObject& json, H801_Command &cmd) {
   // Calculate number of steps for this duration
   uint32_t fadeSteps = 0;
-  if (fadeTime > 0)
-    fadeSteps = (fadeTime/H801_DURATION_FADE_STEPS);
+  if (cmd.fadeTime > 0)
+    fadeSteps = (cmd.fadeTime/H801_DURATION_FADE_STEPS);
 
-  // Has any value changed
-  bool isChanged = false;
+  bool isFound = false;
 
   // Check all PWM leds
-  for (H801_Led& led : LedStatus) {
-    String &id = led.get_ID();
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    String &id = LedStatus[i].get_ID();
     
     // Skip led if we don't have any value
     if (!json.containsKey(id))
       continue;
 
-    if (!led.set_Bri(json[id], fadeSteps))
+    const JsonVariant &value = json[id];
+    uint8_t  bri;
+    uint32_t channelSteps = fadeSteps;
+
+    // Per channel object
+    if (value.is<JsonObject&>()) {
+      JsonObject& jsonChannel = value.as<JsonObject&>();
+
+      if (!H801_Led::jsonToBri(jsonChannel["v"], &bri))
+        continue;
+
+      unsigned long channelTime;
+      if (jsonChannel.containsKey("d") && jsonToDuration(jsonChannel["d"], &channelTime))
+        channelSteps = (channelTime/H801_DURATION_FADE_STEPS);
+    }
+    else if (!H801_Led::jsonToBri(value, &bri)) {
+      continue;
+    }
+
+    cmd.bri[i]       = bri;
+    cmd.fadeSteps[i] = channelSteps;
+    cmd.mask |= (1 << i);
+    isFound = true;
+  }
+
+  return isFound;
+}
+
+
+/**
+ * Load stored scene into command
+ * @param  json Scene id, number or string
+ * @param  cmd  Command to update
+ * @return false if scene was not found
+ */
+bool sceneToCommand(const JsonVariant &json, H801_Command &cmd) {
+  unsigned long id;
+  if (json.is<long>())
+    id = (unsigned long)json.as<long>();
+  else if (!json.is<char*>() || !stringToUnsignedLong(json.as<char*>(), &id))
+    return false;
+
+  const H801_Scene *scene = s_scenes.get(id);
+  if (!scene) {
+    Serial1.printf("Scene: %lu not found\n", id);
+    return false;
+  }
+
+  // Scene duration unless the command has one
+  if (!cmd.fadeTime)
+    cmd.fadeTime = scene->duration;
+
+  // All channels use the same number of steps so they start and end together
+  uint32_t fadeSteps = cmd.fadeTime/H801_DURATION_FADE_STEPS;
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    if (!(scene->mask & (1 << i)))
+      continue;
+
+    cmd.bri[i]       = scene->bri[i];
+    cmd.fadeSteps[i] = fadeSteps;
+    cmd.mask |= (1 << i);
+  }
+
+  return true;
+}
+
+
+/**
+ * Merge command into the inbox, applied at the end of this loop tick
+ * @param eventSource Label of which system sent the command
+ * @param cmd         Command
+ */
+void inboxPush(const char *eventSource, const H801_Command &cmd) {
+  // Inbox full, apply the pending commands before merging more
+  if (s_inbox.numCmds >= H801_INBOX_CMD_MAX) {
+    inboxCommit();
+  }
+
+  s_inbox.stats.commands++;
+  s_metrics.countCommand(eventSource);
+  if (s_inbox.numCmds)
+    s_inbox.stats.merged++;
+
+  uint8_t cmdIndex = s_inbox.numCmds++;
+  s_inbox.eventSource = eventSource;
+  s_inbox.fadeTime = cmd.fadeTime;
+  strlcpy(s_inbox.cmdIds[cmdIndex], cmd.id, H801_FADE_ID_LEN);
+
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    if (cmd.mask & (1 << i))
+      inboxSet(i, cmd.bri[i], cmd.fadeSteps[i], cmdIndex);
+  }
+}
+
+
+/**
+ * Action configured for button gesture
+ * @param  event Gesture, a hold release uses the long press action
+ * @return "none", "mqtt", "fade" or "scene:<id>"
+ */
+const char* buttonAction(H801_Button::Event event) {
+  switch (event) {
+    case H801_Button::EVENT_CLICK:
+      return *s_config.m_Button.click       ? s_config.m_Button.click       : "mqtt";
+    case H801_Button::EVENT_DOUBLE_CLICK:
+      return *s_config.m_Button.doubleClick ? s_config.m_Button.doubleClick : "mqtt";
+    case H801_Button::EVENT_TRIPLE_CLICK:
+      return *s_config.m_Button.tripleClick ? s_config.m_Button.tripleClick : "mqtt";
+    case H801_Button::EVENT_LONG_PRESS:
+    case H801_Button::EVENT_HOLD_RELEASE:
+      return *s_config.m_Button.longPress   ? s_config.m_Button.longPress   : "fade";
+    default:
+      return "none";
+  }
+}
+
+
+/**
+ * Handle decoded button gesture
+ * @param event Gesture
+ */
+void buttonGesture(H801_Button::Event event) {
+  H801_ScratchScope scope(s_scratch);
+
+  const char *gesture = H801_Button::eventName(event);
+  const char *action = buttonAction(event);
+
+  Serial1.printf("Button: %s (%s)\n", gesture, action);
+
+  if (!strcmp(action, "mqtt")) {
+    s_mqttClient.publishButtonPress(gesture);
+  }
+
+  // Recall scene, on the gesture itself and not on the release
+  else if (!strncmp(action, "scene:", 6) && event != H801_Button::EVENT_HOLD_RELEASE) {
+    H801_Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+
+    if (sceneToCommand(action + 6, cmd))
+      inboxPush("button", cmd);
+  }
+
+  // Fade while held, toggling direction each time
+  else if (!strcmp(action, "fade") && event == H801_Button::EVENT_LONG_PRESS) {
+    s_isButtonFading = true;
+    s_isFading = true;
+    s_buttonFadeDirUp = !s_buttonFadeDirUp;
+    s_fade.skip = 1;
+    s_scheduler.wake("fade");
+
+    // Button fading overrides any ongoing fade
+    uint32_t buttonMask = 0;
+    for (size_t i = 0; i < countof(LedButtonFade); i++) {
+      if (LedButtonFade[i] && LedButtonFade[i]->is_Fading())
+        buttonMask |= (1 << i);
+    }
+    fadeTrackSupersede(buttonMask);
+    Serial1.printf("Button: fading %s\n", s_buttonFadeDirUp ? "up" : "down");
+  }
+
+  // Button fading done, publish new value
+  else if (!strcmp(action, "fade") && event == H801_Button::EVENT_HOLD_RELEASE && s_isButtonFading) {
+    s_isButtonFading = false;
+
+    const char *jsonString = statusToJSONString("button", 0);
+
+    Serial1.print("State: ");
+    Serial1.println(jsonString);
+
+    // Publish change
+    s_mqttClient.publishConfigUpdate(jsonString);
+    s_webSocket.notifyState();
+
+    // Green light on
+    digitalWrite(H801_LED_PIN_G, false);
+  }
+}
+
+
+/**
+ * Set pending channel target in inbox, latest value wins
+ * @param index     LED index
+ * @param bri       Target brightness
+ * @param fadeSteps Number of steps to fade over
+ * @param cmdIndex  Index of the command in the inbox
+ */
+void inboxSet(size_t index, uint8_t bri, uint32_t fadeSteps, uint8_t cmdIndex) {
+  if (s_inbox.mask & (1 << index))
+    s_inbox.stats.overwritten++;
+
+  s_inbox.channels[index].bri       = bri;
+  s_inbox.channels[index].cmdIndex  = cmdIndex;
+  s_inbox.channels[index].fadeSteps = fadeSteps;
+  s_inbox.mask |= (1 << index);
+}
+
+
+/**
+ * Queue command until the synchronized clock reaches "at"
+ * @param  eventSource Label of which system sent the command
+ * @param  json        Server time in ms, number or string
+ * @param  cmd         Command
+ * @return false if the command should be applied directly
+ */
+bool scheduleCommand(const char *eventSource, const JsonVariant &json, const H801_Command &cmd) {
+  // The parser keeps numbers as text, converting them with JsonVariant
+  // would go through float on the ESP8266 and lose the milliseconds
+  const char *text = json.as<const char*>();
+  double at = text ? strtod(text, NULL) : json.as<double>();
+
+  unsigned long time = millis();
+  if (!(at > 0) || !s_timeSync.isSynced(time)) {
+    Serial1.println("Schedule: Clock not synchronized, applying directly");
+    return false;
+  }
+
+  unsigned long due = s_timeSync.toLocal(at);
+  long ahead = (long)(due - time);
+
+  // Already passed
+  if (ahead <= 0) {
+    Serial1.printf("Schedule: Command %ldms late\n", -ahead);
+    return false;
+  }
+
+  if ((unsigned long)ahead > H801_SCHEDULE_MAX_AHEAD) {
+    Serial1.println("Schedule: Too far ahead, applying directly");
+    return false;
+  }
+
+  for (auto &entry : s_schedule) {
+    if (entry.isActive)
+      continue;
+
+    entry.cmd         = cmd;
+    entry.eventSource = eventSource;
+    entry.due         = due;
+    entry.isActive    = true;
+
+    Serial1.printf("Schedule: Command in %ldms\n", ahead);
+    return true;
+  }
+
+  Serial1.println("Schedule: Queue full, applying directly");
+  return false;
+}
+
+
+/**
+ * Time until the next scheduled command is due
+ * @param  time Current millis() time
+ * @return ms, 0 if a command is due
+ */
+unsigned long scheduleNextDue(unsigned long time) {
+  unsigned long next = ULONG_MAX;
+  for (auto &entry : s_schedule) {
+    if (!entry.isActive)
       continue;
 
-    // Indicate that we have changed the light
+    long wait = (long)(entry.due - time);
+    if (wait <= 0)
+      return 0;
+    if ((unsigned long)wait < next)
+      next = wait;
+  }
+  return next;
+}
+
+
+/**
+ * Move due scheduled commands to the inbox
+ * @param time Current millis() time
+ */
+void scheduleRun(unsigned long time) {
+  for (auto &entry : s_schedule) {
+    if (!entry.isActive || (long)(time - entry.due) < 0)
+      continue;
+
+    entry.isActive = false;
+    inboxPush(entry.eventSource, entry.cmd);
+  }
+}
+
+
+/**
+ * Store or remove scene using JSON values
+ * Scene without any channel values is removed
+ * @param  json Scene definition with "id", "name", "duration" and channel values
+ * @return Was the scene table modified
+ */
+bool jsonToScene(JsonObject& json) {
+  const JsonVariant &idValue = json["id"];
+  if (!idValue.is<long>())
+    return false;
+  unsigned long id = (unsigned long)idValue.as<long>();
+
+  H801_Scene scene;
+  memset(&scene, 0, sizeof(scene));
+
+  const JsonVariant &nameValue = json["name"];
+  if (nameValue.is<char*>())
+    strlcpy(scene.name, nameValue.as<char*>(), countof(scene.name));
+
+  unsigned long duration = 0;
+  if (json.containsKey("duration") && jsonToDuration(json["duration"], &duration))
+    scene.duration = duration;
+
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    String &ledId = LedStatus[i].get_ID();
+
+    if (json.containsKey(ledId) && H801_Led::jsonToBri(json[ledId], &scene.bri[i]))
+      scene.mask |= (1 << i);
+  }
+
+  // No channels, clear the whole slot
+  if (!scene.mask)
+    memset(&scene, 0, sizeof(scene));
+
+  return s_scenes.set(id, scene);
+}
+
+
+/**
+ * Apply all commands merged in the inbox and publish the new state once
+ */
+void inboxCommit(void) {
+  if (!s_inbox.numCmds)
+    return;
+
+  // The state string is only needed while it is published
+  H801_ScratchScope scope(s_scratch);
+
+  s_inbox.stats.commits++;
+
+  // Fades in the middle of skipped steps continue from where they are now
+  fadeCatchUp(millis());
+
+  // Changed channels for each merged command
+  uint32_t changedMask[H801_INBOX_CMD_MAX] = {0};
+  bool isChanged = false;
+
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    if (!(s_inbox.mask & (1 << i)))
+      continue;
+
+    H801_Led& led = LedStatus[i];
+
+    // New value overrides ongoing fade
+    if (led.is_Fading())
+      fadeTrackSupersede(1 << i);
+
+    if (!led.set_Bri(s_inbox.channels[i].bri, s_inbox.channels[i].fadeSteps))
+      continue;
+
+    changedMask[s_inbox.channels[i].cmdIndex] |= (1 << i);
     isChanged = true;
   }
 
-  return isChanged;
+  if (isChanged) {
+    s_isFading = true;
+    pwmCommit();
+
+    // Restart fade cadence so the first step is taken one period from now,
+    // keeps fades started at the same scheduled time in step between devices
+    s_fade.skip = 1;
+    s_fade.lastStep = millis();
+    s_scheduler.restart("fade");
+
+    // Track each command until all its channels have reached their target
+    for (uint8_t cmd = 0; cmd < s_inbox.numCmds; cmd++) {
+      if (!changedMask[cmd])
+        continue;
+
+      uint32_t fadingMask = 0;
+      for (size_t i = 0; i < countof(LedStatus); i++) {
+        if ((changedMask[cmd] & (1 << i)) && LedStatus[i].is_Fading())
+          fadingMask |= (1 << i);
+      }
+      fadeTrackStart(fadingMask, changedMask[cmd] & ~fadingMask, s_inbox.cmdIds[cmd]);
+    }
+  }
+
+  // Leader sends the committed targets to its group
+  uint8_t  mirrorBri[countof(LedStatus)];
+  uint32_t mirrorSteps[countof(LedStatus)];
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    mirrorBri[i]   = s_inbox.channels[i].bri;
+    mirrorSteps[i] = s_inbox.channels[i].fadeSteps;
+  }
+  s_mirror.publish(s_inbox.mask, mirrorBri, mirrorSteps, s_inbox.fadeTime);
+
+  // Clear inbox before generating the state so targets are read from leds
+  s_inbox.mask = 0;
+  s_inbox.numCmds = 0;
+
+  // Get current state
+  const char *jsonString = statusToJSONString(s_inbox.eventSource, s_inbox.fadeTime);
+
+  Serial1.print("State: ");
+  Serial1.println(jsonString);
+
+  // If changed, publish state
+  if (isChanged) {
+    s_mqttClient.publishConfigUpdate(jsonString);
+    s_webSocket.notifyState();
+  }
+}
+
+
+/**
+ * Publish fade_done event for command
+ * @param cmd Completed command
+ */
+void publishFadeDone(const H801_FadeCommand &cmd) {
+  H801_ScratchScope scope(s_scratch);
+
+  StaticJsonBuffer<256> *jsonBuffer = s_scratch.jsonBuffer<256>();
+  if (!jsonBuffer)
+    return;
+
+  JsonObject& root = jsonBuffer->createObject();
+
+  root["event"] = "fade_done";
+
+  JsonArray& channels = root.createNestedArray("channels");
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    if (cmd.done & (1 << i))
+      channels.add(LedStatus[i].get_ID().c_str());
+  }
+
+  if (*cmd.id)
+    root["id"] = cmd.id;
+
+  // Serialize JSON
+  const char *buffer = s_scratch.printTo(root);
+  if (!buffer)
+    return;
+
+  Serial1.print("Event: ");
+  Serial1.println(buffer);
+
+  s_mqttClient.publishEvent(buffer);
+}
+
+
+/**
+ * Take fade steps on all fading channels
+ * @param  steps Number of steps
+ * @return true if an output was written
+ */
+bool fadeAdvance(uint32_t steps) {
+  bool isWritten = false;
+  s_isFading = false;
+
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    if (!LedStatus[i].is_Fading())
+      continue;
+
+    bool isLedWritten = false;
+    if (LedStatus[i].do_Fade(steps, isLedWritten))
+      s_isFading = true;
+    else
+      fadeTrackDone(1 << i);
+
+    if (isLedWritten) {
+      s_fade.stats.writes++;
+      isWritten = true;
+    }
+  }
+
+  s_fade.stats.steps += steps;
+  return isWritten;
+}
+
+
+/**
+ * Fade steps until the output of any fading channel changes
+ * @return Steps, at least 1
+ */
+uint32_t fadeNextChange(void) {
+  uint32_t next = UINT32_MAX;
+  for (H801_Led &led : LedStatus) {
+    if (led.is_Fading())
+      next = min(next, led.next_Change());
+  }
+  return next == UINT32_MAX || !next ? 1 : next;
+}
+
+
+/**
+ * Take the skipped fade steps that have passed, before new values
+ * are set. None of them changes an output, the change is still ahead
+ * @param time Current millis() time
+ */
+void fadeCatchUp(unsigned long time) {
+  if (!s_isFading || s_isButtonFading || s_fade.skip <= 1)
+    return;
+
+  uint32_t steps = (time - s_fade.lastStep) / H801_FADE_PERIOD;
+  if (steps >= s_fade.skip)
+    steps = s_fade.skip - 1;
+  if (!steps)
+    return;
+
+  fadeAdvance(steps);
+  s_fade.skip -= steps;
+  s_fade.lastStep += steps * H801_FADE_PERIOD;
+}
+
+
+/**
+ * Start tracking a command until its fade is done
+ * @param pending Channels that are fading
+ * @param done    Channels that already reached their target
+ * @param id      Correlation id, NULL or empty if not specified
+ */
+void fadeTrackStart(uint32_t pending, uint32_t done, const char *id) {
+  // Instant change, only report if caller asked for correlation
+  if (!pending) {
+    if (done && id && *id) {
+      H801_FadeCommand cmd = { .pending = 0, .done = done };
+      strlcpy(cmd.id, id, countof(cmd.id));
+      publishFadeDone(cmd);
+    }
+    return;
+  }
+
+  for (H801_FadeCommand &cmd : s_fadeCommands) {
+    if (cmd.pending)
+      continue;
+
+    cmd.pending = pending;
+    cmd.done = done;
+    strlcpy(cmd.id, id ? id : "", countof(cmd.id));
+    return;
+  }
+
+  Serial1.println("Fade: Too many active commands, fade_done will not be sent");
+}
+
+
+/**
+ * Channels whose fade was overridden before reaching the target
+ * @param mask Overridden channels
+ */
+void fadeTrackSupersede(uint32_t mask) {
+  if (!mask)
+    return;
+
+  for (H801_FadeCommand &cmd : s_fadeCommands) {
+    if (!(cmd.pending & mask))
+      continue;
+
+    cmd.pending &= ~mask;
+
+    // Report the channels that did complete
+    if (!cmd.pending && cmd.done)
+      publishFadeDone(cmd);
+  }
+}
+
+
+/**
+ * Channels that finished fading
+ * @param mask Finished channels
+ */
+void fadeTrackDone(uint32_t mask) {
+  for (H801_FadeCommand &cmd : s_fadeCommands) {
+    if (!(cmd.pending & mask))
+      continue;
+
+    cmd.pending &= ~mask;
+    cmd.done |= mask;
+
+    if (!cmd.pending)
+      publishFadeDone(cmd);
+  }
 }
 
 
@@ -638,30 +1716,31 @@ bool jsonToLight(JsonObject& json, unsigned long fadeTime) {
  * Generate string with current status as JSON string
  * @param eventSource  Source event for status change
  * @param fadeTime     Number of ms to reach the new state
- * @return Current status as JSON string 
+ * @return Current status as JSON string in the scratch arena, NULL if out of memory
  */
 const char * statusToJSONString(const char *eventSource, unsigned long fadeTime) {
-  static char buffer[1024];
-  static StaticJsonBuffer<1024> jsonBuffer;
+  StaticJsonBuffer<1024> *jsonBuffer = s_scratch.jsonBuffer<1024>();
+  if (!jsonBuffer)
+    return NULL;
 
-  jsonBuffer.clear();
-  JsonObject& root = jsonBuffer.createObject();
+  JsonObject& root = jsonBuffer->createObject();
 
   if (fadeTime)
     root["duration"] = fadeTime;
 
-  // Convert each led state
-  for (H801_Led& led : LedStatus) {
-    root[led.get_ID()] = led.get_Bri();
+  // Convert each led state, including targets waiting in the inbox
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    if (s_inbox.mask & (1 << i))
+      root[LedStatus[i].get_ID()] = s_inbox.channels[i].bri;
+    else
+      root[LedStatus[i].get_ID()] = LedStatus[i].get_Bri();
   }
 
   if (eventSource && *eventSource)
     root["event"] = eventSource;
 
   // Serialize JSON
-  root.printTo(buffer, sizeof(buffer));
-
-  return buffer;
+  return s_scratch.printTo(root);
 }
 
 
@@ -682,15 +1761,71 @@ const char* getHostname(void) {
 
 
 /**
- * Retreives current LED status
- * @return JSON string with current status
+ * Read values for /info that don't change after boot
  */
-const char *funcGetInfo(void) {
-  static char buffer[1024];
-  static StaticJsonBuffer<1024> jsonBuffer;
+void infoInit(void) {
+  strlcpy(s_info.mac, WiFi.macAddress().c_str(), countof(s_info.mac));
+  s_info.chipSize     = ESP.getFlashChipSize();
+  s_info.chipRealSize = ESP.getFlashChipRealSize();
+  s_info.isStorageChanged = true;
+}
+
+
+/**
+ * Values in /info have changed, snapshot is rebuilt by the next loop
+ * @param isStorageChanged Should filesystem usage be read again
+ */
+void infoInvalidate(bool isStorageChanged) {
+  s_info.isChanged = true;
+  s_info.isStorageChanged = s_info.isStorageChanged || isStorageChanged;
+}
+
+
+/**
+ * Rebuild /info snapshot when values changed or on timer
+ * @param time Current millis() time
+ */
+void infoRefresh(unsigned long time) {
+  if (*s_info.buffer && !s_info.isChanged && time - s_info.lastBuild < H801_INFO_REFRESH)
+    return;
+
+  s_info.isChanged = false;
+  s_info.lastBuild = time;
+
+  // WiFi strings, only formatted when the address changes
+  IPAddress ip = WiFi.localIP();
+  if ((uint32_t)ip != s_info.lastIP) {
+    s_info.lastIP = (uint32_t)ip;
+
+    IPAddress subnet  = WiFi.subnetMask();
+    IPAddress gateway = WiFi.gatewayIP();
+    snprintf(s_info.ip,      countof(s_info.ip),      "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+    snprintf(s_info.subnet,  countof(s_info.subnet),  "%u.%u.%u.%u", subnet[0], subnet[1], subnet[2], subnet[3]);
+    snprintf(s_info.gateway, countof(s_info.gateway), "%u.%u.%u.%u", gateway[0], gateway[1], gateway[2], gateway[3]);
+    strlcpy(s_info.ssid, WiFi.SSID().c_str(), countof(s_info.ssid));
+  }
 
-  jsonBuffer.clear();
-  JsonObject& root = jsonBuffer.createObject();
+  // Filesystem usage, after writes or on a slower timer
+  if (s_storage.isMounted() &&
+      (s_info.isStorageChanged || time - s_info.lastStorage >= H801_INFO_STORAGE_REFRESH)) {
+    s_info.isStorageChanged = false;
+    s_info.lastStorage = time;
+
+    FSInfo fs_info;
+    if (s_storage.info(fs_info)) {
+      s_info.fsUsed = fs_info.usedBytes;
+      s_info.fsFree = fs_info.totalBytes - fs_info.usedBytes;
+    }
+  }
+
+  // Only needed while the snapshot is built
+  H801_ScratchScope scope(s_scratch);
+
+  StaticJsonBuffer<H801_INFO_JSON_SIZE> *jsonBuffer = s_scratch.jsonBuffer<H801_INFO_JSON_SIZE>();
+  if (!jsonBuffer)
+    return;
+
+  JsonObject& root = jsonBuffer->createObject();
 
   // Global info
   if (*s_config.m_name)
@@ -701,46 +1836,213 @@ const char *funcGetInfo(void) {
 
   // WiFi
   JsonObject& jsonWiFi = root.createNestedObject("wifi");
-  jsonWiFi["ip"]      = WiFi.localIP().toString();
-  jsonWiFi["subnet"]  = WiFi.subnetMask().toString();
-  jsonWiFi["gateway"] = WiFi.gatewayIP().toString();
-  jsonWiFi["mac"]     = WiFi.macAddress();
-  jsonWiFi["ssid"]    = WiFi.SSID();
+  jsonWiFi["ip"]      = s_info.ip;
+  jsonWiFi["subnet"]  = s_info.subnet;
+  jsonWiFi["gateway"] = s_info.gateway;
+  jsonWiFi["mac"]     = s_info.mac;
+  jsonWiFi["ssid"]    = s_info.ssid;
+  s_wifi.appendInfo(jsonWiFi);
 
   // System
   JsonObject& jsonSystem = root.createNestedObject("system");
   jsonSystem["chip_id"] = ESP.getChipId();
   jsonSystem["sdk_version"] = ESP.getSdkVersion();
   
-  jsonSystem["chip_size"] = ESP.getFlashChipSize();
-  jsonSystem["chip_real_size"] = ESP.getFlashChipRealSize();
-
-  // SPIFFS
-  if (SPIFFS.begin()) {
-    JsonObject& jsonSPIFFS = root.createNestedObject("spiffs");
-
-    FSInfo fs_info;
-    if (SPIFFS.info(fs_info)) {
-      jsonSPIFFS["used"] = fs_info.usedBytes;
-      jsonSPIFFS["free"] = (fs_info.totalBytes - fs_info.usedBytes);
-    }
-    SPIFFS.end();
+  jsonSystem["chip_size"] = s_info.chipSize;
+  jsonSystem["chip_real_size"] = s_info.chipRealSize;
+  jsonSystem["free_heap"] = ESP.getFreeHeap();
+
+  // Filesystem
+  if (s_storage.isMounted()) {
+    JsonObject& jsonStorage = root.createNestedObject("storage");
+    jsonStorage["backend"]  = s_storage.name();
+    jsonStorage["mount_us"] = s_storage.mountTime();
+    jsonStorage["used"]     = s_info.fsUsed;
+    jsonStorage["free"]     = s_info.fsFree;
   }
 
+  // Boot phases and restored state
+  JsonObject& jsonBoot = root.createNestedObject("boot");
+  jsonBoot["restore"] = s_boot.restore;
+  jsonBoot["config"]  = s_boot.config;
+  jsonBoot["ready"]   = s_boot.ready;
+  jsonBoot["wifi"]    = s_boot.wifi;
+  jsonBoot["mqtt"]    = s_mqttClient.firstPublishTime();
+  s_restore.appendInfo(root, time);
+
   s_mqttClient.appendInfo(root);
 
+  // Time synchronization
+  s_timeSync.appendInfo(root, time);
+
+  // Realtime DMX input
+  s_dmx.appendInfo(root);
+
+  // Group mirroring
+  s_mirror.appendInfo(root);
+
+  // HTTP connections
+  s_httpServer.appendInfo(root);
+
+  // WebSocket clients
+  s_webSocket.appendInfo(root);
+
+  // Request scratch memory
+  s_scratch.appendInfo(root);
+
+  // Button edges and gestures
+  s_button.appendInfo(root);
+
+  // Loop tasks
+  s_scheduler.appendInfo(root);
+
+  // Idle sleep
+  s_power.appendInfo(root, time);
+
+  // Command coalescing
+  JsonObject& jsonInbox = root.createNestedObject("inbox");
+  jsonInbox["commands"]    = s_inbox.stats.commands;
+  jsonInbox["commits"]     = s_inbox.stats.commits;
+  jsonInbox["merged"]      = s_inbox.stats.merged;
+  jsonInbox["overwritten"] = s_inbox.stats.overwritten;
+
+  // Fade steps, only the steps that change an output wake the loop
+  JsonObject& jsonFade = root.createNestedObject("fade");
+  jsonFade["runs"]    = s_fade.stats.runs;
+  jsonFade["steps"]   = s_fade.stats.steps;
+  jsonFade["writes"]  = s_fade.stats.writes;
+  jsonFade["commits"] = s_fade.stats.commits;
+
+  // Age of the snapshot can be calculated from uptime
+  root["uptime"] = time;
+
 /*
   for (H801_Led& led : LedStatus) {
     led.appendInfo(root);
   }
 */
+  // A full buffer silently drops sections and a long text is cut off,
+  // /info answers 503 instead of serving an incomplete snapshot
+  size_t length = root.measureLength();
+  if (jsonBuffer->size() + JSON_OBJECT_SIZE(1) > jsonBuffer->capacity() || length >= sizeof(s_info.buffer)) {
+    Serial1.printf("Info: Snapshot too large, %u of %u JSON bytes, %u of %u text bytes\n",
+                   (unsigned)jsonBuffer->size(), (unsigned)jsonBuffer->capacity(),
+                   (unsigned)length, (unsigned)sizeof(s_info.buffer));
+    *s_info.buffer = '\0';
+    return;
+  }
+
   // Serialize JSON
-  root.printTo(buffer, sizeof(buffer));
+  root.printTo(s_info.buffer, sizeof(s_info.buffer));
+}
+
+
+/**
+ * Retreives device information snapshot
+ * @return JSON string with device information, NULL if it didn't fit
+ */
+const char *funcGetInfo(void) {
+  // First request before the loop built the snapshot
+  if (!*s_info.buffer)
+    infoRefresh(millis());
+
+  return *s_info.buffer ? s_info.buffer : NULL;
+}
+
+
+/**
+ * Retreives the metrics, built on each request from the counters
+ * @return Metrics in the Prometheus text format
+ */
+const char *funcGetMetrics(void) {
+  char *buffer = (char*)s_scratch.alloc(H801_METRICS_SIZE);
+  if (!buffer)
+    return NULL;
+
+  H801_MetricsWriter out(buffer, H801_METRICS_SIZE);
+
+  // Commands
+  s_metrics.writeCommands(out);
+
+  out.metric("h801_parse_failures_total", "counter", "Commands that weren't valid JSON");
+  out.value("h801_parse_failures_total", "source", "HTTP",      s_httpServer.parseFailures());
+  out.value("h801_parse_failures_total", "source", "MQTT",      s_mqttClient.parseFailures());
+  out.value("h801_parse_failures_total", "source", "WebSocket", s_webSocket.parseFailures());
+
+  // Fades and outputs
+  out.metric("h801_fade_ticks_total", "counter", "Fade task runs that took steps");
+  out.value("h801_fade_ticks_total", s_fade.stats.runs);
+  out.metric("h801_fade_steps_total", "counter", "Fade steps taken");
+  out.value("h801_fade_steps_total", s_fade.stats.steps);
+  out.metric("h801_pwm_commits_total", "counter", "Duty changes applied to the outputs");
+  out.value("h801_pwm_commits_total", s_metrics.pwmCommits());
+
+  // Loop
+  out.histogram("h801_loop_tick_seconds", "Time of the loop ticks", s_scheduler.tickTime());
+
+  // MQTT
+  out.metric("h801_mqtt_connected", "gauge", "Connected to the MQTT server");
+  out.value("h801_mqtt_connected", s_mqttClient.isConnected() ? 1 : 0);
+  out.metric("h801_mqtt_reconnects_total", "counter", "Reconnect attempts after the connection was lost");
+  out.value("h801_mqtt_reconnects_total", s_mqttClient.reconnects());
+  out.metric("h801_mqtt_connect_failures_total", "counter", "Failed connects");
+  out.value("h801_mqtt_connect_failures_total", s_mqttClient.connectFailures());
+  out.metric("h801_mqtt_publish_failures_total", "counter", "Messages the client didn't send");
+  out.value("h801_mqtt_publish_failures_total", s_mqttClient.publishFailures());
+
+  // HTTP
+  out.metric("h801_http_requests_total", "counter", "Handled HTTP requests");
+  out.value("h801_http_requests_total", s_httpServer.requests());
+  out.histogram("h801_http_request_seconds", "Time from request line to the end of the response", s_httpServer.latency());
+
+  // Heap
+  out.metric("h801_heap_free_bytes", "gauge", "Free heap");
+  out.value("h801_heap_free_bytes", ESP.getFreeHeap());
+  out.metric("h801_heap_fragmentation_percent", "gauge", "Heap fragmentation");
+  out.value("h801_heap_fragmentation_percent", ESP.getHeapFragmentation());
+
+  out.metric("h801_uptime_seconds", "gauge", "Time since boot");
+  out.value("h801_uptime_seconds", millis() / 1000);
+
+  if (out.isTruncated())
+    Serial1.println("Metrics: Output truncated");
 
   return buffer;
 }
 
 
+/**
+ * Retreives stored scenes
+ * @return JSON string with scene table
+ */
+const char *funcGetScenes(void) {
+  StaticJsonBuffer<1536> *jsonBuffer = s_scratch.jsonBuffer<1536>();
+  if (!jsonBuffer)
+    return NULL;
+
+  JsonArray& root = jsonBuffer->createArray();
+
+  for (unsigned long id = 0; id < H801_SCENE_MAX; id++) {
+    const H801_Scene *scene = s_scenes.get(id);
+    if (!scene)
+      continue;
+
+    JsonObject& jsonScene = root.createNestedObject();
+    jsonScene["id"]       = id;
+    jsonScene["name"]     = scene->name;
+    jsonScene["duration"] = scene->duration;
+
+    for (size_t i = 0; i < countof(LedStatus); i++) {
+      if (scene->mask & (1 << i))
+        jsonScene[LedStatus[i].get_ID().c_str()] = scene->bri[i];
+    }
+  }
+
+  // Serialize JSON
+  return s_scratch.printTo(root);
+}
+
+
 /**
  * Retreives current LED status
  * @return JSON string with current status
@@ -750,6 +2052,29 @@ const char *funcGetStatus(void) {
 }
 
 
+/**
+ * Retreives the values currently on the outputs, differs from the
+ * status while fading
+ * @return JSON string with current values
+ */
+const char *funcGetCurrent(void) {
+  StaticJsonBuffer<256> *jsonBuffer = s_scratch.jsonBuffer<256>();
+  if (!jsonBuffer)
+    return NULL;
+
+  JsonObject& root = jsonBuffer->createObject();
+
+  JsonObject& jsonCurrent = root.createNestedObject("current");
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    jsonCurrent[LedStatus[i].get_ID()] = LedStatus[i].get_CurrBri();
+  }
+  root["fading"] = s_isFading;
+
+  // Serialize JSON
+  return s_scratch.printTo(root);
+}
+
+
 /**
  * Callback used to update current LED status
  * @param  eventSource  Label of which system updated status
@@ -767,41 +2092,105 @@ const char *funcSetStatus(const char* eventSource, JsonObject& json) {
   Serial1.println("");
 
 
+  H801_Command cmd;
+  memset(&cmd, 0, sizeof(cmd));
+
   // Check if duration is specified
-  unsigned long fadeTime = 0;
   if (json.containsKey("duration")) {
-    const JsonVariant &fadeValue = json["duration"];
-
-    // Number value
-    if (fadeValue.is<long>())
-      fadeTime = (unsigned long)constrain(fadeValue.as<long>(), 0, 100000000);
-    //String value
-    else if (fadeValue.is<char*>() && stringToUnsignedLong(fadeValue.as<char*>(), &fadeTime))
-      fadeTime = (unsigned long)constrain(fadeTime, 0, 100000000);
-    else
-      fadeTime = 0;
+    jsonToDuration(json["duration"], &cmd.fadeTime);
   }
 
-  // Update light from json string
-  if (jsonToLight(json, fadeTime)) {
-    s_isFading = true;
-#ifdef NEW_PWM
-    pwm_start();
-#endif//NEW_PWM
+  // Correlation id echoed in the fade_done event
+  if (json.containsKey("id")) {
+    const JsonVariant &idValue = json["id"];
+
+    if (idValue.is<char*>())
+      strlcpy(cmd.id, idValue.as<char*>(), countof(cmd.id));
+    else if (idValue.is<long>())
+      snprintf(cmd.id, countof(cmd.id), "%ld", idValue.as<long>());
   }
 
-  // Get current config
-  const char*jsonString = statusToJSONString(eventSource, fadeTime);
+  // Recall stored scene, channel values in the command override the scene
+  if (json.containsKey("scene")) {
+    sceneToCommand(json["scene"], cmd);
+  }
 
-  Serial1.print("State: ");
-  Serial1.println(jsonString);
+  // Light values
+  jsonToCommand(json, cmd);
 
-  // If changed, publish state
-  if (s_isFading) {
-    s_mqttClient.publishConfigUpdate(jsonString);
+  // Wait for synchronized time, otherwise merge into inbox
+  // that is applied at the end of this loop tick
+  if (!json.containsKey("at") || !scheduleCommand(eventSource, json["at"], cmd)) {
+    inboxPush(eventSource, cmd);
+  }
+
+  // Return the pending state, publishing is done by the commit
+  return statusToJSONString(eventSource, cmd.fadeTime);
+}
+
+
+/**
+ * Callback used when a time beacon is received
+ * @param serverTime Time in beacon (ms)
+ * @param localTime  millis() when beacon was received
+ */
+void funcSetTime(double serverTime, unsigned long localTime) {
+  s_timeSync.addSample(serverTime, localTime);
+}
+
+
+/**
+ * Callback used by realtime inputs, values are applied directly
+ * without fading and no state is published
+ * @param eventSource Label of which system sent the values
+ * @param values      Brightness for each channel in LedStatus order
+ * @param count       Number of values
+ */
+void funcSetChannels(const char *eventSource, const uint8_t *values, size_t count) {
+  bool isChanged = false;
+  s_metrics.countCommand(eventSource);
+
+  for (size_t i = 0; i < countof(LedStatus) && i < count; i++) {
+    // New value overrides ongoing fade
+    if (LedStatus[i].is_Fading())
+      fadeTrackSupersede(1 << i);
+
+    isChanged = LedStatus[i].set_Bri(values[i], 0) || isChanged;
+  }
+
+  if (!isChanged)
+    return;
+
+  pwmCommit();
+
+  s_webSocket.notifyState();
+}
+
+
+/**
+ * Callback used when the group leader sends new targets,
+ * merged into the inbox that is applied at the end of this loop tick
+ * @param eventSource Label of which system sent the targets
+ * @param mask        Channels set
+ * @param bri         Target brightness for each channel
+ * @param fadeSteps   Number of steps to fade over for each channel
+ * @param fadeTime    Command duration in ms
+ */
+void funcSetTargets(const char *eventSource, uint32_t mask, const uint8_t *bri, const uint32_t *fadeSteps, unsigned long fadeTime) {
+  H801_Command cmd;
+  memset(&cmd, 0, sizeof(cmd));
+
+  cmd.fadeTime = fadeTime;
+  for (size_t i = 0; i < countof(LedStatus); i++) {
+    if (!(mask & (1 << i)))
+      continue;
+
+    cmd.bri[i]       = bri[i];
+    cmd.fadeSteps[i] = fadeSteps[i];
+    cmd.mask |= (1 << i);
   }
 
-  return jsonString;
+  inboxPush(eventSource, cmd);
 }
 
 
@@ -824,25 +2213,43 @@ const char *funcSetConfig(const char* eventSource, JsonObject& json) {
   // Print event source
   Serial1.printf("Config: Update from %s\n", eventSource);
 
+  // Store or remove scenes
+  JsonArray& jsonScenes = json["scenes"];
+  if (jsonScenes.success()) {
+    bool isModified = false;
+    for (JsonVariant& jsonValue : jsonScenes) {
+      JsonObject& jsonScene = jsonValue.as<JsonObject&>();
+      if (jsonScene.success())
+        isModified = jsonToScene(jsonScene) || isModified;
+    }
+
+    if (isModified) {
+      s_scenes.save();
+      infoInvalidate(true);
+    }
+  }
+
   // Set config, returns true if changed
   if (s_config.set(json)) {
-    // Save config
+    // Save config, written to flash by the loop
     s_config.save();
+    infoInvalidate(false);
     
     // Update button fading
-    LedButtonFade[0] = s_config.m_ButtonFade.R ? &LedStatus[0] : NULL;
-    LedButtonFade[1] = s_config.m_ButtonFade.G ? &LedStatus[1] : NULL;
-    LedButtonFade[2] = s_config.m_ButtonFade.B ? &LedStatus[2] : NULL;
-
-#if HWMODEL==HWMODEL_H801
-    LedButtonFade[3] = s_config.m_ButtonFade.W1 ? &LedStatus[3] : NULL;
-    LedButtonFade[4] = s_config.m_ButtonFade.W2 ? &LedStatus[4] : NULL;
-#elif HWMODEL==HWMODEL_MAGIC_RGBW
-    LedButtonFade[3] = s_config.m_ButtonFade.W ? &LedStatus[3] : NULL;
-#endif
+    buttonFadeSetup();
 
     // Re-setup mqtt client with new info
     s_mqttClient.setup();
+    s_scheduler.wake("mqtt_reconnect");
+
+    // Re-setup idle sleep
+    s_power.setup();
+
+    // Re-setup DMX input
+    s_dmx.setup();
+
+    // Re-setup group mirroring
+    s_mirror.setup();
   }
   else {
     Serial1.println("Config: No changes");
@@ -878,6 +2285,7 @@ void funcResetConfirmTimeout() {
 
   // Clear config
   s_config.remove();
+  s_scenes.remove();
 
   // Create new wifimanager and tell it to clear config
   WiFiManager wifiManager;
@@ -0,0 +1,202 @@
+
+#ifndef HWMODEL
+# error Missing HWMODEL define
+#endif
+
+#define HWMODEL_H801        1
+#define HWMODEL_MAGIC_RGB   2
+#define HWMODEL_MAGIC_RGBW  3
+
+
+/**
+ * Output channel of a board
+ */
+typedef struct tagH801_BoardChannel {
+  const char *id;     // Name used in JSON, MQTT and DMX order
+  uint8_t     gpio;
+} H801_BoardChannel;
+
+
+/**
+ * H801, 5 channels with red and green status LEDs
+ */
+struct H801_BoardH801 {
+  static constexpr const char *name = "H801";
+  static constexpr bool hasStatusLeds = true;
+  static constexpr H801_BoardChannel channels[] = {
+    { "R",  15 },
+    { "G",  13 },
+    { "B",  12 },
+    { "W1", 14 },
+    { "W2",  4 },
+  };
+};
+constexpr const char *H801_BoardH801::name;
+constexpr H801_BoardChannel H801_BoardH801::channels[];
+
+
+/**
+ * Magic Home RGB controller
+ */
+struct H801_BoardMagicRGB {
+  static constexpr const char *name = "Magic RGB";
+  static constexpr bool hasStatusLeds = false;
+  static constexpr H801_BoardChannel channels[] = {
+    { "R",   5 },
+    { "G",  14 },
+    { "B",  12 },
+  };
+};
+constexpr const char *H801_BoardMagicRGB::name;
+constexpr H801_BoardChannel H801_BoardMagicRGB::channels[];
+
+
+/**
+ * Magic Home RGBW controller
+ */
+struct H801_BoardMagicRGBW {
+  static constexpr const char *name = "Magic RGBW";
+  static constexpr bool hasStatusLeds = false;
+  static constexpr H801_BoardChannel channels[] = {
+    { "R",   5 },
+    { "G",  14 },
+    { "B",  12 },
+    { "W",  13 },
+  };
+};
+constexpr const char *H801_BoardMagicRGBW::name;
+constexpr H801_BoardChannel H801_BoardMagicRGBW::channels[];
+
+
+// Board built for, a new board only needs a descriptor and a HWMODEL value
+#if   HWMODEL==HWMODEL_H801
+typedef H801_BoardH801 H801_Board;
+#elif HWMODEL==HWMODEL_MAGIC_RGB
+typedef H801_BoardMagicRGB H801_Board;
+#elif HWMODEL==HWMODEL_MAGIC_RGBW
+typedef H801_BoardMagicRGBW H801_Board;
+#else
+# error Unknown HWMODEL
+#endif
+
+// Number of output channels
+#define H801_BOARD_CHANNELS countof(H801_Board::channels)
+
+
+#ifdef ARDUINO
+/**
+ * PWM using analogWrite of the Arduino core
+ */
+struct H801_PWMAnalog {
+  // Off and full duty are plain pin levels that hold during light sleep
+  static constexpr bool canLightSleep = true;
+
+  /**
+   * Setup outputs, pins are already outputs
+   * @param channels Board channels
+   * @param count    Number of channels
+   * @param period   Max duty
+   */
+  static void begin(const H801_BoardChannel *channels, size_t count, uint32_t period) {
+  }
+
+  /**
+   * Set duty of channel
+   * @param index Channel index
+   * @param gpio  Channel pin
+   * @param duty  New duty
+   */
+  static void setDuty(uint8_t index, uint8_t gpio, uint32_t duty) {
+    analogWrite(gpio, duty);
+  }
+
+  /**
+   * Apply changed duties, analogWrite applies them directly
+   */
+  static void commit() {
+  }
+};
+
+
+#ifdef NEW_PWM
+/**
+ * PWM using pwm.c, all channels share one timer and
+ * changed duties are applied together by commit()
+ */
+struct H801_PWMNew {
+  // Timer keeps running at off and full duty, stops in light sleep
+  static constexpr bool canLightSleep = false;
+
+  static void begin(const H801_BoardChannel *channels, size_t count, uint32_t period) {
+    static const uint32_t muxTable[] = {
+      PERIPHS_IO_MUX_GPIO0_U,    PERIPHS_IO_MUX_U0TXD_U,    PERIPHS_IO_MUX_GPIO2_U,    PERIPHS_IO_MUX_U0RXD_U,
+      PERIPHS_IO_MUX_GPIO4_U,    PERIPHS_IO_MUX_GPIO5_U,    PERIPHS_IO_MUX_SD_CLK_U,   PERIPHS_IO_MUX_SD_DATA0_U,
+      PERIPHS_IO_MUX_SD_DATA1_U, PERIPHS_IO_MUX_SD_DATA2_U, PERIPHS_IO_MUX_SD_DATA3_U, PERIPHS_IO_MUX_SD_CMD_U,
+      PERIPHS_IO_MUX_MTDI_U,     PERIPHS_IO_MUX_MTCK_U,     PERIPHS_IO_MUX_MTMS_U,     PERIPHS_IO_MUX_MTDO_U,
+    };
+    static const uint32_t funcTable[] = {
+      FUNC_GPIO0,  FUNC_GPIO1,  FUNC_GPIO2,  FUNC_GPIO3,  FUNC_GPIO4,  FUNC_GPIO5,  FUNC_GPIO6,  FUNC_GPIO7,
+      FUNC_GPIO8,  FUNC_GPIO9,  FUNC_GPIO10, FUNC_GPIO11, FUNC_GPIO12, FUNC_GPIO13, FUNC_GPIO14, FUNC_GPIO15,
+    };
+
+    uint32_t initval[H801_BOARD_CHANNELS] = {0};
+    uint32_t ioInfo[H801_BOARD_CHANNELS][3];
+    for (size_t i = 0; i < count; i++) {
+      ioInfo[i][0] = muxTable[channels[i].gpio];
+      ioInfo[i][1] = funcTable[channels[i].gpio];
+      ioInfo[i][2] = channels[i].gpio;
+    }
+
+    pwm_init(period, initval, count, ioInfo);
+    pwm_start();
+  }
+
+  static void setDuty(uint8_t index, uint8_t gpio, uint32_t duty) {
+    pwm_set_duty(duty, index);
+  }
+
+  static void commit() {
+    pwm_start();
+  }
+};
+#endif//NEW_PWM
+#endif//ARDUINO
+
+
+/**
+ * PWM that only keeps the duties, used when building for a host
+ */
+struct H801_PWMMock {
+  static constexpr bool canLightSleep = true;
+
+  static uint32_t duty[H801_BOARD_CHANNELS];
+  static uint32_t writes;
+  static uint32_t commits;
+
+  static void begin(const H801_BoardChannel *channels, size_t count, uint32_t period) {
+  }
+
+  static void setDuty(uint8_t index, uint8_t gpio, uint32_t value) {
+    duty[index] = value;
+    writes++;
+  }
+
+  static void commit() {
+    commits++;
+  }
+};
+uint32_t H801_PWMMock::duty[H801_BOARD_CHANNELS];
+uint32_t H801_PWMMock::writes;
+uint32_t H801_PWMMock::commits;
+
+
+// PWM driver built for
+#if defined(H801_PWM_MOCK)
+typedef H801_PWMMock H801_PWM;
+#elif !defined(ARDUINO)
+# error Host builds need H801_PWM_MOCK
+#elif defined(NEW_PWM)
+typedef H801_PWMNew H801_PWM;
+#else
+typedef H801_PWMAnalog H801_PWM;
+#endif
@@ -0,0 +1,356 @@
+
+// Button edges kept until the loop decodes them, power of two
+#define H801_BUTTON_EDGES 16
+
+// Time the level has to be stable to count
+#define H801_BUTTON_DEBOUNCE 30
+
+// Press this long is a long press
+#define H801_BUTTON_LONG_PRESS 700
+
+// Max time between the clicks of a double or triple click
+#define H801_BUTTON_CLICK_GAP 400
+
+// Gestures decoded but not yet handled by the loop
+#define H801_BUTTON_EVENTS 8
+
+
+/**
+ * Button edge, timestamped by the interrupt
+ */
+typedef struct tagH801_ButtonEdge {
+  uint32_t time;      // millis()
+  bool     isPressed;
+} H801_ButtonEdge;
+
+
+/**
+ * H801 Button, an edge interrupt timestamps the transitions and the loop
+ * decodes them into gestures. Durations come from the timestamps, so a
+ * slow loop only delays a gesture and doesn't change it
+ */
+class H801_Button {
+  public:
+    typedef enum {
+      EVENT_NONE,
+      EVENT_CLICK,
+      EVENT_DOUBLE_CLICK,
+      EVENT_TRIPLE_CLICK,
+      EVENT_LONG_PRESS,     // Held for H801_BUTTON_LONG_PRESS, still held
+      EVENT_HOLD_RELEASE,   // Released after a long press
+    } Event;
+
+  private:
+    // Only one button, the interrupt needs a static instance
+    static H801_Button *s_instance;
+
+    uint8_t m_pin;
+
+    // Written by the interrupt, read by the loop. All volatile so the
+    // entry is written before the head that publishes it
+    volatile H801_ButtonEdge m_edges[H801_BUTTON_EDGES];
+    volatile uint32_t m_edgeHead;
+    volatile uint32_t m_edgeTail;
+    volatile uint32_t m_edgeDropped;
+
+    // Level wakeup from light sleep replaces the edge interrupt
+    volatile bool m_isWakeupArmed;
+
+    // Last raw edge, counts when stable for H801_BUTTON_DEBOUNCE
+    bool m_rawPressed;
+    uint32_t m_rawTime;
+
+    // Debounced state
+    bool m_isPressed;
+    bool m_isHold;
+    bool m_isIgnored;       // Held since boot, release is ignored
+    uint32_t m_pressTime;
+    uint32_t m_releaseTime;
+    uint8_t m_clicks;
+
+    // Decoded gestures
+    Event m_events[H801_BUTTON_EVENTS];
+    uint8_t m_numEvents;
+
+    // Counters
+    struct {
+      uint32_t edges;
+      uint32_t gestures;
+    } m_stats;
+
+
+    /**
+     * Set the pin back to interrupt on both edges, without wakeup
+     * @param pin GPIO pin
+     */
+    static inline void IRAM_ATTR setEdgeInterrupt(uint8_t pin) {
+      GPC(pin) = (GPC(pin) & ~((0xF << GPCI) | (1 << GPCWE))) | (CHANGE << GPCI);
+    }
+
+
+    /**
+     * Pin change interrupt
+     */
+    static void IRAM_ATTR isr() {
+      H801_Button *button = s_instance;
+
+      // Woken by the press, the low level would fire again until released
+      if (button->m_isWakeupArmed) {
+        button->m_isWakeupArmed = false;
+        setEdgeInterrupt(button->m_pin);
+      }
+
+      uint32_t head = button->m_edgeHead;
+
+      if (head - button->m_edgeTail >= H801_BUTTON_EDGES) {
+        button->m_edgeDropped++;
+        return;
+      }
+
+      volatile H801_ButtonEdge &edge = button->m_edges[head & (H801_BUTTON_EDGES - 1)];
+      edge.time = millis();
+      edge.isPressed = !digitalRead(button->m_pin);
+      button->m_edgeHead = head + 1;
+    }
+
+
+    /**
+     * Queue decoded gesture
+     * @param event Gesture
+     */
+    void pushEvent(Event event) {
+      if (m_numEvents >= H801_BUTTON_EVENTS)
+        return;
+
+      m_events[m_numEvents++] = event;
+      m_stats.gestures++;
+    }
+
+
+    /**
+     * Take oldest decoded gesture
+     * @return Gesture, EVENT_NONE if none
+     */
+    Event popEvent() {
+      if (!m_numEvents)
+        return EVENT_NONE;
+
+      Event event = m_events[0];
+      memmove(m_events, m_events + 1, (--m_numEvents) * sizeof(m_events[0]));
+      return event;
+    }
+
+
+    /**
+     * Queue gesture of the pending clicks
+     */
+    void flushClicks() {
+      if (!m_clicks)
+        return;
+
+      this->pushEvent(m_clicks == 1 ? EVENT_CLICK : m_clicks == 2 ? EVENT_DOUBLE_CLICK : EVENT_TRIPLE_CLICK);
+      m_clicks = 0;
+    }
+
+
+    /**
+     * Debounced level changed
+     * @param isPressed New level
+     * @param time      Time of the edge
+     */
+    void setPressed(bool isPressed, uint32_t time) {
+      m_isPressed = isPressed;
+
+      if (isPressed) {
+        if (time - m_releaseTime >= H801_BUTTON_CLICK_GAP)
+          this->flushClicks();
+
+        m_pressTime = time;
+        return;
+      }
+
+      if (m_isIgnored) {
+        m_isIgnored = false;
+        m_isHold = false;
+        return;
+      }
+
+      // Long press that the loop didn't see while held
+      if (!m_isHold && time - m_pressTime >= H801_BUTTON_LONG_PRESS) {
+        this->flushClicks();
+        this->pushEvent(EVENT_LONG_PRESS);
+        m_isHold = true;
+      }
+
+      if (m_isHold) {
+        m_isHold = false;
+        this->pushEvent(EVENT_HOLD_RELEASE);
+        return;
+      }
+
+      m_releaseTime = time;
+      if (++m_clicks >= 3)
+        this->flushClicks();
+    }
+
+
+  public:
+    /**
+     * H801 Button
+     * @param pin Button pin, low when pressed
+     */
+    H801_Button(uint8_t pin):
+        m_pin(pin),
+        m_edgeHead(0),
+        m_edgeTail(0),
+        m_edgeDropped(0),
+        m_isWakeupArmed(false),
+        m_rawPressed(false),
+        m_rawTime(0),
+        m_isPressed(false),
+        m_isHold(false),
+        m_isIgnored(false),
+        m_pressTime(0),
+        m_releaseTime(0),
+        m_clicks(0),
+        m_numEvents(0) {
+      memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+
+    /**
+     * Setup pin and interrupt
+     */
+    void begin() {
+      pinMode(m_pin, INPUT);
+
+      // Held during boot, wait for the release
+      m_rawPressed = m_isPressed = m_isIgnored = !digitalRead(m_pin);
+      m_rawTime = millis();
+
+      s_instance = this;
+      attachInterrupt(digitalPinToInterrupt(m_pin), isr, CHANGE);
+    }
+
+
+    /**
+     * Let a press wake the CPU from light sleep, until disarmWakeup().
+     * The wakeup needs a level interrupt, the first press switches the
+     * pin back to edges so the interrupt fires once
+     */
+    void armWakeup() {
+      noInterrupts();
+      m_isWakeupArmed = true;
+      gpio_pin_wakeup_enable(GPIO_ID_PIN(m_pin), GPIO_PIN_INTR_LOLEVEL);
+      interrupts();
+    }
+
+
+    /**
+     * Back to edge interrupts after light sleep
+     */
+    void disarmWakeup() {
+      noInterrupts();
+      if (m_isWakeupArmed) {
+        m_isWakeupArmed = false;
+        setEdgeInterrupt(m_pin);
+      }
+      interrupts();
+    }
+
+
+    /**
+     * Is the button held after a long press
+     */
+    bool isHeld() {
+      return m_isHold && m_isPressed;
+    }
+
+
+    /**
+     * Released with no edges or clicks waiting to be decoded
+     */
+    bool isIdle() {
+      return !m_isPressed && !m_clicks && !m_numEvents && m_edgeTail == m_edgeHead;
+    }
+
+
+    /**
+     * Decode button edges, call until it returns EVENT_NONE
+     * @param  time current millis time
+     * @return Next gesture
+     */
+    Event loop(unsigned long time) {
+      // Gestures from the previous call
+      if (m_numEvents)
+        return this->popEvent();
+
+      // Edges in the order they happened, an edge adds at most
+      // three gestures and the checks below two more
+      while (m_edgeTail != m_edgeHead && m_numEvents + 5 <= H801_BUTTON_EVENTS) {
+        // Entry is read before the tail frees it for the interrupt
+        const volatile H801_ButtonEdge &edge = m_edges[m_edgeTail & (H801_BUTTON_EDGES - 1)];
+        uint32_t edgeTime = edge.time;
+        bool edgeIsPressed = edge.isPressed;
+
+        // Previous level was stable until this edge
+        if (m_rawPressed != m_isPressed && edgeTime - m_rawTime >= H801_BUTTON_DEBOUNCE)
+          this->setPressed(m_rawPressed, m_rawTime);
+
+        m_rawPressed = edgeIsPressed;
+        m_rawTime = edgeTime;
+        m_edgeTail = m_edgeTail + 1;
+        m_stats.edges++;
+      }
+
+      if (m_edgeTail == m_edgeHead) {
+        // Current level is stable
+        if (m_rawPressed != m_isPressed && time - m_rawTime >= H801_BUTTON_DEBOUNCE)
+          this->setPressed(m_rawPressed, m_rawTime);
+
+        // Still held
+        if (m_isPressed && !m_isHold && !m_isIgnored && time - m_pressTime >= H801_BUTTON_LONG_PRESS) {
+          this->flushClicks();
+          m_isHold = true;
+          this->pushEvent(EVENT_LONG_PRESS);
+        }
+
+        // No further click
+        if (!m_isPressed && time - m_releaseTime >= H801_BUTTON_CLICK_GAP)
+          this->flushClicks();
+      }
+
+      return this->popEvent();
+    }
+
+
+    /**
+     * Name of gesture
+     * @param  event Gesture
+     * @return Name used in config and MQTT
+     */
+    static const char* eventName(Event event) {
+      switch (event) {
+        case EVENT_CLICK:        return "click";
+        case EVENT_DOUBLE_CLICK: return "double_click";
+        case EVENT_TRIPLE_CLICK: return "triple_click";
+        case EVENT_LONG_PRESS:   return "long_press";
+        case EVENT_HOLD_RELEASE: return "hold_release";
+        default:                 return "none";
+      }
+    }
+
+
+    /**
+     * Add button information to JSON object
+     * @param root JSON object
+     */
+    void appendInfo(JsonObject& root) {
+      JsonObject& jsonButton = root.createNestedObject("button");
+      jsonButton["edges"]    = m_stats.edges;
+      jsonButton["dropped"]  = m_edgeDropped;
+      jsonButton["gestures"] = m_stats.gestures;
+    }
+};
+
+H801_Button *H801_Button::s_instance = NULL;
@@ -1,42 +1,198 @@
 
-// Configuration file
-#define H801_CONFIG_FILE "/config.json"
+// Binary config record
+#define H801_CONFIG_MAGIC   0x46433848 // "H8CF"
+#define H801_CONFIG_VERSION 2
+
+// Time to wait for more changes before writing to flash
+#define H801_CONFIG_WRITE_DELAY 1000
+
+// Two config sectors (A/B), reserved by the linker scripts in ld/
+extern "C" uint32_t _H801_CONFIG_start;
+#define H801_CONFIG_SECTOR (((uintptr_t)&_H801_CONFIG_start - 0x40200000) / SPI_FLASH_SEC_SIZE)
+
+
+/**
+ * Last WiFi connection, used to connect without scanning and DHCP
+ */
+typedef struct tagH801_WiFiCache {
+  uint8_t  bssid[6];
+  uint8_t  channel;      // 0 if not cached
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+} H801_WiFiCache;
+
+
+/**
+ * Configuration values, set through JSON by the field table below.
+ * Stored as is in the flash record, so new values are appended
+ */
+typedef struct tagH801_ConfigValues {
+  char m_name[128];
+
+  // MQTT config
+  struct {
+    char server[128];
+    char port[6];
+
+    char alias[128];
+
+    char login[128];
+    char passw[128];
+  } m_MQTT;
+
+  // Channels faded by the button, in board channel order
+  bool m_ButtonFade[H801_BOARD_CHANNELS];
+
+  // Realtime DMX input
+  struct {
+    char     protocol[8];  // "e131", "artnet" or empty if disabled
+    uint16_t universe;
+    uint16_t address;      // DMX start address of first channel, 1-512
+  } m_DMX;
+
+  // Group mirroring
+  struct {
+    char     role[10];     // "leader", "follower" or empty if disabled
+    uint16_t group;        // Group id, 1-255
+  } m_Mirror;
+
+  // Button gesture actions, "none", "mqtt", "fade", "scene:<id>" or empty for the default
+  struct {
+    char click[12];
+    char doubleClick[12];
+    char tripleClick[12];
+    char longPress[12];
+  } m_Button;
+
+  // Idle power saving
+  struct {
+    char sleep[8];         // "modem", "light" or empty if disabled
+  } m_Power;
+
+  // Metrics published to MQTT
+  struct {
+    uint16_t interval;     // Seconds between publishes, 0 if disabled
+  } m_Metrics;
+} H801_ConfigValues;
+
+
+/**
+ * Configuration as stored in flash, written to the config sector that
+ * doesn't hold the newest valid record so a failed write keeps the old one.
+ * Values appended after a record was written keep their defaults
+ */
+typedef struct tagH801_ConfigRecord {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;          // Size of data
+  uint32_t crc;           // CRC32 of sequence and data
+  uint32_t sequence;      // Incremented on every write, newest record wins
+
+  struct {
+    H801_WiFiCache    wifi;
+    H801_ConfigValues values;
+  } data;
+} H801_ConfigRecord;
+
+// Flash is read and written in 32 bit words
+#define H801_CONFIG_RECORD_WORDS ((sizeof(H801_ConfigRecord) + 3) / 4)
+
+
+// Config field types
+typedef enum {
+  H801_CONFIG_STRING,
+  H801_CONFIG_SECRET,    // String replaced by H801_CONFIG_HIDDEN when hidden
+  H801_CONFIG_BOOL,
+  H801_CONFIG_UINT16,
+  H801_CONFIG_CHANNELS,  // Bool for each board channel, named by channel id
+} H801_ConfigType;
+
+// Value shown for a hidden secret, ignored when set
+#define H801_CONFIG_HIDDEN "*********"
+
+/**
+ * Config field descriptor, one for each JSON value
+ */
+typedef struct tagH801_ConfigField {
+  const char *group;     // Nested JSON object, NULL for the root
+  const char *name;
+  uint16_t    offset;    // Offset in H801_ConfigValues
+  uint8_t     type;      // H801_ConfigType
+  uint8_t     size;      // Size of string buffer
+  uint16_t    minValue;  // Range of number
+  uint16_t    maxValue;
+  uint16_t    defValue;  // Default of bool or number, strings are empty
+  const char *choices;   // Allowed strings separated by '|', NULL for any. A trailing '*' matches any suffix
+} H801_ConfigField;
+
+#define H801_CONFIG_MEMBER_SIZE(member) sizeof(((H801_ConfigValues*)0)->member)
+
+#define H801_CONFIG_STRING_FIELD(group, name, member, type, choices) \
+  { group, name, offsetof(H801_ConfigValues, member), type, H801_CONFIG_MEMBER_SIZE(member), 0, 0, 0, choices }
+
+#define H801_CONFIG_BOOL_FIELD(group, name, member, defValue) \
+  { group, name, offsetof(H801_ConfigValues, member), H801_CONFIG_BOOL, 0, 0, 1, defValue, NULL }
+
+#define H801_CONFIG_CHANNELS_FIELD(group, member, defValue) \
+  { group, NULL, offsetof(H801_ConfigValues, member), H801_CONFIG_CHANNELS, H801_BOARD_CHANNELS, 0, 1, defValue, NULL }
+
+#define H801_CONFIG_UINT16_FIELD(group, name, member, minValue, maxValue, defValue) \
+  { group, name, offsetof(H801_ConfigValues, member), H801_CONFIG_UINT16, 0, minValue, maxValue, defValue, NULL }
+
+/**
+ * All config fields, fields of the same group are kept together.
+ * Drives parsing, serialization, defaults and change detection
+ */
+static constexpr H801_ConfigField s_configFields[] PROGMEM = {
+  H801_CONFIG_STRING_FIELD(NULL,          "name",     m_name,          H801_CONFIG_STRING, NULL),
+
+  H801_CONFIG_STRING_FIELD("mqtt",        "server",   m_MQTT.server,   H801_CONFIG_STRING, NULL),
+  H801_CONFIG_STRING_FIELD("mqtt",        "port",     m_MQTT.port,     H801_CONFIG_STRING, NULL),
+  H801_CONFIG_STRING_FIELD("mqtt",        "alias",    m_MQTT.alias,    H801_CONFIG_STRING, NULL),
+  H801_CONFIG_STRING_FIELD("mqtt",        "login",    m_MQTT.login,    H801_CONFIG_STRING, NULL),
+  H801_CONFIG_STRING_FIELD("mqtt",        "passw",    m_MQTT.passw,    H801_CONFIG_SECRET, NULL),
+
+  H801_CONFIG_CHANNELS_FIELD("button_fade",           m_ButtonFade,    true),
+
+  H801_CONFIG_STRING_FIELD("dmx",         "protocol", m_DMX.protocol,  H801_CONFIG_STRING, "|e131|artnet"),
+  H801_CONFIG_UINT16_FIELD("dmx",         "universe", m_DMX.universe,  0, 63999, 1),
+  H801_CONFIG_UINT16_FIELD("dmx",         "address",  m_DMX.address,   1, 512,   1),
+
+  H801_CONFIG_STRING_FIELD("mirror",      "role",     m_Mirror.role,   H801_CONFIG_STRING, "|leader|follower"),
+  H801_CONFIG_UINT16_FIELD("mirror",      "group",    m_Mirror.group,  1, 255,   1),
+
+  H801_CONFIG_STRING_FIELD("button",      "click",        m_Button.click,       H801_CONFIG_STRING, "|none|mqtt|scene:*"),
+  H801_CONFIG_STRING_FIELD("button",      "double_click", m_Button.doubleClick, H801_CONFIG_STRING, "|none|mqtt|scene:*"),
+  H801_CONFIG_STRING_FIELD("button",      "triple_click", m_Button.tripleClick, H801_CONFIG_STRING, "|none|mqtt|scene:*"),
+  H801_CONFIG_STRING_FIELD("button",      "long_press",   m_Button.longPress,   H801_CONFIG_STRING, "|none|mqtt|fade|scene:*"),
+
+  H801_CONFIG_STRING_FIELD("power",       "sleep",    m_Power.sleep,   H801_CONFIG_STRING, "|modem|light"),
+
+  H801_CONFIG_UINT16_FIELD("metrics",     "interval", m_Metrics.interval, 0, 3600, 0),
+};
 
 
 /**
  * H801 Configuration
  */
-class H801_Config {
+class H801_Config : public H801_ConfigValues {
+  private:
+    H801_Scratch &m_scratch;
+
+    // Sector holding the newest valid record, -1 if none
+    int m_slot;
+    uint32_t m_sequence;
+
+    // Deferred write
+    bool m_isDirty;
+    bool m_isErased;
+    unsigned long m_changeTime;
+
   public:
-    StaticJsonBuffer<1024> m_jsonBuffer;
-
-    char m_name[128];
-
-    // MQTT config
-    struct {
-      char server[128];
-      char port[6];
-
-      char alias[128];
-
-      char login[128];
-      char passw[128];
-    } m_MQTT;
-
-    struct {
-      bool R;
-      bool G;
-      bool B;
-#if HWMODEL==HWMODEL_H801
-      bool W1;
-      bool W2;
-#elif HWMODEL==HWMODEL_MAGIC_RGBW
-      bool W;
-#elif HWMODEL==HWMODEL_MAGIC_RGB
-#else
-# error Unknown model
-#endif
-    } m_ButtonFade;
+    // Last WiFi connection, not part of the JSON config
+    H801_WiFiCache m_WiFiCache;
 
   private:
     /**
@@ -97,7 +253,7 @@ class H801_Config {
         return false;
 
       // Dummy password
-      if (!strcmp(tmp, "*********"))
+      if (!strcmp(tmp, H801_CONFIG_HIDDEN))
         return false;
 
       // And update the value
@@ -146,16 +302,300 @@ class H801_Config {
       else
         return false;
       
-      return *dest == oldValue;
+      return *dest != oldValue;
+    }
+
+    /**
+     * Copy json variable to integer value if valid and within range
+     * @param  json     JSON value, number or string
+     * @param  dest     dest variable
+     * @param  minValue Min allowed value
+     * @param  maxValue Max allowed value
+     * @return false if failure or unchanged
+     */
+    bool jsonToUInt16Prop(const JsonVariant &json, uint16_t *dest, uint16_t minValue, uint16_t maxValue) {
+      // Check for valid json object
+      if (!json.success()) {
+        return false;
+      }
+
+      unsigned long value;
+
+      // Number
+      if (json.is<signed long>()) {
+        if (json.as<signed long>() < 0)
+          return false;
+        value = (unsigned long)json.as<signed long>();
+      }
+
+      // String
+      else if (!json.is<const char*>() || !stringToUnsignedLong(json.as<const char*>(), &value))
+        return false;
+
+      if (value < minValue || value > maxValue)
+        return false;
+
+      // Ignore same value
+      if (*dest == value)
+        return false;
+
+      *dest = (uint16_t)value;
+      return true;
+    }
+
+
+    /**
+     * Is the string one of the choices
+     * @param  json    JSON value
+     * @param  choices Allowed strings separated by '|'
+     * @return false if not a string or not allowed
+     */
+    static bool isChoice(const JsonVariant &json, const char *choices) {
+      if (!json.is<const char*>())
+        return false;
+
+      const char *value = json.as<const char*>();
+      size_t length = strlen(value);
+
+      while (choices) {
+        const char *next = strchr(choices, '|');
+        size_t choiceLength = next ? (size_t)(next - choices) : strlen(choices);
+
+        if (choiceLength == length && !strncmp(choices, value, length))
+          return true;
+
+        // Prefix
+        if (choiceLength && choices[choiceLength - 1] == '*' &&
+            length >= choiceLength - 1 && !strncmp(choices, value, choiceLength - 1))
+          return true;
+
+        choices = next ? next + 1 : NULL;
+      }
+      return false;
+    }
+
+
+    /**
+     * Same JSON group
+     * @param  a Group name, NULL for the root
+     * @param  b Group name, NULL for the root
+     */
+    static bool isSameGroup(const char *a, const char *b) {
+      return a == b || (a && b && !strcmp(a, b));
+    }
+
+
+    /**
+     * Value of field
+     * @param  field Field descriptor
+     * @return Pointer into the config values
+     */
+    uint8_t* fieldValue(const H801_ConfigField &field) {
+      return (uint8_t*)static_cast<H801_ConfigValues*>(this) + field.offset;
+    }
+
+
+    /**
+     * Set field from JSON value if valid
+     * @param  field     Field descriptor
+     * @param  jsonGroup JSON object of the field group
+     * @return false if failure or unchanged
+     */
+    bool jsonToField(const H801_ConfigField &field, JsonObject &jsonGroup) {
+      uint8_t *value = this->fieldValue(field);
+
+      // Value for each board channel
+      if (field.type == H801_CONFIG_CHANNELS) {
+        bool isModified = false;
+        for (size_t i = 0; i < H801_BOARD_CHANNELS; i++)
+          isModified = jsonToBoolProp(jsonGroup[H801_Board::channels[i].id], (bool*)value + i) || isModified;
+        return isModified;
+      }
+
+      const JsonVariant &json = jsonGroup[field.name];
+
+      // String doesn't fit
+      if (field.size && json.is<const char*>() && strlen(json.as<const char*>()) >= field.size)
+        return false;
+
+      switch (field.type) {
+        case H801_CONFIG_STRING:
+          if (field.choices && json.success() && !isChoice(json, field.choices))
+            return false;
+          return jsonToStringProp(json, (char*)value, field.size);
+
+        case H801_CONFIG_SECRET:
+          return jsonToPasswProp(json, (char*)value, field.size);
+
+        case H801_CONFIG_BOOL:
+          return jsonToBoolProp(json, (bool*)value);
+
+        case H801_CONFIG_UINT16:
+          return jsonToUInt16Prop(json, (uint16_t*)value, field.minValue, field.maxValue);
+
+        default:
+          break;
+      }
+      return false;
+    }
+
+
+    /**
+     * Add field to JSON object
+     * @param field        Field descriptor
+     * @param json         JSON object of the field group
+     * @param hidePassword Hides secret fields
+     */
+    void fieldToJSON(const H801_ConfigField &field, JsonObject &json, bool hidePassword) {
+      uint8_t *value = this->fieldValue(field);
+
+      switch (field.type) {
+        case H801_CONFIG_STRING:
+          json[field.name] = (const char*)value;
+          break;
+
+        case H801_CONFIG_SECRET:
+          // Output empty string if password is empty
+          json[field.name] = (hidePassword && *value) ? H801_CONFIG_HIDDEN : (const char*)value;
+          break;
+
+        case H801_CONFIG_BOOL:
+          json[field.name] = *(bool*)value;
+          break;
+
+        case H801_CONFIG_UINT16:
+          json[field.name] = *(uint16_t*)value;
+          break;
+
+        case H801_CONFIG_CHANNELS:
+          for (size_t i = 0; i < H801_BOARD_CHANNELS; i++)
+            json[H801_Board::channels[i].id] = ((bool*)value)[i];
+          break;
+      }
+    }
+
+
+    /**
+     * CRC32 of sequence and data
+     * @param  record Config record
+     * @return CRC
+     */
+    static uint32_t recordCRC(const H801_ConfigRecord &record) {
+      return calcCRC32(&record.sequence, sizeof(record.sequence) + record.size);
+    }
+
+
+    /**
+     * Read and validate record in config sector
+     * @param  slot   Sector, 0 or 1
+     * @param  record Output record, buffer of H801_CONFIG_RECORD_WORDS
+     * @return false if invalid
+     */
+    bool readRecord(int slot, H801_ConfigRecord *record) {
+      if (!ESP.flashRead((H801_CONFIG_SECTOR + slot) * SPI_FLASH_SEC_SIZE,
+                         (uint32_t*)record, H801_CONFIG_RECORD_WORDS * 4))
+        return false;
+
+      return record->magic   == H801_CONFIG_MAGIC &&
+             record->version == H801_CONFIG_VERSION &&
+             record->size    >= offsetof(H801_ConfigRecord, data.values) - offsetof(H801_ConfigRecord, data) &&
+             record->size    <= sizeof(record->data) &&
+             record->crc     == recordCRC(*record);
+    }
+
+
+    /**
+     * Erase the sector not holding the newest record
+     */
+    void eraseRecord(void) {
+      int slot = m_slot == 0 ? 1 : 0;
+
+      if (!ESP.flashEraseSector(H801_CONFIG_SECTOR + slot)) {
+        Serial1.printf("Config: Failed to erase slot %c\n", 'A' + slot);
+        return;
+      }
+      m_isErased = true;
     }
 
 
+    /**
+     * Write record to the erased sector and verify it
+     */
+    void writeRecord(void) {
+      unsigned long start = micros();
+      int slot = m_slot == 0 ? 1 : 0;
+      std::unique_ptr<uint32_t[]> buf(new uint32_t[H801_CONFIG_RECORD_WORDS]);
+      H801_ConfigRecord *record = (H801_ConfigRecord*)buf.get();
+
+      m_isErased = false;
+
+      memset(record, 0, H801_CONFIG_RECORD_WORDS * 4);
+      this->toRecord(*record);
+      record->sequence = m_sequence + 1;
+      record->crc = recordCRC(*record);
+
+      // Old record stays valid until the new one is written and verified
+      if (!ESP.flashWrite((H801_CONFIG_SECTOR + slot) * SPI_FLASH_SEC_SIZE, buf.get(), H801_CONFIG_RECORD_WORDS * 4) ||
+          !this->readRecord(slot, record)) {
+        Serial1.printf("Config: Failed to write slot %c\n", 'A' + slot);
+        return;
+      }
+
+      m_slot = slot;
+      m_sequence = record->sequence;
+
+      Serial1.printf("Config: Saved record %u to slot %c in %luus\n", m_sequence, 'A' + m_slot, micros() - start);
+    }
+
+
+    /**
+     * Copy configuration to record
+     * @param record Config record
+     */
+    void toRecord(H801_ConfigRecord &record) {
+      record.magic   = H801_CONFIG_MAGIC;
+      record.version = H801_CONFIG_VERSION;
+      record.size    = sizeof(record.data);
+
+      memcpy(&record.data.wifi, &m_WiFiCache, sizeof(record.data.wifi));
+      memcpy(&record.data.values, static_cast<H801_ConfigValues*>(this), sizeof(record.data.values));
+    }
+
+
+    /**
+     * Copy configuration from validated record, values not in the
+     * record keep the defaults set by clear()
+     * @param record Config record
+     */
+    void fromRecord(const H801_ConfigRecord &record) {
+      size_t size = record.size - (offsetof(H801_ConfigRecord, data.values) - offsetof(H801_ConfigRecord, data));
+
+      memcpy(&m_WiFiCache, &record.data.wifi, sizeof(m_WiFiCache));
+      memcpy(static_cast<H801_ConfigValues*>(this), &record.data.values, size);
+
+      // Strings are terminated even if the record was cut inside one
+      for (size_t i = 0; i < countof(s_configFields); i++) {
+        H801_ConfigField field;
+        memcpy_P(&field, &s_configFields[i], sizeof(field));
+
+        if (field.size && (field.type == H801_CONFIG_STRING || field.type == H801_CONFIG_SECRET))
+          this->fieldValue(field)[field.size - 1] = '\0';
+      }
+    }
+
 
   public:
     /**
      * H801 Configuration object
+     * @param scratch Scratch arena, holds the JSON string
      */
-    H801_Config() {
+    H801_Config(H801_Scratch &scratch):
+        m_scratch(scratch),
+        m_slot(-1),
+        m_sequence(0),
+        m_isDirty(false),
+        m_isErased(false),
+        m_changeTime(0) {
       this->clear();
     }
 
@@ -164,66 +604,54 @@ class H801_Config {
      * Reset configuration
      */
     void clear(void) {
-      *m_name = '\0';
-      memset(&m_MQTT, 0, sizeof(m_MQTT));
-
-      m_ButtonFade.R = true;
-      m_ButtonFade.G = true;
-      m_ButtonFade.B = true;
-#if HWMODEL==HWMODEL_H801
-      m_ButtonFade.W1 = true;
-      m_ButtonFade.W2 = true;
-#elif HWMODEL==HWMODEL_MAGIC_RGBW
-      m_ButtonFade.W = true;
-#endif
+      memset(static_cast<H801_ConfigValues*>(this), 0, sizeof(H801_ConfigValues));
+
+      for (size_t i = 0; i < countof(s_configFields); i++) {
+        H801_ConfigField field;
+        memcpy_P(&field, &s_configFields[i], sizeof(field));
+
+        if (field.type == H801_CONFIG_BOOL)
+          *(bool*)this->fieldValue(field) = field.defValue;
+        else if (field.type == H801_CONFIG_CHANNELS)
+          memset(this->fieldValue(field), field.defValue, H801_BOARD_CHANNELS);
+        else if (field.type == H801_CONFIG_UINT16)
+          *(uint16_t*)this->fieldValue(field) = field.defValue;
+      }
+
+      memset(&m_WiFiCache, 0, sizeof(m_WiFiCache));
     }
 
 
     /**
      * Converts configuration to JSON stirng
      * @param  hidePassword Hides password fields
-     * @return JSON string
+     * @return JSON string in the scratch arena, NULL if out of memory
      */
     char * toJSONString(bool hidePassword) {
-      static char buffer[1024];
+      StaticJsonBuffer<1024> *jsonBuffer = m_scratch.jsonBuffer<1024>();
+      if (!jsonBuffer)
+        return NULL;
 
-      m_jsonBuffer.clear();
-      JsonObject& json = m_jsonBuffer.createObject();
+      JsonObject& json = jsonBuffer->createObject();
 
-      json["name"] = m_name;
+      JsonObject *jsonGroup = &json;
+      const char *group = NULL;
 
-      // MQTT
-      JsonObject& jsonMQTT = json.createNestedObject("mqtt");
-      jsonMQTT["server"] = m_MQTT.server;
-      jsonMQTT["port"]   = m_MQTT.port;
+      for (size_t i = 0; i < countof(s_configFields); i++) {
+        H801_ConfigField field;
+        memcpy_P(&field, &s_configFields[i], sizeof(field));
 
-      jsonMQTT["alias"]  = m_MQTT.alias;
+        // Fields of a group follow each other
+        if (!isSameGroup(field.group, group)) {
+          group = field.group;
+          jsonGroup = group ? &json.createNestedObject(group) : &json;
+        }
 
-      jsonMQTT["login"]  = m_MQTT.login;
-      
-      // Output empty string if password is empty
-      if (!hidePassword || !*m_MQTT.passw) {
-        jsonMQTT["passw"]  = m_MQTT.passw;
-      }
-      else {
-        jsonMQTT["passw"]  = "*********";
+        this->fieldToJSON(field, *jsonGroup, hidePassword);
       }
 
-
-      // Button fading
-      JsonObject& jsonButtonFade = json.createNestedObject("button_fade");
-      jsonButtonFade["R"]  = m_ButtonFade.R;
-      jsonButtonFade["G"]  = m_ButtonFade.G;
-      jsonButtonFade["B"]  = m_ButtonFade.B;
-#if HWMODEL==HWMODEL_H801
-      jsonButtonFade["W1"] = m_ButtonFade.W1;
-      jsonButtonFade["W2"] = m_ButtonFade.W2;
-#elif HWMODEL==HWMODEL_MAGIC_RGBW
-      jsonButtonFade["W"]  = m_ButtonFade.W;
-#endif
       // Serialize JSON
-      json.printTo(buffer, sizeof(buffer));
-      return buffer;
+      return m_scratch.printTo(json);
     }
 
 
@@ -233,140 +661,131 @@ class H801_Config {
    * @return Was any value modified
    */
   bool set(JsonObject& json) {
-
     bool isModified = false;
 
-    isModified = jsonToStringProp(json["name"], m_name,  countof(m_name)) || isModified;
+    JsonObject *jsonGroup = &json;
+    const char *group = NULL;
 
-    JsonObject& jsonMQTT = json["mqtt"];
-    if (jsonMQTT.success()) {
-      isModified = jsonToStringProp(jsonMQTT["server"], m_MQTT.server,  countof(m_MQTT.server)) || isModified;
-      isModified = jsonToStringProp(jsonMQTT["port"],   m_MQTT.port,    countof(m_MQTT.port))   || isModified;
-      isModified = jsonToStringProp(jsonMQTT["alias"],  m_MQTT.alias,   countof(m_MQTT.alias))  || isModified;
-      isModified = jsonToStringProp(jsonMQTT["login"],  m_MQTT.login,   countof(m_MQTT.login))  || isModified;
-      isModified = jsonToStringProp(jsonMQTT["passw"],  m_MQTT.passw,   countof(m_MQTT.passw))  || isModified;
-    }
+    for (size_t i = 0; i < countof(s_configFields); i++) {
+      H801_ConfigField field;
+      memcpy_P(&field, &s_configFields[i], sizeof(field));
 
-    JsonObject& jsonButtonFade = json["button_fade"];
-    if (jsonButtonFade.success()) {
-      isModified = jsonToBoolProp(jsonButtonFade["R"],  &m_ButtonFade.R)  || isModified;
-      isModified = jsonToBoolProp(jsonButtonFade["G"],  &m_ButtonFade.G)  || isModified;
-      isModified = jsonToBoolProp(jsonButtonFade["B"],  &m_ButtonFade.B)  || isModified;
-#if HWMODEL==HWMODEL_H801
-      isModified = jsonToBoolProp(jsonButtonFade["W1"], &m_ButtonFade.W1) || isModified;
-      isModified = jsonToBoolProp(jsonButtonFade["W2"], &m_ButtonFade.W2) || isModified;
-#elif HWMODEL==HWMODEL_MAGIC_RGBW
-      isModified = jsonToBoolProp(jsonButtonFade["W"], &m_ButtonFade.W) || isModified;
-#endif
+      if (!isSameGroup(field.group, group)) {
+        group = field.group;
+        jsonGroup = group ? &json[group].as<JsonObject&>() : &json;
+      }
+
+      // Group not in the update
+      if (!jsonGroup->success())
+        continue;
+
+      isModified = this->jsonToField(field, *jsonGroup) || isModified;
     }
     return isModified;
   }
 
 
   /**
-   * Write current configuration to SPIFFS
-   * @return false if failure
+   * Write current configuration to flash, the write is deferred to the loop
+   * so the caller doesn't wait for the flash
    */
-  bool save(void) {
-    if (!SPIFFS.begin()) {
-      Serial1.println("Config: failed to mount FS");
-      return false;
-    }
+  void save(void) {
+    m_isDirty = true;
+    m_changeTime = millis();
+  }
 
-    const char *config = this->toJSONString(false);
 
-    Serial1.println("Config: Saving config");
+  /**
+   * Write pending configuration, erase and write are done in separate
+   * calls to keep each flash stall short
+   * @param time current millis time
+   */
+  void loop(unsigned long time) {
+    if (m_isErased) {
+      this->writeRecord();
+      return;
+    }
 
-    File configFile = SPIFFS.open(H801_CONFIG_FILE, "w");
-    
-    if (!configFile) {
-      Serial1.println("Config: Failed to open config file for writing");
-      configFile.close();
-      SPIFFS.end();
-      return false;
+    if (m_isDirty && time - m_changeTime >= H801_CONFIG_WRITE_DELAY) {
+      m_isDirty = false;
+      this->eraseRecord();
     }
+  }
 
-    // Print config
-    Serial1.print("Config Save: ");
-    Serial1.println(config);
 
-    if (!configFile.print(config)) {
-      Serial1.println("Config: Failed to write config file");
-      configFile.close();
-      SPIFFS.end();
-      return false;
+  /**
+   * Write pending configuration now, used before restarting
+   */
+  void flush(void) {
+    if (m_isDirty) {
+      m_isDirty = false;
+      this->eraseRecord();
     }
 
-    configFile.close();
-    SPIFFS.end();
-    return true;
+    if (m_isErased)
+      this->writeRecord();
   }
 
 
   /**
-   * Read current configuration from SPIFFS
+   * Read current configuration from flash
    * @return false if failed to read config
    */
   bool load() {
-    File configFile;
+    unsigned long start = micros();
+    std::unique_ptr<uint32_t[]> buf(new uint32_t[H801_CONFIG_RECORD_WORDS]);
+    H801_ConfigRecord *record = (H801_ConfigRecord*)buf.get();
+
+    this->clear();
+    m_slot = -1;
+    m_sequence = 0;
+
+    // Find newest valid record, a record of another version is not
+    // read and the config starts from the defaults
+    bool isEmpty = true;
+    for (int slot = 0; slot < 2; slot++) {
+      if (!this->readRecord(slot, record)) {
+        isEmpty = isEmpty && (record->magic == 0xFFFFFFFF ||
+                              (record->magic == H801_CONFIG_MAGIC && record->version != H801_CONFIG_VERSION));
+        continue;
+      }
 
-    if (!SPIFFS.begin()) {
-      Serial1.println("Config: failed to mount FS");
-      return false;
+      if (m_slot < 0 || (int32_t)(record->sequence - m_sequence) > 0) {
+        m_slot = slot;
+        m_sequence = record->sequence;
+      }
     }
 
-    if (!SPIFFS.exists(H801_CONFIG_FILE)) {
-      Serial1.println("Config: No config file");
-      this->clear();
-      SPIFFS.end();
+    // Never written
+    if (m_slot < 0 && isEmpty) {
+      Serial1.println("Config: No config record");
       return true;
     }
 
-    if ((configFile = SPIFFS.open(H801_CONFIG_FILE, "r")) == 0) {
-      Serial1.println("Config: Unable to open " H801_CONFIG_FILE);
-      SPIFFS.end();
+    if (m_slot < 0) {
+      Serial1.println("Config: No valid config record");
       return false;
     }
 
-    size_t size = configFile.size();
-    // Allocate a buffer to store contents of the file.
-    std::unique_ptr<char[]> buf(new char[size]);
-
-    configFile.readBytes(buf.get(), size);
-
-    m_jsonBuffer.clear();
-    JsonObject& json = m_jsonBuffer.parseObject(buf.get());
-
-    // Close file and filesystem
-    configFile.close();
-    SPIFFS.end();
-
-    if (!json.success()) {
-      Serial1.println("Config: Failed to parse json config");
-      Serial1.println(buf.get());
-      return false;
-    }
-
-    Serial1.print("Config: Input JSON ");
-    json.printTo(Serial1);
-    Serial1.println("");
-
-    this->set(json);
+    this->readRecord(m_slot, record);
+    this->fromRecord(*record);
 
+    Serial1.printf("Config: Loaded record %u from slot %c in %luus\n", m_sequence, 'A' + m_slot, micros() - start);
     return true;
   }
 
   /**
-   * Removes configuration from disk and WifiManager
+   * Removes configuration from flash
    */
   void remove() {
-    if (SPIFFS.begin()) {
-      // Remove JSON configuration
-      SPIFFS.remove(H801_CONFIG_FILE);
-      SPIFFS.end();
-    }
-    else {
-      Serial1.println("Config: failed to mount FS");
+    m_isDirty = false;
+    m_isErased = false;
+    m_slot = -1;
+    m_sequence = 0;
+
+    if (!ESP.flashEraseSector(H801_CONFIG_SECTOR) ||
+        !ESP.flashEraseSector(H801_CONFIG_SECTOR + 1)) {
+      Serial1.println("Config: failed to remove config");
     }
   }
-};
\ No newline at end of file
+};
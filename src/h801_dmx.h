@@ -0,0 +1,353 @@
+
+// Protocol ports
+#define H801_DMX_E131_PORT    5568
+#define H801_DMX_ARTNET_PORT  6454
+
+// Largest packet that is read, E1.31 header and a full universe
+#define H801_DMX_PACKET_MAX   638
+
+// Max number of packets read during one loop tick
+#define H801_DMX_PACKETS_PER_LOOP 8
+
+// Source is considered gone after this time, allows lower priority sources to take over
+#define H801_DMX_SOURCE_TIMEOUT 2500
+
+// Packets this far behind the last sequence number are out of order,
+// larger differences are treated as a restarted source (E1.31 6.7.2)
+#define H801_DMX_SEQUENCE_WINDOW 20
+
+// Max number of consecutive channels mapped from the universe
+#define H801_DMX_CHANNELS 5
+
+// E1.31 default priority
+#define H801_DMX_E131_PRIORITY 100
+
+
+/**
+ * Received DMX frame, data points into the packet buffer
+ */
+typedef struct tagH801_DMXFrame {
+  uint16_t       universe;
+  uint8_t        sequence;     // 0 if source doesn't use sequence numbers (Art-Net)
+  uint8_t        priority;
+  bool           isTerminated; // Source stops sending this universe
+  const uint8_t *cid;          // Source id, NULL if protocol has none
+  const uint8_t *data;         // DMX slot 1
+  uint16_t       length;       // Number of slots
+} H801_DMXFrame;
+
+
+/**
+ * H801 Realtime DMX input, E1.31 (sACN) or Art-Net over UDP
+ */
+class H801_DMX {
+  private:
+    typedef enum {
+      PROTOCOL_NONE,
+      PROTOCOL_E131,
+      PROTOCOL_ARTNET,
+    } Protocol;
+
+    WiFiUDP m_udp;
+    H801_Config& m_config;
+    PH801_Functions m_functions;
+
+    Protocol m_protocol;
+    uint8_t  m_packet[H801_DMX_PACKET_MAX];
+
+    // Active source
+    struct {
+      bool          isActive;
+      uint8_t       cid[16];
+      uint8_t       priority;
+      uint8_t       sequence;
+      unsigned long lastTime;
+    } m_source;
+
+    // Counters
+    struct {
+      uint32_t packets;    // Frames applied
+      uint32_t late;       // Out of order frames that were discarded
+      uint32_t dropped;    // Frames missing in the sequence
+      uint32_t ignored;    // Other universe, lower priority or invalid packets
+      uint32_t pps;        // Frames applied during last second
+
+      uint32_t windowPackets;
+      unsigned long windowStart;
+    } m_stats;
+
+
+    /**
+     * Read big endian 16-bit value
+     */
+    static uint16_t readU16(const uint8_t *p) {
+      return (uint16_t)(p[0] << 8 | p[1]);
+    }
+
+
+    /**
+     * Read big endian 32-bit value
+     */
+    static uint32_t readU32(const uint8_t *p) {
+      return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+
+
+    /**
+     * Is the frame next in sequence from the active source
+     * Updates dropped and late counters
+     * @param  frame Received frame
+     * @param  time  Current millis() time
+     * @return false if the frame should be discarded
+     */
+    bool acceptFrame(const H801_DMXFrame &frame, unsigned long time) {
+      bool isSourceAlive = m_source.isActive && (time - m_source.lastTime) < H801_DMX_SOURCE_TIMEOUT;
+      bool isSameSource = isSourceAlive &&
+        (frame.cid == NULL || !memcmp(frame.cid, m_source.cid, sizeof(m_source.cid)));
+
+      // Another source, only take over if it has at least the same priority
+      if (!isSameSource) {
+        if (isSourceAlive && frame.priority < m_source.priority) {
+          m_stats.ignored++;
+          return false;
+        }
+
+        m_source.isActive = true;
+        m_source.priority = frame.priority;
+        m_source.sequence = frame.sequence;
+        m_source.lastTime = time;
+        if (frame.cid)
+          memcpy(m_source.cid, frame.cid, sizeof(m_source.cid));
+        return true;
+      }
+
+      m_source.priority = frame.priority;
+      m_source.lastTime = time;
+
+      // Art-Net sequence 0 disables the check, E1.31 just wraps to 0
+      bool isArtNet = frame.cid == NULL;
+      if (isArtNet && !frame.sequence)
+        return true;
+
+      int8_t diff = (int8_t)(frame.sequence - m_source.sequence);
+
+      // Art-Net wraps from 255 to 1
+      if (isArtNet && diff > 0 && frame.sequence < m_source.sequence)
+        diff--;
+      if (diff <= 0 && diff > -H801_DMX_SEQUENCE_WINDOW) {
+        m_stats.late++;
+        return false;
+      }
+
+      if (diff > 1)
+        m_stats.dropped += diff - 1;
+
+      m_source.sequence = frame.sequence;
+      return true;
+    }
+
+
+  public:
+    /**
+     * H801 DMX constructor
+     * @param config    Configuration
+     * @param functions External functions
+     */
+    H801_DMX(H801_Config &config, PH801_Functions functions):
+        m_config(config),
+        m_functions(functions),
+        m_protocol(PROTOCOL_NONE) {
+      memset(&m_source, 0, sizeof(m_source));
+      memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+
+    /**
+     * Parse E1.31 data packet
+     * @param  packet Packet data
+     * @param  length Packet length
+     * @param  frame  Output frame
+     * @return false if not a valid E1.31 DMX packet
+     */
+    static bool parseE131(const uint8_t *packet, size_t length, H801_DMXFrame *frame) {
+      static const uint8_t acnId[12] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+
+      if (length < 126)
+        return false;
+
+      // Root layer
+      if (readU16(packet) != 0x0010 || readU16(packet + 2) != 0x0000 ||
+          memcmp(packet + 4, acnId, sizeof(acnId)) ||
+          readU32(packet + 18) != 0x00000004)
+        return false;
+
+      // Framing layer
+      if (readU32(packet + 40) != 0x00000002)
+        return false;
+
+      // DMP layer, DMX data with start code 0
+      uint16_t count = readU16(packet + 123);
+      if (packet[117] != 0x02 || count < 1 || packet[125] != 0x00 || 125 + (size_t)count > length)
+        return false;
+
+      frame->cid          = packet + 22;
+      frame->priority     = packet[108];
+      frame->sequence     = packet[111];
+      frame->isTerminated = (packet[112] & 0x40) != 0;
+      frame->universe     = readU16(packet + 113);
+      frame->data         = packet + 126;
+      frame->length       = count - 1;
+      return true;
+    }
+
+
+    /**
+     * Parse Art-Net ArtDmx packet
+     * @param  packet Packet data
+     * @param  length Packet length
+     * @param  frame  Output frame
+     * @return false if not a valid ArtDmx packet
+     */
+    static bool parseArtNet(const uint8_t *packet, size_t length, H801_DMXFrame *frame) {
+      static const uint8_t artId[8] = { 'A', 'r', 't', '-', 'N', 'e', 't', 0 };
+
+      if (length < 18 || memcmp(packet, artId, sizeof(artId)))
+        return false;
+
+      // OpDmx, little endian, and protocol version 14
+      if ((packet[8] | packet[9] << 8) != 0x5000 || readU16(packet + 10) < 14)
+        return false;
+
+      uint16_t count = readU16(packet + 16);
+      if (18 + (size_t)count > length)
+        return false;
+
+      frame->cid          = NULL;
+      frame->priority     = H801_DMX_E131_PRIORITY;
+      frame->sequence     = packet[12];
+      frame->isTerminated = false;
+      frame->universe     = (uint16_t)(packet[14] | packet[15] << 8) & 0x7FFF;
+      frame->data         = packet + 18;
+      frame->length       = count;
+      return true;
+    }
+
+
+    /**
+     * Start listening with current DMX config
+     */
+    void setup() {
+      m_udp.stop();
+      memset(&m_source, 0, sizeof(m_source));
+
+      if (!strcmp(m_config.m_DMX.protocol, "e131")) {
+        m_protocol = PROTOCOL_E131;
+
+        // Universe multicast group 239.255.<universe hi>.<universe lo>
+        IPAddress group(239, 255, m_config.m_DMX.universe >> 8, m_config.m_DMX.universe & 0xFF);
+        m_udp.beginMulticast(WiFi.localIP(), group, H801_DMX_E131_PORT);
+      }
+      else if (!strcmp(m_config.m_DMX.protocol, "artnet")) {
+        m_protocol = PROTOCOL_ARTNET;
+        m_udp.begin(H801_DMX_ARTNET_PORT);
+      }
+      else {
+        m_protocol = PROTOCOL_NONE;
+        return;
+      }
+
+      Serial1.printf("DMX: Listening %s universe %u address %u\n",
+                     m_config.m_DMX.protocol, m_config.m_DMX.universe, m_config.m_DMX.address);
+    }
+
+
+    /**
+     * Read pending packets, only the newest accepted frame is applied
+     * @param time current millis time
+     */
+    void loop(unsigned long time) {
+      if (m_protocol == PROTOCOL_NONE)
+        return;
+
+      uint8_t values[H801_DMX_CHANNELS];
+      size_t  numValues = 0;
+
+      for (int i = 0; i < H801_DMX_PACKETS_PER_LOOP; i++) {
+        int size = m_udp.parsePacket();
+        if (size <= 0)
+          break;
+
+        size_t length = m_udp.read(m_packet, min((size_t)size, sizeof(m_packet)));
+
+        H801_DMXFrame frame;
+        bool isValid = (m_protocol == PROTOCOL_E131) ?
+          parseE131(m_packet, length, &frame) :
+          parseArtNet(m_packet, length, &frame);
+
+        if (!isValid || frame.universe != m_config.m_DMX.universe) {
+          m_stats.ignored++;
+          continue;
+        }
+
+        // Source stopped, let other sources take over directly
+        if (frame.isTerminated) {
+          if (m_source.isActive && !memcmp(frame.cid, m_source.cid, sizeof(m_source.cid)))
+            m_source.isActive = false;
+          continue;
+        }
+
+        if (!this->acceptFrame(frame, time))
+          continue;
+
+        m_stats.packets++;
+        m_stats.windowPackets++;
+
+        // Map start address onto the channels
+        size_t offset = m_config.m_DMX.address - 1;
+        numValues = 0;
+        while (numValues < countof(values) && offset + numValues < frame.length) {
+          values[numValues] = frame.data[offset + numValues];
+          numValues++;
+        }
+      }
+
+      if (numValues)
+        m_functions->set_Channels("dmx", values, numValues);
+
+      // Packets per second
+      if (time - m_stats.windowStart >= 1000) {
+        m_stats.pps = m_stats.windowPackets;
+        m_stats.windowPackets = 0;
+        m_stats.windowStart = time;
+      }
+    }
+
+
+    /**
+     * Is a source sending frames
+     * @param time Current millis() time
+     */
+    bool isReceiving(unsigned long time) {
+      return m_protocol != PROTOCOL_NONE && m_source.isActive &&
+             (time - m_source.lastTime) < H801_DMX_SOURCE_TIMEOUT;
+    }
+
+
+    /**
+     * Add DMX information to JSON object
+     * @param root JSON object
+     */
+    void appendInfo(JsonObject& root) {
+      if (m_protocol == PROTOCOL_NONE)
+        return;
+
+      JsonObject& jsonDMX = root.createNestedObject("dmx");
+      jsonDMX["protocol"] = m_config.m_DMX.protocol;
+      jsonDMX["universe"] = m_config.m_DMX.universe;
+      jsonDMX["packets"]  = m_stats.packets;
+      jsonDMX["pps"]      = m_stats.pps;
+      jsonDMX["late"]     = m_stats.late;
+      jsonDMX["dropped"]  = m_stats.dropped;
+      jsonDMX["ignored"]  = m_stats.ignored;
+    }
+};
@@ -1,69 +1,413 @@
 
+// HTTP port
+#define H801_HTTP_PORT 80
+
+// Max number of simultaneous HTTP connections
+#define H801_HTTP_MAX_CONNECTIONS 4
+
+// Max time spent on HTTP during each loop, in us, also the budget of
+// the http task so a busy loop fits in the tick
+#define H801_HTTP_LOOP_BUDGET 2000
+
+// Idle keep-alive connections are closed after this time
+#define H801_HTTP_KEEPALIVE_TIMEOUT 5000
+
+// Number of requests served on a connection before it is closed
+#define H801_HTTP_KEEPALIVE_MAX 100
+
+// Max length of request line and each header line
+#define H801_HTTP_LINE_MAX 256
+
+// Max length of request URI
+#define H801_HTTP_URI_MAX 128
+
+// Max size of request body, firmware upload is streamed
+#define H801_HTTP_BODY_MAX 1024
+
+// Size of chunks used when streaming assets and firmware
+#define H801_HTTP_CHUNK_SIZE 512
+
+// Max length of If-None-Match header that is kept
+#define H801_HTTP_ETAG_MAX 64
+
+// Time an interrupted resumable firmware upload is kept, in ms
+#define H801_HTTP_UPDATE_TIMEOUT 300000
+
+
+/**
+ * Web file embedded in flash, generated by assets.js
+ */
+typedef struct tagH801_Asset {
+  const char    *path;         // Original path, revalidated using ETag
+  const char    *hashedPath;   // Path with content hash, cached forever, NULL for entry page
+  const char    *contentType;
+  const char    *etag;
+  const uint8_t *data;         // PROGMEM
+  uint32_t       length;
+  bool           isGzip;
+} H801_Asset;
+
+#include "assets.inc"
+
+
+/**
+ * H801 HTTP connection
+ */
+typedef struct tagH801_HTTPConnection {
+  typedef enum {
+    STATE_FREE,
+    STATE_REQUEST_LINE,     // Waiting for request line
+    STATE_HEADERS,          // Reading headers
+    STATE_BODY,             // Reading request body
+    STATE_UPLOAD_HEADERS,   // Reading multipart headers of firmware upload
+    STATE_UPLOAD,           // Streaming firmware to flash
+    STATE_SEND_ASSET,       // Streaming asset to client
+    STATE_SEND_RESPONSE,    // Streaming rest of response body to slow client
+  } State;
+
+  typedef enum {
+    METHOD_GET,
+    METHOD_POST,
+    METHOD_DELETE,
+    METHOD_OTHER,
+  } Method;
+
+  WiFiClient    client;
+  State         state;
+  unsigned long lastActive;
+  uint16_t      numRequests;
+  uint32_t      requestStart;         // micros() when the request line was read
+
+  // Request
+  Method   method;
+  bool     isKeepAlive;
+  char     uri[H801_HTTP_URI_MAX];
+  char     boundary[72];              // Multipart boundary, empty if not multipart
+  char     ifNoneMatch[H801_HTTP_ETAG_MAX];
+  char     md5[33];                   // X-MD5 of firmware image, empty if none
+  bool     hasRange;                  // Content-Range of resumable firmware upload
+  long     rangeStart;                // -1 for status query
+  size_t   rangeEnd;
+  size_t   rangeTotal;                // 0 if invalid
+  size_t   contentLength;
+  size_t   bodyLength;                // Body bytes read, the body is in the server
+
+  // Current line
+  char     line[H801_HTTP_LINE_MAX];
+  size_t   lineLength;
+
+  // Firmware upload, bytes left of the image
+  size_t   uploadRemaining;
+
+  // Asset being sent
+  const H801_Asset *asset;
+  size_t   assetOffset;
+
+  // Response body the send buffer didn't take, only while streaming
+  std::unique_ptr<char[]> response;
+  size_t   responseLength;
+  size_t   responseOffset;
+} H801_HTTPConnection;
+
+
+/**
+ * H801 HTTP server
+ * Serves several keep-alive connections at once without blocking the
+ * main loop, each loop only spends a small time budget on HTTP
+ */
 class H801_HTTP {
   private:
-    ESP8266WebServer m_httpServer;
-    ESP8266HTTPUpdateServer m_httpUpdater;
+    typedef H801_HTTPConnection Connection;
+
+    WiFiServer m_httpServer;
     H801_Config &m_config;
+    H801_Scratch &m_scratch;
     PH801_Functions m_functions;
-    StaticJsonBuffer<1024> m_jsonBuffer;
 
-    bool send_File(const char* contentType, const char *fileName) {
-      Serial1.printf("send_File: %s\n", fileName);
-      
-      if (!SPIFFS.begin()) {
-        return false;
+    Connection m_connections[H801_HTTP_MAX_CONNECTIONS];
+    size_t m_nextConnection;
+
+    // Request body, shared by the connections. Bodies are small and read
+    // at once, other connections wait in STATE_BODY while it is in use
+    char m_body[H801_HTTP_BODY_MAX + 1];
+    Connection *m_bodyOwner;
+
+    // Restart once the firmware update response has been sent
+    unsigned long m_restartTime;
+
+    // Resumable firmware upload, kept between connections
+    struct {
+      bool isResumable;
+      size_t size;
+      char md5[33];
+      unsigned long lastActive;
+    } m_update;
+
+    // Counters
+    struct {
+      uint32_t connections;  // Accepted connections
+      uint32_t requests;     // Handled requests
+      uint32_t rejected;     // Connections rejected, no free slot
+      uint32_t parseFailed;  // Request bodies that weren't valid JSON
+    } m_stats;
+    H801_Histogram m_latency;
+
+
+    /**
+     * Status text for HTTP status code
+     * @param  code HTTP status code
+     * @return Status text
+     */
+    static const char* statusText(int code) {
+      switch (code) {
+        case 200: return "OK";
+        case 202: return "Accepted";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 406: return "Not Acceptable";
+        case 408: return "Request Timeout";
+        case 413: return "Payload Too Large";
+        case 416: return "Range Not Satisfiable";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        default:  return "Unknown";
       }
+    }
 
-      Serial1.printf("GET: %s\r\n", fileName);
 
-      // Check if exact match exists
-      if (SPIFFS.exists(fileName)) {
-        File file = SPIFFS.open(fileName, "r");
-        m_httpServer.sendHeader("Cache-Control", "max-age=86400");
-        m_httpServer.streamFile(file, contentType);
-        file.close();
-        SPIFFS.end();
-        return true;
+    /**
+     * Decode URL encoded string in place
+     * @param str String to decode
+     */
+    static void urlDecode(char *str) {
+      char *dst = str;
+      while (*str) {
+        if (*str == '+') {
+          *dst++ = ' ';
+          str++;
+        }
+        else if (*str == '%' && isxdigit(str[1]) && isxdigit(str[2])) {
+          char hex[3] = { str[1], str[2], '\0' };
+          *dst++ = (char)strtol(hex, NULL, 16);
+          str += 3;
+        }
+        else {
+          *dst++ = *str++;
+        }
       }
+      *dst = '\0';
+    }
 
-      // No file
-      SPIFFS.end();
-      m_httpServer.send(404, "text/plain", "FileNotFound");
-      return false;
+
+    /**
+     * Send response headers
+     * @param conn          Connection
+     * @param code          HTTP status code
+     * @param contentType   Content type, NULL if none
+     * @param contentLength Length of body
+     * @param extraHeaders  Additional header lines, each ending with \r\n
+     */
+    void sendHeaders(Connection &conn, int code, const char *contentType, size_t contentLength, const char *extraHeaders) {
+      char header[384];
+      int length = snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\n"
+        "%s%s%s"
+        "Content-Length: %u\r\n"
+        "Connection: %s\r\n"
+        "%s"
+        "\r\n",
+        code, statusText(code),
+        contentType ? "Content-Type: " : "", contentType ? contentType : "", contentType ? "\r\n" : "",
+        (unsigned)contentLength,
+        conn.isKeepAlive ? "keep-alive" : "close",
+        extraHeaders ? extraHeaders : "");
+
+      conn.client.write((const uint8_t*)header, min((size_t)length, sizeof(header) - 1));
+    }
+
+
+    /**
+     * Send response, the part of the body the send buffer doesn't take
+     * is copied and streamed as the client acknowledges, the request is
+     * finished once it is sent
+     * @param conn        Connection
+     * @param code        HTTP status code
+     * @param contentType Content type
+     * @param body        Response body
+     */
+    void send(Connection &conn, int code, const char *contentType, const char *body) {
+      size_t length = body ? strlen(body) : 0;
+
+      this->sendHeaders(conn, code, contentType, length, NULL);
+
+      size_t written = min(length, (size_t)conn.client.availableForWrite());
+      if (written)
+        conn.client.write((const uint8_t*)body, written);
+
+      if (written == length) {
+        this->finishRequest(conn);
+        return;
+      }
+
+      // Body lives in the scratch arena, which is released after the request
+      conn.response.reset(new (std::nothrow) char[length - written]);
+      if (!conn.response) {
+        Serial1.println("HTTP: No memory for response");
+        this->closeConnection(conn);
+        return;
+      }
+
+      memcpy(conn.response.get(), body + written, length - written);
+      conn.responseLength = length - written;
+      conn.responseOffset = 0;
+      conn.state = Connection::STATE_SEND_RESPONSE;
+    }
+
+
+    /**
+     * Send body built by a callback, 503 if it returned NULL because
+     * the scratch arena was out of memory
+     * @param conn        Connection
+     * @param contentType Content type
+     * @param body        Body, NULL if not built
+     */
+    void sendResult(Connection &conn, const char *contentType, const char *body) {
+      if (!body) {
+        this->sendError(conn, 503);
+        return;
+      }
+
+      this->send(conn, 200, contentType, body);
+    }
+
+
+    /**
+     * Send error response and close the connection
+     * @param conn Connection
+     * @param code HTTP status code
+     */
+    void sendError(Connection &conn, int code) {
+      conn.isKeepAlive = false;
+      this->send(conn, code, "text/plain", statusText(code));
+    }
+
+
+    /**
+     * Request is done, wait for next request or close connection
+     * @param conn Connection
+     */
+    void finishRequest(Connection &conn) {
+      m_stats.requests++;
+      m_latency.observe(micros() - conn.requestStart);
+      conn.numRequests++;
+
+      if (!conn.isKeepAlive || conn.numRequests >= H801_HTTP_KEEPALIVE_MAX) {
+        this->closeConnection(conn);
+        return;
+      }
+
+      conn.state = Connection::STATE_REQUEST_LINE;
+      conn.lineLength = 0;
+      conn.lastActive = millis();
+    }
+
+
+    /**
+     * Close connection and release its slot
+     * @param conn Connection
+     */
+    void closeConnection(Connection &conn) {
+      if (conn.state == Connection::STATE_UPLOAD && m_update.isResumable) {
+        Serial1.printf("HTTP: Firmware upload interrupted at %u bytes\n", (unsigned)Update.progress());
+        m_update.lastActive = millis();
+      }
+      else if (conn.state == Connection::STATE_UPLOAD_HEADERS || conn.state == Connection::STATE_UPLOAD) {
+        Serial1.println("HTTP: Firmware upload aborted");
+        Update.end(false);
+      }
+
+      if (m_bodyOwner == &conn)
+        m_bodyOwner = NULL;
+      conn.response.reset();
+
+      conn.client.stop();
+      conn.state = Connection::STATE_FREE;
+    }
+
+
+    /**
+     * Find embedded asset
+     * @param  path Request path
+     * @return Asset or NULL if not found
+     */
+    static const H801_Asset* findAsset(const char *path) {
+      // Entry page
+      if (!strcmp(path, "/"))
+        path = "/index.html";
+
+      for (const H801_Asset &asset : s_assets) {
+        if (!strcmp(path, asset.path) || (asset.hashedPath && !strcmp(path, asset.hashedPath)))
+          return &asset;
+      }
+      return NULL;
     }
 
 
     /**
-     * HTTP GET root/index page
+     * Start streaming embedded asset, or 304 if client has it cached
+     * @param conn  Connection
+     * @param asset Asset
+     * @param path  Request path
      */
-    void send_Data(const char* type, const char *data) {
-      //m_httpServer.sendHeader("Cache-Control", "max-age=86400");
-      m_httpServer.send(200, type, data);
+    void send_Asset(Connection &conn, const H801_Asset *asset, const char *path) {
+      // Hashed name never changes content, original name must be revalidated
+      bool isHashed = asset->hashedPath && !strcmp(path, asset->hashedPath);
+
+      char headers[160];
+      snprintf(headers, sizeof(headers), "Cache-Control: %s\r\nETag: %s\r\n%s",
+               isHashed ? "public, max-age=31536000, immutable" : "no-cache",
+               asset->etag,
+               asset->isGzip ? "Content-Encoding: gzip\r\n" : "");
+
+      if (*conn.ifNoneMatch && strstr(conn.ifNoneMatch, asset->etag)) {
+        this->sendHeaders(conn, 304, NULL, 0, headers);
+        this->finishRequest(conn);
+        return;
+      }
+
+      this->sendHeaders(conn, 200, asset->contentType, asset->length, headers);
+
+      conn.asset = asset;
+      conn.assetOffset = 0;
+      conn.state = Connection::STATE_SEND_ASSET;
     }
 
 
     /**
      * HTTP POST status
      */
-    void post_Status() {
-      m_jsonBuffer.clear();
-      
+    void post_Status(Connection &conn) {
       // Check if body received
-      if (m_httpServer.hasArg("plain")== false) { 
-        m_httpServer.send(406, "application/json", "{ \"message\": \"Body not received\"}");
+      if (!conn.bodyLength) {
+        this->send(conn, 406, "application/json", "{ \"message\": \"Body not received\"}");
         return;
       }
 
-      Serial1.print("POST Input: ");
-      //Serial1.println(m_httpServer.arg("plain"));
+      StaticJsonBuffer<1024> *jsonBuffer = m_scratch.jsonBuffer<1024>();
+      if (!jsonBuffer) {
+        this->sendError(conn, 503);
+        return;
+      }
 
-      m_jsonBuffer.clear();
       // Parse the json
-      JsonObject& json = m_jsonBuffer.parseObject(m_httpServer.arg("plain"));
+      JsonObject& json = jsonBuffer->parseObject(m_body);
 
       // Failed to parse json
       if (!json.success()) {
-        m_httpServer.send(406, "application/json", "{ \"message\": \"invalid JSON\"}");
+        m_stats.parseFailed++;
+        this->send(conn, 406, "application/json", "{ \"message\": \"invalid JSON\"}");
         return;
       }
 
@@ -71,31 +415,47 @@ class H801_HTTP {
       json.printTo(Serial1);
       Serial1.println();
 
-      const char *jsonString = m_functions->set_Status("HTTP", json);
-      m_httpServer.send(200, "application/json", jsonString);
-      return;
+      this->sendResult(conn, "application/json", m_functions->set_Status("HTTP", json));
     }
 
 
     /**
      * HTTP GET status
+     * @param query URL encoded arguments, NULL if none
      */
-    void get_Status() {
-      int numArgs = 0;
-
+    void get_Status(Connection &conn, char *query) {
       // Check if we have arguments
-      if ((numArgs = m_httpServer.args()) == 0) {
-        m_httpServer.send(200, "application/json", m_functions->get_Status());
+      if (!query || !*query) {
+        this->sendResult(conn, "application/json", m_functions->get_Status());
         return;
       }
 
+      StaticJsonBuffer<1024> *jsonBuffer = m_scratch.jsonBuffer<1024>();
+      if (!jsonBuffer) {
+        this->sendError(conn, 503);
+        return;
+      }
 
-      m_jsonBuffer.clear();
-      JsonObject& json = m_jsonBuffer.createObject();
+      JsonObject& json = jsonBuffer->createObject();
 
-      // Convert to JSON
-      for (int i = 0; i < numArgs; i++) {
-        json[m_httpServer.argName(i)] = m_httpServer.arg(i); 
+      // Convert to JSON, the decoded strings stay in the URI buffer during the request
+      char *next = query;
+      while (next) {
+        char *arg = next;
+        next = strchr(arg, '&');
+        if (next)
+          *next++ = '\0';
+
+        char *value = strchr(arg, '=');
+        if (value)
+          *value++ = '\0';
+
+        urlDecode(arg);
+        if (value)
+          urlDecode(value);
+
+        if (*arg)
+          json[(const char*)arg] = (const char*)(value ? value : "");
       }
 
       Serial1.print("HTTP GET: ");
@@ -104,47 +464,37 @@ class H801_HTTP {
 
       const char *jsonString = m_functions->set_Status("HTTP", json);
       if (!jsonString) {
-        m_httpServer.send(406, "application/json", "{ \"message\": \"Unable to update lights\"}");
+        this->send(conn, 406, "application/json", "{ \"message\": \"Unable to update lights\"}");
+        return;
       }
 
-      m_httpServer.send(200, "application/json", jsonString);
-    }
-
-
-    /**
-     * HTTP GET info
-     */
-    void get_Info() {
-      m_httpServer.send(200, "application/json", m_functions->get_Info());
-    }
-
-
-    /**
-     * HTTP GET config
-     */
-    void get_Config() {
-      m_httpServer.send(200, "application/json", m_functions->get_Config());
+      this->send(conn, 200, "application/json", jsonString);
     }
 
 
     /**
      * HTTP POST config
      */
-    void post_Config() {
+    void post_Config(Connection &conn) {
       // Check if body received
-      if (m_httpServer.hasArg("plain")== false) { 
-        m_httpServer.send(406, "application/json", "{ \"message\": \"Body not received\"}");
+      if (!conn.bodyLength) {
+        this->send(conn, 406, "application/json", "{ \"message\": \"Body not received\"}");
         return;
       }
 
-      m_jsonBuffer.clear();
+      StaticJsonBuffer<1024> *jsonBuffer = m_scratch.jsonBuffer<1024>();
+      if (!jsonBuffer) {
+        this->sendError(conn, 503);
+        return;
+      }
 
       // Parse the json
-      JsonObject& json = m_jsonBuffer.parseObject(m_httpServer.arg("plain"));
+      JsonObject& json = jsonBuffer->parseObject(m_body);
 
       // Failed to parse json
       if (!json.success()) {
-        m_httpServer.send(406, "application/json", "{ \"message\": \"invalid JSON\"}");
+        m_stats.parseFailed++;
+        this->send(conn, 406, "application/json", "{ \"message\": \"invalid JSON\"}");
         return;
       }
 
@@ -152,94 +502,758 @@ class H801_HTTP {
       json.printTo(Serial1);
       Serial1.println();
 
-      const char *jsonString = m_functions->set_Config("HTTP", json);
-      m_httpServer.send(200, "application/json", jsonString);
-      return;
+      this->sendResult(conn, "application/json", m_functions->set_Config("HTTP", json));
     }
 
+
     /**
      * HTTP DELETE config
      */
-    void delete_Config() {
+    void delete_Config(Connection &conn) {
       m_functions->reset_Config();
-      m_httpServer.send(200, "application/json", "{}");
+      this->send(conn, 200, "application/json", "{}");
+    }
+
+
+    /**
+     * HTTP GET update, firmware upload form
+     */
+    void get_Update(Connection &conn) {
+      this->send(conn, 200, "text/html",
+        "<html><body><form method='POST' action='' enctype='multipart/form-data'>"
+        "<input type='file' name='update' accept='.bin,.gz'><input type='submit' value='Update'>"
+        "</form></body></html>");
+    }
+
+
+    /**
+     * Is a firmware upload in progress on another connection
+     * @param conn Connection to ignore
+     */
+    bool isUploading(Connection &conn) {
+      for (Connection &other : m_connections) {
+        if (&other != &conn &&
+            (other.state == Connection::STATE_UPLOAD_HEADERS || other.state == Connection::STATE_UPLOAD))
+          return true;
+      }
+      return false;
+    }
+
+
+    /**
+     * Bytes stored of interrupted upload that matches the request
+     * @param  conn Connection
+     * @return Bytes received, 0 if the upload has to start over
+     */
+    size_t updateReceived(Connection &conn) {
+      if (!m_update.isResumable || !Update.isRunning() ||
+          m_update.size != conn.rangeTotal || strcmp(m_update.md5, conn.md5))
+        return 0;
+
+      return Update.progress();
+    }
+
+
+    /**
+     * Drop interrupted resumable upload
+     */
+    void abort_Update() {
+      if (m_update.isResumable && Update.isRunning()) {
+        Serial1.println("HTTP: Interrupted firmware upload dropped");
+        Update.end(false);
+      }
+      m_update.isResumable = false;
+    }
+
+
+    /**
+     * Send progress of resumable upload
+     * @param conn     Connection
+     * @param code     HTTP status code
+     * @param received Bytes stored
+     */
+    void send_UpdateProgress(Connection &conn, int code, size_t received) {
+      char headers[48] = "";
+      if (received)
+        snprintf(headers, sizeof(headers), "Range: bytes=0-%u\r\n", (unsigned)(received - 1));
+
+      char body[48];
+      snprintf(body, sizeof(body), "{\"received\":%u,\"size\":%u}", (unsigned)received, (unsigned)conn.rangeTotal);
+
+      this->sendHeaders(conn, code, "application/json", strlen(body), headers);
+      conn.client.write((const uint8_t*)body, strlen(body));
+      this->finishRequest(conn);
+    }
+
+
+    /**
+     * Start firmware upload, body is either the raw image or a multipart form
+     */
+    void start_Update(Connection &conn) {
+      if (this->isUploading(conn)) {
+        this->sendError(conn, 503);
+        return;
+      }
+
+      // Piece of resumable upload
+      if (conn.hasRange) {
+        this->resume_Update(conn);
+        return;
+      }
+
+      Serial1.printf("HTTP: Firmware upload, %u bytes\n", (unsigned)conn.contentLength);
+      this->abort_Update();
+
+      // Raw image
+      if (!*conn.boundary) {
+        this->begin_Update(conn, conn.contentLength);
+        return;
+      }
+
+      // Multipart, skip part headers before the image
+      conn.bodyLength = 0;
+      conn.lineLength = 0;
+      conn.state = Connection::STATE_UPLOAD_HEADERS;
+    }
+
+
+    /**
+     * Continue resumable upload, each request is a raw piece of the image
+     * with "Content-Range: bytes <start>-<end>/<total>".
+     * A Content-Range with only the total and no body asks for the progress
+     * @param conn Connection
+     */
+    void resume_Update(Connection &conn) {
+      size_t received = this->updateReceived(conn);
+
+      if (!conn.rangeTotal || *conn.boundary) {
+        this->sendError(conn, 400);
+        return;
+      }
+
+      // Status query
+      if (conn.rangeStart < 0) {
+        if (conn.contentLength)
+          conn.isKeepAlive = false;
+        this->send_UpdateProgress(conn, 202, received);
+        return;
+      }
+
+      if (conn.rangeEnd < (size_t)conn.rangeStart || conn.rangeEnd >= conn.rangeTotal ||
+          conn.rangeEnd - conn.rangeStart + 1 != conn.contentLength) {
+        this->sendError(conn, 400);
+        return;
+      }
+
+      // First piece starts a new upload
+      if (conn.rangeStart == 0) {
+        Serial1.printf("HTTP: Resumable firmware upload, %u bytes\n", (unsigned)conn.rangeTotal);
+        this->abort_Update();
+
+        if (!this->begin_Update(conn, conn.rangeTotal))
+          return;
+
+        m_update.isResumable = true;
+        m_update.size = conn.rangeTotal;
+        strlcpy(m_update.md5, conn.md5, sizeof(m_update.md5));
+      }
+      // Client has to continue from what is stored
+      else if ((size_t)conn.rangeStart != received) {
+        conn.isKeepAlive = false;
+        this->send_UpdateProgress(conn, 416, received);
+        return;
+      }
+      else {
+        conn.state = Connection::STATE_UPLOAD;
+      }
+
+      conn.uploadRemaining = conn.contentLength;
+    }
+
+
+    /**
+     * Start writing firmware image to flash
+     * @param  conn      Connection
+     * @param  imageSize Size of image
+     * @return false if failure
+     */
+    bool begin_Update(Connection &conn, size_t imageSize) {
+      if (!imageSize || !Update.begin(imageSize)) {
+        Update.printError(Serial1);
+        this->sendError(conn, 500);
+        return false;
+      }
+
+      // Image is verified by Update.end() before it is used
+      if (*conn.md5 && !Update.setMD5(conn.md5)) {
+        Update.end(false);
+        this->sendError(conn, 400);
+        return false;
+      }
+
+      conn.uploadRemaining = imageSize;
+      conn.state = Connection::STATE_UPLOAD;
+      return true;
+    }
+
+
+    /**
+     * Firmware image written, verify and restart
+     */
+    void end_Update(Connection &conn) {
+      // Upload is complete, also when verification fails
+      conn.state = Connection::STATE_BODY;
+      m_update.lastActive = millis();
+
+      // More pieces to come
+      if (m_update.isResumable && Update.progress() < m_update.size) {
+        this->send_UpdateProgress(conn, 202, Update.progress());
+        return;
+      }
+      m_update.isResumable = false;
+
+      if (!Update.end(true)) {
+        Update.printError(Serial1);
+        this->sendError(conn, 500);
+        return;
+      }
+
+      // DMX and mirror keep running until the new image is verified
+      WiFiUDP::stopAll();
+      Serial1.println("HTTP: Firmware update done, rebooting");
+
+      conn.isKeepAlive = false;
+      this->send(conn, 200, "text/plain", "Update Success! Rebooting...");
+      m_restartTime = millis() + 500;
+    }
+
+
+    /**
+     * Route request to handler
+     * @param conn Connection
+     */
+    void handleRequest(Connection &conn) {
+      // JSON buffers and strings of the request
+      H801_ScratchScope scope(m_scratch);
+
+      char *query = strchr(conn.uri, '?');
+      if (query)
+        *query++ = '\0';
+
+      const char *path = conn.uri;
+      bool isGet = conn.method == Connection::METHOD_GET;
+
+      // Static content
+      const H801_Asset *asset = isGet ? findAsset(path) : NULL;
+      if (asset)
+        this->send_Asset(conn, asset, path);
+
+      // Data content
+      else if (!strcmp(path, "/status") && isGet)
+        this->get_Status(conn, query);
+      else if (!strcmp(path, "/status") && conn.method == Connection::METHOD_POST)
+        this->post_Status(conn);
+
+      else if (!strcmp(path, "/config") && isGet)
+        this->sendResult(conn, "application/json", m_functions->get_Config());
+      else if (!strcmp(path, "/config") && conn.method == Connection::METHOD_POST)
+        this->post_Config(conn);
+      else if (!strcmp(path, "/config") && conn.method == Connection::METHOD_DELETE)
+        this->delete_Config(conn);
+
+      else if (!strcmp(path, "/info") && isGet)
+        this->sendResult(conn, "application/json", m_functions->get_Info());
+
+      else if (!strcmp(path, "/scenes") && isGet)
+        this->sendResult(conn, "application/json", m_functions->get_Scenes());
+
+      else if (!strcmp(path, "/metrics") && isGet)
+        this->sendResult(conn, "text/plain; version=0.0.4", m_functions->get_Metrics());
+
+      else if (!strcmp(path, "/update") && isGet)
+        this->get_Update(conn);
+
+      else
+        this->send(conn, 404, "text/plain", "FileNotFound");
+    }
+
+
+    /**
+     * Handle request line or header line
+     * @param conn Connection
+     */
+    void handleLine(Connection &conn) {
+      char *line = conn.line;
+
+      // Request line, "<method> <uri> HTTP/1.x"
+      if (conn.state == Connection::STATE_REQUEST_LINE) {
+        // Ignore empty lines between requests
+        if (!*line)
+          return;
+        conn.requestStart = micros();
+
+        char *uri = strchr(line, ' ');
+        char *version = uri ? strchr(uri + 1, ' ') : NULL;
+        if (!version) {
+          this->sendError(conn, 400);
+          return;
+        }
+        *uri++ = '\0';
+        *version++ = '\0';
+
+        if (!strcmp(line, "GET"))
+          conn.method = Connection::METHOD_GET;
+        else if (!strcmp(line, "POST"))
+          conn.method = Connection::METHOD_POST;
+        else if (!strcmp(line, "DELETE"))
+          conn.method = Connection::METHOD_DELETE;
+        else
+          conn.method = Connection::METHOD_OTHER;
+
+        if (strlcpy(conn.uri, uri, sizeof(conn.uri)) >= sizeof(conn.uri)) {
+          this->sendError(conn, 431);
+          return;
+        }
+
+        // HTTP/1.1 defaults to keep-alive
+        conn.isKeepAlive = !strcmp(version, "HTTP/1.1");
+        conn.contentLength = 0;
+        conn.bodyLength = 0;
+        *conn.boundary = '\0';
+        *conn.ifNoneMatch = '\0';
+        *conn.md5 = '\0';
+        conn.hasRange = false;
+        conn.rangeStart = 0;
+        conn.rangeEnd = 0;
+        conn.rangeTotal = 0;
+        conn.state = Connection::STATE_HEADERS;
+        return;
+      }
+
+      // Header line
+      if (*line) {
+        char *value = strchr(line, ':');
+        if (!value)
+          return;
+        *value++ = '\0';
+        while (*value == ' ')
+          value++;
+
+        if (!strcasecmp(line, "Content-Length")) {
+          conn.contentLength = strtoul(value, NULL, 10);
+        }
+        else if (!strcasecmp(line, "Connection")) {
+          if (!strncasecmp(value, "close", 5))
+            conn.isKeepAlive = false;
+          else if (!strncasecmp(value, "keep-alive", 10))
+            conn.isKeepAlive = true;
+        }
+        else if (!strcasecmp(line, "If-None-Match")) {
+          strlcpy(conn.ifNoneMatch, value, sizeof(conn.ifNoneMatch));
+        }
+        else if (!strcasecmp(line, "X-MD5")) {
+          if (strlen(value) != sizeof(conn.md5) - 1) {
+            this->sendError(conn, 400);
+            return;
+          }
+          strlcpy(conn.md5, value, sizeof(conn.md5));
+        }
+        else if (!strcasecmp(line, "Content-Range")) {
+          unsigned start, end, total;
+          conn.hasRange = true;
+          if (sscanf(value, "bytes %u-%u/%u", &start, &end, &total) == 3) {
+            conn.rangeStart = start;
+            conn.rangeEnd   = end;
+            conn.rangeTotal = total;
+          }
+          else if (sscanf(value, "bytes */%u", &total) == 1) {
+            conn.rangeStart = -1;
+            conn.rangeTotal = total;
+          }
+        }
+        else if (!strcasecmp(line, "Content-Type")) {
+          const char *boundary = strstr(value, "boundary=");
+          if (boundary)
+            snprintf(conn.boundary, sizeof(conn.boundary), "--%s", boundary + 9);
+        }
+        return;
+      }
+
+      // Empty line, end of headers
+      if (conn.method == Connection::METHOD_POST && !strcmp(conn.uri, "/update")) {
+        this->start_Update(conn);
+        return;
+      }
+
+      if (conn.contentLength > H801_HTTP_BODY_MAX) {
+        this->sendError(conn, 413);
+        return;
+      }
+
+      if (conn.contentLength) {
+        conn.state = Connection::STATE_BODY;
+        return;
+      }
+
+      this->handleRequest(conn);
+    }
+
+
+    /**
+     * Read request and header lines
+     * @param  conn Connection
+     * @return false if no more data available
+     */
+    bool readLines(Connection &conn) {
+      while (conn.client.available()) {
+        int c = conn.client.read();
+        if (c < 0)
+          return false;
+
+        if (conn.state == Connection::STATE_UPLOAD_HEADERS)
+          conn.bodyLength++;
+
+        if (c == '\r')
+          continue;
+
+        if (c != '\n') {
+          if (conn.lineLength >= sizeof(conn.line) - 1) {
+            this->sendError(conn, 431);
+            return false;
+          }
+          conn.line[conn.lineLength++] = (char)c;
+          continue;
+        }
+
+        conn.line[conn.lineLength] = '\0';
+        conn.lineLength = 0;
+
+        if (conn.state == Connection::STATE_UPLOAD_HEADERS) {
+          this->handleUploadLine(conn);
+        }
+        else {
+          this->handleLine(conn);
+        }
+
+        // Request complete or state changed to body
+        if (conn.state != Connection::STATE_REQUEST_LINE &&
+            conn.state != Connection::STATE_HEADERS &&
+            conn.state != Connection::STATE_UPLOAD_HEADERS)
+          return true;
+      }
+      return false;
+    }
+
+
+    /**
+     * Handle multipart header line of firmware upload
+     * Image ends with "\r\n<boundary>--\r\n"
+     * @param conn Connection
+     */
+    void handleUploadLine(Connection &conn) {
+      // Boundary and part headers
+      if (*conn.line)
+        return;
+
+      size_t trailer = strlen(conn.boundary) + 6;
+      if (conn.contentLength < conn.bodyLength + trailer) {
+        this->sendError(conn, 400);
+        return;
+      }
+
+      this->begin_Update(conn, conn.contentLength - conn.bodyLength - trailer);
+    }
+
+
+    /**
+     * Process connection, spends at most the time left of the budget
+     * @param conn  Connection
+     * @param start micros() when the loop started
+     */
+    void processConnection(Connection &conn, unsigned long start) {
+      // Client disconnected
+      if (!conn.client.connected() && !conn.client.available()) {
+        this->closeConnection(conn);
+        return;
+      }
+
+      while (conn.state != Connection::STATE_FREE && micros() - start < H801_HTTP_LOOP_BUDGET) {
+        switch (conn.state) {
+          case Connection::STATE_REQUEST_LINE:
+          case Connection::STATE_HEADERS:
+          case Connection::STATE_UPLOAD_HEADERS:
+            if (!this->readLines(conn))
+              return;
+            break;
+
+          case Connection::STATE_BODY: {
+            if (m_bodyOwner && m_bodyOwner != &conn)
+              return;
+            m_bodyOwner = &conn;
+
+            size_t length = conn.client.read((uint8_t*)m_body + conn.bodyLength,
+                                             conn.contentLength - conn.bodyLength);
+            if (!length)
+              return;
+
+            conn.bodyLength += length;
+            if (conn.bodyLength < conn.contentLength)
+              return;
+
+            m_body[conn.bodyLength] = '\0';
+            this->handleRequest(conn);
+            m_bodyOwner = NULL;
+            break;
+          }
+
+          case Connection::STATE_UPLOAD: {
+            static uint8_t buffer[H801_HTTP_CHUNK_SIZE];
+
+            // Image done, drop multipart trailer
+            if (!conn.uploadRemaining) {
+              while (conn.client.available() && conn.bodyLength < conn.contentLength) {
+                conn.client.read();
+                conn.bodyLength++;
+              }
+              if (conn.bodyLength < conn.contentLength && *conn.boundary)
+                return;
+
+              this->end_Update(conn);
+              break;
+            }
+
+            size_t length = conn.client.read(buffer, min(conn.uploadRemaining, sizeof(buffer)));
+            if (!length)
+              return;
+
+            // Gzip image is stored as is, the bootloader unpacks it
+            if (!Update.progress() && buffer[0] == 0x1f)
+              Serial1.println("HTTP: Firmware image is compressed");
+
+            if (Update.write(buffer, length) != length) {
+              Update.printError(Serial1);
+              m_update.isResumable = false;
+              this->sendError(conn, 500);
+              return;
+            }
+
+            conn.uploadRemaining -= length;
+            conn.bodyLength += length;
+            break;
+          }
+
+          case Connection::STATE_SEND_ASSET: {
+            static uint8_t buffer[H801_HTTP_CHUNK_SIZE];
+
+            size_t remaining = conn.asset->length - conn.assetOffset;
+            if (!remaining) {
+              this->finishRequest(conn);
+              break;
+            }
+
+            // Wait until the client can take a full chunk
+            size_t length = min(remaining, sizeof(buffer));
+            if (conn.client.availableForWrite() < length)
+              return;
+
+            memcpy_P(buffer, conn.asset->data + conn.assetOffset, length);
+            if (conn.client.write(buffer, length) != length) {
+              this->closeConnection(conn);
+              return;
+            }
+
+            conn.assetOffset += length;
+            break;
+          }
+
+          case Connection::STATE_SEND_RESPONSE: {
+            size_t remaining = conn.responseLength - conn.responseOffset;
+            if (!remaining) {
+              conn.response.reset();
+              this->finishRequest(conn);
+              break;
+            }
+
+            // Only what the send buffer takes, writes never wait for the client
+            size_t length = min(remaining, (size_t)conn.client.availableForWrite());
+            if (!length)
+              return;
+
+            if (conn.client.write((const uint8_t*)conn.response.get() + conn.responseOffset, length) != length) {
+              this->closeConnection(conn);
+              return;
+            }
+
+            conn.responseOffset += length;
+            break;
+          }
+
+          default:
+            return;
+        }
+
+        conn.lastActive = millis();
+      }
     }
 
 
   public:
-    H801_HTTP(H801_Config &config, PH801_Functions functions):
+    H801_HTTP(H801_Config &config, H801_Scratch &scratch, PH801_Functions functions):
         m_config(config),
-        m_httpServer(80),
-        m_httpUpdater() {
+        m_scratch(scratch),
+        m_httpServer(H801_HTTP_PORT),
+        m_nextConnection(0),
+        m_bodyOwner(NULL),
+        m_restartTime(0) {
 
       m_functions = functions;
+      memset(&m_stats, 0, sizeof(m_stats));
+      memset(&m_update, 0, sizeof(m_update));
+
+      for (Connection &conn : m_connections)
+        conn.state = Connection::STATE_FREE;
     }
 
 
     /**
      * Setup HTTP server
-     * @param config Configuration
      */
     void setup() {
       MDNS.begin(getHostname());
 
-      m_httpUpdater.setup(&m_httpServer);
-      
-
-      // Static contentent
-      m_httpServer.on("/",           HTTP_GET, [&]() {
-        this->send_File("text/html", "/index.html");
-      });
-      m_httpServer.on("/index.html", HTTP_GET, [&]() {
-        this->send_File("text/html", "/index.html");
-      });
-      m_httpServer.on("/favicon.gif", HTTP_GET, [&]() {
-        this->send_File("image/gif", "favicon.gif");
-      });
-      m_httpServer.on("/iro.min.js", HTTP_GET, [&]() {
-        this->send_File("text/javascript", "/iro.min.js");
-      });
-      m_httpServer.on("/bundle.js", HTTP_GET, [&]() {
-        this->send_File("text/javascript", "/bundle.js.gz");
-      });
-      m_httpServer.on("/icons.woff", HTTP_GET, [&]() {
-        this->send_File("application/font-woff", "/icons.woff");
-      });
+      m_httpServer.begin();
+      m_httpServer.setNoDelay(true);
 
+      MDNS.addService("http", "tcp", H801_HTTP_PORT);
+    }
 
-      // Data content
-      m_httpServer.on("/status", HTTP_GET,  [&]() {
-        this->get_Status();
-      });
-      m_httpServer.on("/status", HTTP_POST, [&]() {
-        this->post_Status();
-      });
-
-      m_httpServer.on("/config", HTTP_GET, [&]() {
-        this->get_Config();
-      });      
-      m_httpServer.on("/config", HTTP_POST, [&]() {
-        this->post_Config();
-      });
-      m_httpServer.on("/config", HTTP_DELETE, [&]() {
-        this->delete_Config();
-      });
-
-      m_httpServer.on("/info", HTTP_GET, [&]() {
-        this->get_Info();
-      });      
 
+    /**
+     * HTTP loop, accepts new connections and processes open ones
+     * within the time budget
+     */
+    void loop() {
+      unsigned long start = micros();
+      unsigned long time = millis();
 
-      m_httpServer.begin();
+      // Firmware updated, restart once the response is sent
+      if (m_restartTime && (long)(time - m_restartTime) >= 0) {
+        ESP.restart();
+      }
+
+      // Interrupted upload was not resumed
+      if (m_update.isResumable && time - m_update.lastActive > H801_HTTP_UPDATE_TIMEOUT) {
+        bool isActive = false;
+        for (Connection &conn : m_connections) {
+          if (conn.state == Connection::STATE_UPLOAD)
+            isActive = true;
+        }
+        if (!isActive)
+          this->abort_Update();
+      }
 
-      MDNS.addService("http", "tcp", 80);
+      // Accept new connection
+      WiFiClient client = m_httpServer.available();
+      if (client) {
+        Connection *freeConn = NULL;
+        for (Connection &conn : m_connections) {
+          if (conn.state == Connection::STATE_FREE) {
+            freeConn = &conn;
+            break;
+          }
+        }
+
+        if (freeConn) {
+          m_stats.connections++;
+
+          freeConn->client       = client;
+          freeConn->state        = Connection::STATE_REQUEST_LINE;
+          freeConn->lastActive   = time;
+          freeConn->numRequests  = 0;
+          freeConn->requestStart = micros();
+          freeConn->lineLength   = 0;
+          freeConn->client.setNoDelay(true);
+        }
+        else {
+          m_stats.rejected++;
+          static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+          client.write((const uint8_t*)busy, sizeof(busy) - 1);
+          client.stop();
+        }
+      }
+
+      // Process connections round robin, a different one starts each loop
+      for (size_t i = 0; i < countof(m_connections); i++) {
+        Connection &conn = m_connections[(m_nextConnection + i) % countof(m_connections)];
+        if (conn.state == Connection::STATE_FREE)
+          continue;
+
+        // Idle keep-alive or stalled request
+        if (time - conn.lastActive > H801_HTTP_KEEPALIVE_TIMEOUT && !conn.client.available()) {
+          this->closeConnection(conn);
+          continue;
+        }
+
+        if (micros() - start >= H801_HTTP_LOOP_BUDGET)
+          break;
+
+        this->processConnection(conn, start);
+      }
+      m_nextConnection = (m_nextConnection + 1) % countof(m_connections);
     }
 
 
-    void loop() {
-      m_httpServer.handleClient();
+    /**
+     * Has open connections, an unfinished upload or a pending restart
+     */
+    bool isBusy() {
+      for (Connection &conn : m_connections) {
+        if (conn.state != Connection::STATE_FREE)
+          return true;
+      }
+      return m_update.isResumable || m_restartTime;
+    }
+
+
+    /**
+     * Add HTTP information to JSON object
+     * @param root JSON object
+     */
+    void appendInfo(JsonObject& root) {
+      size_t numOpen = 0;
+      for (Connection &conn : m_connections) {
+        if (conn.state != Connection::STATE_FREE)
+          numOpen++;
+      }
+
+      JsonObject& jsonHTTP = root.createNestedObject("http");
+      jsonHTTP["open"]        = numOpen;
+      jsonHTTP["connections"] = m_stats.connections;
+      jsonHTTP["requests"]    = m_stats.requests;
+      jsonHTTP["rejected"]    = m_stats.rejected;
+    }
+
+
+    /**
+     * Number of handled requests
+     */
+    uint32_t requests() {
+      return m_stats.requests;
     }
-};
 
 
+    /**
+     * Number of request bodies that weren't valid JSON
+     */
+    uint32_t parseFailures() {
+      return m_stats.parseFailed;
+    }
 
+
+    /**
+     * Time from request line to the end of the response
+     */
+    const H801_Histogram& latency() {
+      return m_latency;
+    }
+};
@@ -13,65 +13,68 @@ static const uint16_t s_gammaTable[] = {
 static_assert(countof(s_gammaTable) == 1024, "Gamma-table countof must be 1024");
 
 /**
- * H801 Led
+ * H801 Led, the output is written through the PWM driver policy
  */
-class H801_Led {
+template <typename PWM>
+class H801_LedT {
 private:
   String   m_id;
   uint16_t m_bri;
   uint16_t m_currBri;
+  uint8_t  m_targetBri;
 
   double    m_fadeBri;
   double    m_fadeStep;
   uint32_t  m_fadeNum;
 
   uint8_t  m_pwm_index;
-  struct {
-    uint32_t mux;
-    uint32_t func;
-    uint32_t num;
-  } m_pwm_pin;
+  uint8_t  m_gpio;
 
-public:
   /**
-   * H801 led constructor
-   * @param id        ID of light
-   * @param pwm_index pwm index
-   * @param pin_mux   pwm mux value
-   * @param pin_func  pwm func value
-   * @param pin_num   pin number
+   * Write brightness to the output
    */
-  H801_Led(String id, uint8_t pwm_index, uint32_t pin_mux, uint32_t pin_func, uint32_t pin_num):
-      m_pwm_pin{.mux = pin_mux, .func = pin_func, .num = pin_num},
-      m_id(id),
-      m_pwm_index(pwm_index),
-      m_bri(0),
-      m_currBri(0),
-      m_fadeBri(0),
-      m_fadeStep(0),
-      m_fadeNum(0) {
-    pinMode(m_pwm_pin.num, OUTPUT);
-    digitalWrite(m_pwm_pin.num, 0);
+  void write() {
+    PWM::setDuty(m_pwm_index, m_gpio, s_gammaTable[m_bri]);
   }
 
 
-#ifdef NEW_PWM
   /**
-   * Get pwm io information
-   * @param pwm_io_info  Destionation to copy information
+   * Brightness that a number of fade steps from now would give
+   * @param  steps Number of steps
+   * @return 10-bit brightness
+   */
+  uint16_t fadeBriAt(uint32_t steps) {
+    return ((int)constrain(m_fadeBri + m_fadeStep * steps, 0x0, 0x3FF)) & 0x3FF;
+  }
+
+public:
+  /**
+   * H801 led constructor, channel is assigned by setup
    */
-  void get_IO(uint32_t pwm_io_info[3]) {
-    pwm_io_info[0] = m_pwm_pin.mux;
-    pwm_io_info[1] = m_pwm_pin.func;
-    pwm_io_info[2] = m_pwm_pin.num;
+  H801_LedT():
+      m_bri(0),
+      m_currBri(0),
+      m_targetBri(0),
+      m_fadeBri(0),
+      m_fadeStep(0),
+      m_fadeNum(0),
+      m_pwm_index(0),
+      m_gpio(0) {
   }
-#endif
 
 
   /**
    * Setup led
+   * @param index   Channel index, pwm index
+   * @param channel Board channel
    */
-  void setup() {
+  void setup(uint8_t index, const H801_BoardChannel &channel) {
+    m_id = channel.id;
+    m_pwm_index = index;
+    m_gpio = channel.gpio;
+
+    pinMode(m_gpio, OUTPUT);
+    digitalWrite(m_gpio, 0);
   }
 
 
@@ -94,15 +97,44 @@ public:
 
 
   /**
-   * Set brightness using JsonVariant
-   * @param  item      JSON object value
-   * @param  fadeSteps Number of steps to fade over
-   * @return Was the led value changed
+   * Return brightness of the last set_Bri or button fade, the end of
+   * the fade while get_Bri follows it
+   * @return brightness
+   */
+  uint8_t get_TargetBri() {
+    return m_targetBri;
+  }
+
+
+  /**
+   * Is the output fully off or on, holds without PWM
+   */
+  bool is_Static() {
+    uint16_t duty = s_gammaTable[m_bri];
+    return duty == 0 || duty == s_gammaTable[countof(s_gammaTable) - 1];
+  }
+
+
+  /**
+   * Return brightness currently on the output, differs from get_Bri during fading
+   * @return brightness
+   */
+  uint8_t get_CurrBri() {
+    return m_currBri>>2;
+  }
+
+
+  /**
+   * Convert JsonVariant to brightness value
+   * @param  item JSON object value
+   * @param  bri  Output brightness
+   * @return false if value could not be converted
    */
-  bool set_Bri(JsonVariant &item, uint32_t fadeSteps) {
+  static bool jsonToBri(const JsonVariant &item, uint8_t *bri) {
     // Number
     if (item.is<int>()) {
-      return this->set_Bri((uint8_t)constrain(item.as<int>(), 0x00, 0xFF), fadeSteps);
+      *bri = (uint8_t)constrain(item.as<int>(), 0x00, 0xFF);
+      return true;
     }
 
     // string
@@ -112,7 +144,8 @@ public:
       if (!stringToUnsignedLong(item.as<char*>(), &tmp))
         return false;
 
-      return this->set_Bri((uint8_t)constrain(tmp, 0x00, 0xFF), fadeSteps);
+      *bri = (uint8_t)constrain(tmp, 0x00, 0xFF);
+      return true;
     }
 
     // Unhandled value type
@@ -129,6 +162,7 @@ public:
   bool set_Bri(uint8_t bri, uint32_t fadeSteps) {
     // Clear any current fading
     m_fadeNum = 0;
+    m_targetBri = bri;
 
     // No change
     if (m_bri>>2 == bri)
@@ -140,11 +174,7 @@ public:
 
       // Only update on change
       if (m_bri != m_currBri) {
-#if NEW_PWM
-        pwm_set_duty(s_gammaTable[m_bri], m_pwm_index);
-#else
-        analogWrite(m_pwm_pin.num, s_gammaTable[m_bri]);
-#endif
+        this->write();
       }
 
       // Update current brightness
@@ -169,31 +199,81 @@ public:
   }
 
   /**
-   * Fade led value one step
+   * Is the led currently fading
+   * @return true if a fade is in progress
+   */
+  bool is_Fading() {
+    return m_fadeNum != 0;
+  }
+
+
+  /**
+   * Number of fade steps until the duty on the output changes, the
+   * steps in between only move the brightness within one gamma value
+   * @return Steps, the remaining steps if the duty doesn't change again
+   */
+  uint32_t next_Change() {
+    if (!m_fadeNum || m_fadeStep == 0)
+      return m_fadeNum;
+
+    // Next brightness with another duty, the gamma table only rises
+    uint16_t duty = s_gammaTable[m_currBri];
+    int next = m_currBri;
+    if (m_fadeStep > 0) {
+      while (next < 0x3FF && s_gammaTable[next] == duty)
+        next++;
+      if (s_gammaTable[next] == duty)
+        return m_fadeNum;
+    }
+    else {
+      while (next > 0x0 && s_gammaTable[next] == duty)
+        next--;
+      if (s_gammaTable[next] == duty)
+        return m_fadeNum;
+    }
+
+    // Steps to reach it, estimated and corrected for rounding
+    double estimate = ceil((next - m_fadeBri) / m_fadeStep);
+    if (estimate >= m_fadeNum)
+      return m_fadeNum;
+
+    uint32_t steps = estimate < 1 ? 1 : (uint32_t)estimate;
+    while (steps > 1 && s_gammaTable[this->fadeBriAt(steps - 1)] != duty)
+      steps--;
+    while (steps < m_fadeNum && s_gammaTable[this->fadeBriAt(steps)] == duty)
+      steps++;
+    return steps;
+  }
+
+
+  /**
+   * Fade led value a number of steps
+   * @param  steps     Steps to take, at most next_Change() to not skip a duty
+   * @param  isWritten Set when the output was written
    * @return Are we still fading
    */
-  bool do_Fade() {
+  bool do_Fade(uint32_t steps, bool &isWritten) {
     // Fading light?
     if (!m_fadeNum)
       return false;
 
+    if (steps > m_fadeNum)
+      steps = m_fadeNum;
+
     // Decrease fading counter
-    m_fadeNum--;
+    m_fadeNum -= steps;
 
-    // Fade one step
-    m_fadeBri += m_fadeStep;
+    // Fade the steps
+    m_fadeBri += m_fadeStep * steps;
     m_fadeBri = constrain(m_fadeBri, 0x0, 0x3FF);
 
     // Convert to 10-bit number
     m_bri = ((int)(m_fadeBri)) & 0x3FF;
 
-    // Only update on change
-    if (m_bri != m_currBri) {
-#if NEW_PWM
-      pwm_set_duty(s_gammaTable[m_bri], m_pwm_index);
-#else
-      analogWrite(m_pwm_pin.num, s_gammaTable[m_bri]);
-#endif
+    // Only update when the duty changes
+    if (s_gammaTable[m_bri] != s_gammaTable[m_currBri]) {
+      this->write();
+      isWritten = true;
     }
     
     // Update current brightness
@@ -231,17 +311,16 @@ public:
 
     // Only update if light has changed
     if (m_bri != m_currBri) {
-#ifdef NEW_PWM
       // Update light
-      pwm_set_duty(s_gammaTable[m_bri], m_pwm_index);
-#else 
-      analogWrite(m_pwm_pin.num, s_gammaTable[m_bri]);
-#endif
+      this->write();
     }
 
     // Update current brightness
     m_currBri = m_bri; 
 
+    // Button level is the new target, kept by the restore
+    m_targetBri = m_bri >> 2;
+
     // Have we reached the endpoints
     return m_bri != (dirUp ? 0x3FF : 0x0);
   }
@@ -256,3 +335,5 @@ public:
 */
 };
 
+// Led using the PWM driver built for
+typedef H801_LedT<H801_PWM> H801_Led;
@@ -0,0 +1,300 @@
+
+// Upper bounds of the latency histogram buckets in us, a last
+// bucket counts everything above
+static const uint32_t s_metricsBuckets[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000,
+};
+
+// Command sources counted separately, "other" holds the rest
+#define H801_METRICS_SOURCES 8
+
+
+/**
+ * Latency histogram, counts each observed time in its bucket.
+ * Only written by the loop, observing is a few compares and adds
+ */
+class H801_Histogram {
+  private:
+    uint32_t m_buckets[countof(s_metricsBuckets) + 1];
+    uint32_t m_count;
+    uint64_t m_sum;    // us
+
+  public:
+    /**
+     * H801 Histogram
+     */
+    H801_Histogram():
+        m_count(0),
+        m_sum(0) {
+      memset(m_buckets, 0, sizeof(m_buckets));
+    }
+
+
+    /**
+     * Count time
+     * @param us Time in us
+     */
+    void observe(uint32_t us) {
+      size_t i = 0;
+      while (i < countof(s_metricsBuckets) && us > s_metricsBuckets[i])
+        i++;
+
+      m_buckets[i]++;
+      m_count++;
+      m_sum += us;
+    }
+
+
+    /**
+     * Number of observed times
+     */
+    uint32_t count() const {
+      return m_count;
+    }
+
+
+    /**
+     * Sum of observed times in us
+     */
+    uint64_t sum() const {
+      return m_sum;
+    }
+
+
+    /**
+     * Observed times in bucket
+     * @param  index Bucket index, countof(s_metricsBuckets) for the last
+     * @return Count, not cumulative
+     */
+    uint32_t bucket(size_t index) const {
+      return m_buckets[index];
+    }
+};
+
+
+/**
+ * Writes metrics in the Prometheus text format to a buffer,
+ * output that doesn't fit is dropped a whole line at a time
+ */
+class H801_MetricsWriter {
+  private:
+    char *m_buffer;
+    size_t m_size;
+    size_t m_length;
+    bool m_isTruncated;
+
+
+    /**
+     * Append formatted line
+     * @param format printf format
+     */
+    void printf(const char *format, ...) {
+      if (m_isTruncated)
+        return;
+
+      va_list args;
+      va_start(args, format);
+      int length = vsnprintf(m_buffer + m_length, m_size - m_length, format, args);
+      va_end(args);
+
+      // Drop the partial line
+      if (length < 0 || (size_t)length >= m_size - m_length) {
+        m_buffer[m_length] = '\0';
+        m_isTruncated = true;
+        return;
+      }
+      m_length += length;
+    }
+
+
+    /**
+     * Format time in us as seconds, without trailing zeros
+     * @param buffer Output
+     * @param size   Size of output
+     * @param us     Time
+     */
+    static void formatSeconds(char *buffer, size_t size, uint64_t us) {
+      int length = snprintf(buffer, size, "%lu.%06lu", (unsigned long)(us / 1000000), (unsigned long)(us % 1000000));
+      if (length <= 0 || (size_t)length >= size)
+        return;
+
+      while (buffer[length - 1] == '0')
+        length--;
+      if (buffer[length - 1] == '.')
+        length--;
+      buffer[length] = '\0';
+    }
+
+
+  public:
+    /**
+     * H801 Metrics writer
+     * @param buffer Output buffer
+     * @param size   Size of buffer
+     */
+    H801_MetricsWriter(char *buffer, size_t size):
+        m_buffer(buffer),
+        m_size(size),
+        m_length(0),
+        m_isTruncated(false) {
+      if (size)
+        *buffer = '\0';
+    }
+
+
+    /**
+     * Start metric, written once before its values
+     * @param name Metric name
+     * @param type "counter", "gauge" or "histogram"
+     * @param help Description
+     */
+    void metric(const char *name, const char *type, const char *help) {
+      this->printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    }
+
+
+    /**
+     * Value of metric
+     * @param name  Metric name
+     * @param value Value
+     */
+    void value(const char *name, uint32_t value) {
+      this->printf("%s %u\n", name, value);
+    }
+
+
+    /**
+     * Value of metric with a label
+     * @param name       Metric name
+     * @param label      Label name
+     * @param labelValue Label value
+     * @param value      Value
+     */
+    void value(const char *name, const char *label, const char *labelValue, uint32_t value) {
+      this->printf("%s{%s=\"%s\"} %u\n", name, label, labelValue, value);
+    }
+
+
+    /**
+     * Histogram with its cumulative buckets, sum and count, times in seconds
+     * @param name      Metric name
+     * @param help      Description
+     * @param histogram Histogram
+     */
+    void histogram(const char *name, const char *help, const H801_Histogram &histogram) {
+      this->metric(name, "histogram", help);
+
+      char seconds[24];
+      uint32_t count = 0;
+      for (size_t i = 0; i < countof(s_metricsBuckets); i++) {
+        count += histogram.bucket(i);
+        formatSeconds(seconds, sizeof(seconds), s_metricsBuckets[i]);
+        this->printf("%s_bucket{le=\"%s\"} %u\n", name, seconds, count);
+      }
+      this->printf("%s_bucket{le=\"+Inf\"} %u\n", name, histogram.count());
+
+      formatSeconds(seconds, sizeof(seconds), histogram.sum());
+      this->printf("%s_sum %s\n", name, seconds);
+      this->printf("%s_count %u\n", name, histogram.count());
+    }
+
+
+    /**
+     * Did all metrics fit
+     */
+    bool isTruncated() {
+      return m_isTruncated;
+    }
+};
+
+
+/**
+ * H801 Metrics, counters of the command path that no single module owns.
+ * The counters are only written by the loop, never by an interrupt, so
+ * plain increments are enough and they can stay on in production
+ */
+class H801_Metrics {
+  private:
+    // Commands per source, sources are the static labels passed
+    // with the command so the pointer is compared first
+    struct {
+      const char *source;
+      uint32_t    count;
+    } m_sources[H801_METRICS_SOURCES];
+    uint32_t m_otherCommands;
+
+    uint32_t m_pwmCommits;
+
+  public:
+    /**
+     * H801 Metrics
+     */
+    H801_Metrics():
+        m_otherCommands(0),
+        m_pwmCommits(0) {
+      memset(m_sources, 0, sizeof(m_sources));
+    }
+
+
+    /**
+     * Count received command
+     * @param eventSource Label of which system sent the command
+     */
+    void countCommand(const char *eventSource) {
+      if (!eventSource) {
+        m_otherCommands++;
+        return;
+      }
+
+      for (size_t i = 0; i < countof(m_sources); i++) {
+        if (!m_sources[i].source)
+          m_sources[i].source = eventSource;
+        else if (m_sources[i].source != eventSource && strcmp(m_sources[i].source, eventSource))
+          continue;
+
+        m_sources[i].count++;
+        return;
+      }
+
+      m_otherCommands++;
+    }
+
+
+    /**
+     * Count PWM commit
+     */
+    void countPWMCommit() {
+      m_pwmCommits++;
+    }
+
+
+    /**
+     * Number of PWM commits
+     */
+    uint32_t pwmCommits() {
+      return m_pwmCommits;
+    }
+
+
+    /**
+     * Number of received commands
+     */
+    uint32_t commands() {
+      uint32_t count = m_otherCommands;
+      for (size_t i = 0; i < countof(m_sources); i++)
+        count += m_sources[i].count;
+      return count;
+    }
+
+
+    /**
+     * Write received commands per source
+     * @param out Metrics writer
+     */
+    void writeCommands(H801_MetricsWriter &out) {
+      out.metric("h801_commands_total", "counter", "Light commands received");
+      for (size_t i = 0; i < countof(m_sources) && m_sources[i].source; i++)
+        out.value("h801_commands_total", "source", m_sources[i].source, m_sources[i].count);
+      out.value("h801_commands_total", "source", "other", m_otherCommands);
+    }
+};
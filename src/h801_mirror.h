@@ -0,0 +1,263 @@
+
+// Mirror packets are sent to 239.72.1.<group>
+#define H801_MIRROR_PORT  5570
+
+// Mirror packet magic and version
+#define H801_MIRROR_MAGIC    0x524D3848 // "H8MR"
+#define H801_MIRROR_VERSION  2
+
+// Max number of channels in a mirror packet
+#define H801_MIRROR_CHANNELS 5
+
+// Each state is sent this many times, followers drop the duplicates
+#define H801_MIRROR_REPEAT 2
+
+// Packets this far behind the last sequence number are out of order,
+// larger differences are treated as a restarted leader. A rebooted
+// leader is recognized by its session instead
+#define H801_MIRROR_SEQUENCE_WINDOW 1000
+
+
+/**
+ * Committed channel state sent by the group leader
+ */
+typedef struct tagH801_MirrorPacket {
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  group;
+  uint16_t sequence;
+  uint32_t session;                            // Random, new each time the leader is set up
+  uint32_t mask;                               // Channels set
+  uint32_t fadeTime;                           // Command duration in ms
+  double   sentAt;                             // Leader server time, 0 if not synchronized
+  uint8_t  bri[H801_MIRROR_CHANNELS];          // Target brightness
+  uint32_t fadeSteps[H801_MIRROR_CHANNELS];    // Number of steps to fade over
+} H801_MirrorPacket;
+
+
+/**
+ * H801 Group mirroring, the leader multicasts each committed state
+ * and followers apply it directly
+ */
+class H801_Mirror {
+  private:
+    typedef enum {
+      ROLE_NONE,
+      ROLE_LEADER,
+      ROLE_FOLLOWER,
+    } Role;
+
+    WiFiUDP m_udp;
+    H801_Config& m_config;
+    H801_TimeSync& m_timeSync;
+    PH801_Functions m_functions;
+
+    Role      m_role;
+    IPAddress m_groupIP;
+    uint16_t  m_sequence;
+    uint32_t  m_session;      // Leader, own session. Follower, session of the sequence
+    bool      m_hasSequence;
+
+    // Counters
+    struct {
+      uint32_t sent;       // States sent by leader
+      uint32_t received;   // States applied by follower
+      uint32_t duplicate;  // Repeated or out of order packets
+      uint32_t ignored;    // Invalid packets or other group
+
+      // Leader to follower latency, only when both clocks are synchronized
+      uint32_t latencyNum;
+      double   latencySum;
+      double   latencyMin;
+      double   latencyMax;
+    } m_stats;
+
+
+    /**
+     * Track leader to follower latency
+     * @param packet    Received packet
+     * @param localTime millis() when packet was read
+     */
+    void addLatency(const H801_MirrorPacket &packet, unsigned long localTime) {
+      if (packet.sentAt <= 0 || !m_timeSync.isSynced(localTime))
+        return;
+
+      double latency = m_timeSync.toServer(localTime) - packet.sentAt;
+
+      if (!m_stats.latencyNum || latency < m_stats.latencyMin)
+        m_stats.latencyMin = latency;
+      if (!m_stats.latencyNum || latency > m_stats.latencyMax)
+        m_stats.latencyMax = latency;
+
+      m_stats.latencySum += latency;
+      m_stats.latencyNum++;
+    }
+
+
+  public:
+    /**
+     * H801 Mirror constructor
+     * @param config    Configuration
+     * @param timeSync  Synchronized clock, used for latency measurement
+     * @param functions External functions
+     */
+    H801_Mirror(H801_Config &config, H801_TimeSync &timeSync, PH801_Functions functions):
+        m_config(config),
+        m_timeSync(timeSync),
+        m_functions(functions),
+        m_role(ROLE_NONE),
+        m_sequence(0),
+        m_session(0),
+        m_hasSequence(false) {
+      memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+
+    /**
+     * Setup leader or follower from current mirror config
+     */
+    void setup() {
+      m_udp.stop();
+      m_hasSequence = false;
+
+      m_groupIP = IPAddress(239, 72, 1, m_config.m_Mirror.group & 0xFF);
+
+      if (!strcmp(m_config.m_Mirror.role, "leader")) {
+        m_role = ROLE_LEADER;
+
+        // New session, followers restart their sequence when it changes
+        m_session = 0;
+        while (!m_session)
+          m_session = ESP.random();
+      }
+      else if (!strcmp(m_config.m_Mirror.role, "follower")) {
+        m_role = ROLE_FOLLOWER;
+        m_udp.beginMulticast(WiFi.localIP(), m_groupIP, H801_MIRROR_PORT);
+      }
+      else {
+        m_role = ROLE_NONE;
+        return;
+      }
+
+      Serial1.printf("Mirror: %s of group %u\n", m_config.m_Mirror.role, m_config.m_Mirror.group);
+    }
+
+
+    /**
+     * Multicast committed state to the group, only sent by the leader
+     * @param mask      Channels set
+     * @param bri       Target brightness for each channel
+     * @param fadeSteps Number of steps to fade over for each channel
+     * @param fadeTime  Command duration in ms
+     */
+    void publish(uint32_t mask, const uint8_t *bri, const uint32_t *fadeSteps, unsigned long fadeTime) {
+      if (m_role != ROLE_LEADER || !mask)
+        return;
+
+      H801_MirrorPacket packet;
+      memset(&packet, 0, sizeof(packet));
+
+      packet.magic    = H801_MIRROR_MAGIC;
+      packet.version  = H801_MIRROR_VERSION;
+      packet.group    = m_config.m_Mirror.group;
+      packet.sequence = ++m_sequence;
+      packet.session  = m_session;
+      packet.mask     = mask;
+      packet.fadeTime = fadeTime;
+
+      for (size_t i = 0; i < H801_MIRROR_CHANNELS; i++) {
+        if (!(mask & (1 << i)))
+          continue;
+
+        packet.bri[i]       = bri[i];
+        packet.fadeSteps[i] = fadeSteps[i];
+      }
+
+      unsigned long time = millis();
+      if (m_timeSync.isSynced(time))
+        packet.sentAt = m_timeSync.toServer(time);
+
+      for (int i = 0; i < H801_MIRROR_REPEAT; i++) {
+        m_udp.beginPacketMulticast(m_groupIP, H801_MIRROR_PORT, WiFi.localIP());
+        m_udp.write((const uint8_t*)&packet, sizeof(packet));
+        m_udp.endPacket();
+      }
+
+      m_stats.sent++;
+    }
+
+
+    /**
+     * Apply states received from the leader
+     * @param time current millis time
+     */
+    void loop(unsigned long time) {
+      if (m_role != ROLE_FOLLOWER)
+        return;
+
+      int size;
+      while ((size = m_udp.parsePacket()) > 0) {
+        H801_MirrorPacket packet;
+
+        if (size != sizeof(packet) ||
+            m_udp.read((uint8_t*)&packet, sizeof(packet)) != sizeof(packet) ||
+            packet.magic   != H801_MIRROR_MAGIC ||
+            packet.version != H801_MIRROR_VERSION ||
+            packet.group   != m_config.m_Mirror.group) {
+          m_stats.ignored++;
+          continue;
+        }
+
+        // Leader rebooted, its sequence starts over
+        if (packet.session != m_session) {
+          m_session = packet.session;
+          m_hasSequence = false;
+        }
+
+        // Repeated or out of order
+        int16_t diff = (int16_t)(packet.sequence - m_sequence);
+        if (m_hasSequence && diff <= 0 && diff > -H801_MIRROR_SEQUENCE_WINDOW) {
+          m_stats.duplicate++;
+          continue;
+        }
+
+        m_sequence = packet.sequence;
+        m_hasSequence = true;
+
+        this->addLatency(packet, time);
+        m_stats.received++;
+
+        m_functions->set_Targets("mirror", packet.mask, packet.bri, packet.fadeSteps, packet.fadeTime);
+      }
+    }
+
+
+    /**
+     * Add mirror information to JSON object
+     * @param root JSON object
+     */
+    void appendInfo(JsonObject& root) {
+      if (m_role == ROLE_NONE)
+        return;
+
+      JsonObject& jsonMirror = root.createNestedObject("mirror");
+      jsonMirror["role"]  = m_config.m_Mirror.role;
+      jsonMirror["group"] = m_config.m_Mirror.group;
+
+      if (m_role == ROLE_LEADER) {
+        jsonMirror["sent"] = m_stats.sent;
+        return;
+      }
+
+      jsonMirror["received"]  = m_stats.received;
+      jsonMirror["duplicate"] = m_stats.duplicate;
+      jsonMirror["ignored"]   = m_stats.ignored;
+
+      if (m_stats.latencyNum) {
+        JsonObject& jsonLatency = jsonMirror.createNestedObject("latency");
+        jsonLatency["min"] = m_stats.latencyMin;
+        jsonLatency["avg"] = m_stats.latencySum / m_stats.latencyNum;
+        jsonLatency["max"] = m_stats.latencyMax;
+      }
+    }
+};
@@ -5,6 +5,10 @@
 #define H801_MQTT_SET    "/set"
 #define H801_MQTT_UPDATE "/updated"
 #define H801_MQTT_EVENT  "/event"
+#define H801_MQTT_METRICS "/metrics"
+
+// Time beacon shared by all devices, payload is server time in ms
+#define H801_MQTT_TIME   "h801/time"
 
 
 // Interval between each ping
@@ -21,6 +25,7 @@ class H801_MQTT {
 
     PubSubClient m_mqttClient;
     H801_Config& m_config;
+    H801_Scratch& m_scratch;
     PH801_Functions m_functions;
 
     char m_chipID[10];
@@ -29,10 +34,21 @@ class H801_MQTT {
     char m_topicSet[128];
     char m_topicUpdate[128];
     char m_topicSetNoAlias[128];
+    char m_topicMetrics[128];
 
-    unsigned long m_lastPost;
     unsigned long m_lastReconnect;
 
+    // millis() of the first publish after boot, 0 until then
+    unsigned long m_firstPublish;
+
+    // Counters
+    struct {
+      uint32_t reconnects;     // Reconnect attempts after the connection was lost
+      uint32_t connectFailed;  // Failed connects
+      uint32_t publishFailed;  // Publishes the client didn't send
+      uint32_t parseFailed;    // Received commands that weren't valid JSON
+    } m_stats;
+
     /**
      * MQTT callback
      * @param mqttTopic   Topic
@@ -40,23 +56,45 @@ class H801_MQTT {
      * @param mqttLength  Data length
      */
     void callback(char* mqttTopic, byte* mqttPayload, unsigned int mqttLength) {
-      static char payload[1024];
-      if (mqttLength >= countof(payload))
+      // Payload copy and new state
+      H801_ScratchScope scope(m_scratch);
+
+      // Time beacon, take receive time before anything else
+      if (!strcmp(mqttTopic, H801_MQTT_TIME)) {
+        unsigned long localTime = millis();
+
+        char timeBuffer[24];
+        if (mqttLength >= countof(timeBuffer))
+          return;
+
+        memcpy(timeBuffer, mqttPayload, mqttLength);
+        timeBuffer[mqttLength] = '\0';
+
+        double serverTime = strtod(timeBuffer, NULL);
+        if (serverTime > 0)
+          m_functions->set_Time(serverTime, localTime);
         return;
+      }
       
       // Set topic
       if (!strcmp(mqttTopic, m_topicSet) ||
           (*m_topicSetNoAlias && !strcmp(mqttTopic, m_topicSetNoAlias))) {        
         // Copy mqtt payload to buffer and NULL terminate it
-        strncpy(payload, (char*)mqttPayload, min(mqttLength, countof(payload)));
-        payload[min(mqttLength, countof(payload) - 1)] = '\0';
+        char *payload = (char*)m_scratch.alloc(mqttLength + 1);
+        if (!payload)
+          return;
+
+        memcpy(payload, mqttPayload, mqttLength);
+        payload[mqttLength] = '\0';
 
-        StaticJsonBuffer<200> jsonBuffer;
+        // Room for per channel objects
+        StaticJsonBuffer<512> jsonBuffer;
 
         // Parse the json
         JsonObject& json = jsonBuffer.parseObject(payload);
 
         if (!json.success()) {
+          m_stats.parseFailed++;
           return;
         }
 
@@ -98,6 +136,50 @@ class H801_MQTT {
       concatTopic(m_topicPing,   countof(m_topicPing),   newTopic, H801_MQTT_PING);
       concatTopic(m_topicUpdate, countof(m_topicUpdate), newTopic, H801_MQTT_UPDATE);
       concatTopic(m_topicSet,    countof(m_topicSet),    newTopic, H801_MQTT_SET);
+      concatTopic(m_topicMetrics, countof(m_topicMetrics), newTopic, H801_MQTT_METRICS);
+    }
+
+
+    /**
+     * Publish message, failures are counted
+     * @param  topic   Topic
+     * @param  payload Message
+     * @return false if the client didn't send it
+     */
+    bool publish(const char *topic, const char *payload) {
+      if (m_mqttClient.publish(topic, payload, false))
+        return true;
+
+      m_stats.publishFailed++;
+      return false;
+    }
+
+
+    /**
+     * Announce that the device is online
+     */
+    void publishOnline() {
+      if (!this->publish(m_topicEvent, "{\"event\": \"online\"}") || m_firstPublish)
+        return;
+
+      m_firstPublish = millis();
+      Serial1.printf("Boot: First MQTT publish at %lums\n", m_firstPublish);
+    }
+
+
+    /**
+     * Subscribe to all topics
+     */
+    void subscribeTopics() {
+      // Always listen to the <id>/set topic
+      m_mqttClient.subscribe(m_topicSet);
+
+      // Register non-alias version
+      if (*m_topicSetNoAlias) {
+        m_mqttClient.subscribe(m_topicSetNoAlias);
+      }
+
+      m_mqttClient.subscribe(H801_MQTT_TIME);
     }
 
 
@@ -106,16 +188,19 @@ class H801_MQTT {
      * H801 MQTT constructor
      * @param wifiClient WiFi client
      * @param config     Configuration
+     * @param scratch    Scratch arena, holds the received payload
      * @param functions  External functions
      */
-    H801_MQTT(WiFiClient &wifiClient, H801_Config &config, PH801_Functions functions):
+    H801_MQTT(WiFiClient &wifiClient, H801_Config &config, H801_Scratch &scratch, PH801_Functions functions):
         m_config(config),
+        m_scratch(scratch),
         m_functions(functions),
-        m_lastPost(0),
         m_lastReconnect(0),
+        m_firstPublish(0),
         m_validConfig(false),
         m_connected(false),
         m_mqttClient(wifiClient) {
+      memset(&m_stats, 0, sizeof(m_stats));
 
       // Setup message callback
       m_mqttClient.setCallback([&](char* mqttTopic, byte* mqttPayload, unsigned int mqttLength) {
@@ -176,9 +261,11 @@ class H801_MQTT {
       Serial1.printf("   %s\n", m_topicPing);
       Serial1.printf("   %s\n", m_topicUpdate);
       Serial1.printf("   %s\n", m_topicSet);
+      Serial1.printf("   %s\n", m_topicMetrics);
       if (*m_topicSetNoAlias) {
         Serial1.printf("   %s\n", m_topicSetNoAlias);
       }
+      Serial1.printf("   %s\n", H801_MQTT_TIME);
 
       // Configure server
       m_mqttClient.setServer(m_config.m_MQTT.server, port);
@@ -188,16 +275,9 @@ class H801_MQTT {
 
       // Are we connected
       if (m_connected) {
+        this->subscribeTopics();
 
-        // Always listen to the <id>/set topic
-        m_mqttClient.subscribe(m_topicSet);
-
-        // Register non-alias version
-        if (*m_topicSetNoAlias) {
-          m_mqttClient.subscribe(m_topicSetNoAlias);
-        }
-
-        m_mqttClient.publish(m_topicEvent, "{\"event\": \"online\"}");
+        this->publishOnline();
       }
       else {
         Serial1.println("MQTT: Failed to connect to server");
@@ -213,21 +293,47 @@ class H801_MQTT {
      * @param buffer New configuration
      */
     void publishConfigUpdate(const char *buffer) {
-      if (!m_validConfig || !m_connected)
+      if (!m_validConfig || !m_connected || !buffer)
         return;
 
-      m_mqttClient.publish(m_topicUpdate, buffer, false);
+      this->publish(m_topicUpdate, buffer);
     }
 
 
     /**
-     * Publish button press to MQTT
+     * Publish button gesture to MQTT
+     * @param gesture Gesture name
      */
-    void publishButtonPress() {
+    void publishButtonPress(const char *gesture) {
       if (!m_validConfig || !m_connected)
         return;
 
-      m_mqttClient.publish(m_topicEvent, "{\"event\":\"button\"}", false);
+      char buffer[64];
+      snprintf(buffer, sizeof(buffer), "{\"event\":\"button\",\"gesture\":\"%s\"}", gesture);
+      this->publish(m_topicEvent, buffer);
+    }
+
+
+    /**
+     * Publish event to MQTT
+     * @param buffer JSON encoded event
+     */
+    void publishEvent(const char *buffer) {
+      if (!m_validConfig || !m_connected || !buffer)
+        return;
+
+      this->publish(m_topicEvent, buffer);
+    }
+
+    /**
+     * Publish metrics to MQTT
+     * @param buffer JSON encoded metrics
+     */
+    void publishMetrics(const char *buffer) {
+      if (!m_validConfig || !m_connected || !buffer)
+        return;
+
+      this->publish(m_topicMetrics, buffer);
     }
 
     /**
@@ -284,6 +390,7 @@ class H801_MQTT {
 
       if (!m_connected) {
         // Failed to connect
+        m_stats.connectFailed++;
         Serial1.printf("MQTT: connect failed, state: %d (%s)\n", m_mqttClient.state(), this->getConnectStateInfo(m_mqttClient.state()));
         m_lastReconnect = millis();
       }
@@ -292,26 +399,28 @@ class H801_MQTT {
 
 
     /**
-     * MQTT loop
+     * Keep the connection, retried 20s after a failed connect
      * @param time current millis time
      */
-    void loop(unsigned long time) {
+    void reconnect(unsigned long time) {
       if (!m_validConfig)
         return;
 
-      // Waiting period for next re-connect
-      if (m_lastReconnect != 0 && time - m_lastReconnect < 20000) {
+      // Still connected
+      if (m_mqttClient.connected()) {
+        m_lastReconnect = 0;
+        m_connected = true;
         return;
       }
 
-      // Check if we connected
-      else if (m_mqttClient.connected()) {
-        m_lastReconnect = 0;
-        m_connected = true;        
+      // Waiting period for next re-connect
+      if (m_lastReconnect != 0 && time - m_lastReconnect < 20000) {
+        return;
       }
 
       // Try to re-connect
-      else if (!this->connect()) {
+      m_stats.reconnects++;
+      if (!this->connect()) {
         m_lastReconnect = time;
         m_connected = false;
 
@@ -320,28 +429,82 @@ class H801_MQTT {
       }
 
       // Connected
-      else {
-        m_lastReconnect = 0;
-        m_connected = true;
+      m_lastReconnect = 0;
+      m_connected = true;
+
+      Serial1.println("MQTT: Connected");
+      this->subscribeTopics();
+      this->publishOnline();
+    }
 
-        Serial1.println("MQTT: Connected");
-        m_mqttClient.subscribe(m_topicSet);
-        if (*m_topicSetNoAlias) {
-          m_mqttClient.subscribe(m_topicSetNoAlias);
-        }
-        m_mqttClient.publish(m_topicEvent, "{\"event\": \"online\"}");
-      }
+
+    /**
+     * MQTT loop, handles received messages
+     * @param time current millis time
+     */
+    void loop(unsigned long time) {
+      if (!m_validConfig || !m_connected)
+        return;
 
       m_mqttClient.loop();
+    }
 
-      // Trigger if we have wrapped or we had a timeout
-      if (time < m_lastPost || time > m_lastPost + (H801_MQTT_PING_INTERVAL)) {
-        m_lastPost = time;
 
-        const char *buffer = m_functions->get_Status();
-        if (buffer)
-          m_mqttClient.publish(m_topicPing, buffer, false);
-      }
+    /**
+     * Publish status on the ping topic
+     * @param time current millis time
+     */
+    void ping(unsigned long time) {
+      if (!m_validConfig || !m_connected)
+        return;
+
+      H801_ScratchScope scope(m_scratch);
+      const char *buffer = m_functions->get_Status();
+      if (buffer)
+        this->publish(m_topicPing, buffer);
+    }
+
+    /**
+     * Time of the first publish after boot
+     * @return millis() time, 0 if nothing published yet
+     */
+    unsigned long firstPublishTime() {
+      return m_firstPublish;
+    }
+
+    /**
+     * Is the client connected to the server
+     */
+    bool isConnected() {
+      return m_validConfig && m_mqttClient.connected();
+    }
+
+    /**
+     * Number of reconnect attempts after the connection was lost
+     */
+    uint32_t reconnects() {
+      return m_stats.reconnects;
+    }
+
+    /**
+     * Number of failed connects
+     */
+    uint32_t connectFailures() {
+      return m_stats.connectFailed;
+    }
+
+    /**
+     * Number of publishes the client didn't send
+     */
+    uint32_t publishFailures() {
+      return m_stats.publishFailed;
+    }
+
+    /**
+     * Number of received commands that weren't valid JSON
+     */
+    uint32_t parseFailures() {
+      return m_stats.parseFailed;
     }
 
     void appendInfo(JsonObject& root) {
@@ -357,5 +520,7 @@ class H801_MQTT {
         jsonMQTT["connected"] = false;  
         jsonMQTT["state"] = this->getConnectStateInfo(m_mqttClient.state());
       }
+      jsonMQTT["reconnects"]     = m_stats.reconnects;
+      jsonMQTT["publish_failed"] = m_stats.publishFailed;
     }
 };
@@ -0,0 +1,165 @@
+
+// Longest idle sleep, network data and button gestures
+// received while sleeping are handled at most this late
+#define H801_POWER_MAX_SLEEP 50
+
+// Shortest idle sleep worth entering
+#define H801_POWER_MIN_SLEEP 2
+
+
+/**
+ * H801 Power, sleeps between loop tasks when nothing is going on.
+ * The WiFi sleep type is set for the idle periods: modem sleep turns
+ * the radio off between beacons, light sleep also stops the CPU and is
+ * only used while every output is fully off or on so the PWM holds
+ */
+class H801_Power {
+  private:
+    typedef enum {
+      MODE_NONE,
+      MODE_MODEM,
+      MODE_LIGHT,
+    } Mode;
+
+    H801_Config& m_config;
+    H801_Button& m_button;  // Wakes from light sleep
+
+    Mode m_mode;       // Configured
+    Mode m_sleepType;  // Currently set
+
+    // Counters
+    struct {
+      uint64_t idleTime;      // us spent sleeping
+      uint32_t sleeps;
+      uint32_t lightSleeps;
+      uint64_t wakeTotal;     // us woken after the requested time
+      uint32_t wakeMax;
+    } m_stats;
+
+
+    /**
+     * Set WiFi sleep type, only when it changes
+     * @param mode Sleep type
+     */
+    void setSleepType(Mode mode) {
+      if (mode == m_sleepType)
+        return;
+
+      m_sleepType = mode;
+      switch (mode) {
+        case MODE_NONE:  WiFi.setSleepMode(WIFI_NONE_SLEEP);  break;
+        case MODE_MODEM: WiFi.setSleepMode(WIFI_MODEM_SLEEP); break;
+        case MODE_LIGHT: WiFi.setSleepMode(WIFI_LIGHT_SLEEP); break;
+      }
+    }
+
+
+    /**
+     * Name of mode
+     * @param mode Sleep mode
+     */
+    static const char* modeName(Mode mode) {
+      switch (mode) {
+        case MODE_MODEM: return "modem";
+        case MODE_LIGHT: return "light";
+        default:         return "none";
+      }
+    }
+
+
+  public:
+    /**
+     * H801 Power
+     * @param config Configuration, holds the sleep mode
+     * @param button Button, a press wakes from light sleep
+     */
+    H801_Power(H801_Config &config, H801_Button &button):
+        m_config(config),
+        m_button(button),
+        m_mode(MODE_NONE),
+        m_sleepType(MODE_MODEM) {
+      memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+
+    /**
+     * Apply sleep mode from the config
+     */
+    void setup() {
+      if (!strcmp(m_config.m_Power.sleep, "light"))
+        m_mode = MODE_LIGHT;
+      else if (!strcmp(m_config.m_Power.sleep, "modem"))
+        m_mode = MODE_MODEM;
+      else
+        m_mode = MODE_NONE;
+      this->busy();
+
+      Serial1.printf("Power: Idle sleep %s\n", modeName(m_mode));
+    }
+
+
+    /**
+     * Sleep while idle, the loop runs again when it returns
+     * @param duration      Time until the next task is due in ms
+     * @param canLightSleep Outputs hold without PWM
+     */
+    void idle(unsigned long duration, bool canLightSleep) {
+      if (m_mode == MODE_NONE || duration < H801_POWER_MIN_SLEEP)
+        return;
+
+      if (duration > H801_POWER_MAX_SLEEP)
+        duration = H801_POWER_MAX_SLEEP;
+
+      bool isLight = m_mode == MODE_LIGHT && canLightSleep;
+      this->setSleepType(isLight ? MODE_LIGHT : MODE_MODEM);
+
+      // Pressing the button wakes the CPU so the edge is timestamped,
+      // only armed during the sleep as it takes over the edge interrupt
+      if (isLight)
+        m_button.armWakeup();
+
+      // The SDK sleeps while the loop waits
+      uint32_t start = micros();
+      delay(duration);
+      uint32_t elapsed = micros() - start;
+
+      if (isLight)
+        m_button.disarmWakeup();
+
+      m_stats.idleTime += elapsed;
+      m_stats.sleeps++;
+      if (m_sleepType == MODE_LIGHT)
+        m_stats.lightSleeps++;
+
+      // Wake latency, time past the requested wake
+      uint32_t late = elapsed > duration * 1000 ? elapsed - duration * 1000 : 0;
+      m_stats.wakeTotal += late;
+      if (late > m_stats.wakeMax)
+        m_stats.wakeMax = late;
+    }
+
+
+    /**
+     * Loop has work, leave light sleep so the outputs can change
+     */
+    void busy() {
+      if (m_sleepType == MODE_LIGHT)
+        this->setSleepType(MODE_MODEM);
+    }
+
+
+    /**
+     * Add power information to JSON object
+     * @param root JSON object
+     * @param time Current millis() time
+     */
+    void appendInfo(JsonObject& root, unsigned long time) {
+      JsonObject& jsonPower = root.createNestedObject("power");
+      jsonPower["sleep"]        = modeName(m_mode);
+      jsonPower["sleeps"]       = m_stats.sleeps;
+      jsonPower["light_sleeps"] = m_stats.lightSleeps;
+      jsonPower["idle_pct"]     = time ? (uint32_t)(m_stats.idleTime / 10 / time) : 0;
+      jsonPower["wake_avg_us"]  = m_stats.sleeps ? (uint32_t)(m_stats.wakeTotal / m_stats.sleeps) : 0;
+      jsonPower["wake_max_us"]  = m_stats.wakeMax;
+    }
+};
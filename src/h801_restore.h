@@ -0,0 +1,339 @@
+
+// Restore record, same format in RTC memory and flash
+#define H801_RESTORE_MAGIC    0x5348 // "HS"
+#define H801_RESTORE_CHANNELS 5
+
+// Offset in RTC user memory, in 4 byte blocks
+#define H801_RESTORE_RTC_OFFSET 0
+
+// Flash record is written when the state has been unchanged this long
+#define H801_RESTORE_FLASH_DELAY 2000
+
+// Max time a continuously changing state waits for the flash write
+#define H801_RESTORE_FLASH_MAX_DELAY (30UL*1000)
+
+// Journal sectors, reserved by the linker scripts in ld/
+extern "C" uint32_t _H801_STATE_start;
+#define H801_RESTORE_SECTOR (((uintptr_t)&_H801_STATE_start - 0x40200000) / SPI_FLASH_SEC_SIZE)
+#define H801_RESTORE_SECTORS 4
+
+// Rated erase cycles of the flash, used for the lifetime estimate
+#define H801_RESTORE_ENDURANCE 100000
+
+
+/**
+ * Channel state record
+ */
+typedef struct tagH801_RestoreRecord {
+  uint16_t magic;
+  uint8_t  count;                          // Number of channels
+  uint8_t  bri[H801_RESTORE_CHANNELS];
+  uint32_t sequence;                       // Number of records written over the device lifetime
+  uint32_t crc;                            // CRC32 of the fields above
+} H801_RestoreRecord;
+
+static_assert(sizeof(H801_RestoreRecord) == 16, "Restore record must be 16 bytes");
+
+// Records appended to a journal sector before moving to the next
+#define H801_RESTORE_SECTOR_RECORDS (SPI_FLASH_SEC_SIZE / sizeof(H801_RestoreRecord))
+
+
+/**
+ * H801 Restore, keeps the last committed channel state in RTC memory,
+ * which survives a soft reset, and in flash for a power loss
+ */
+class H801_Restore {
+  private:
+    const char *m_source;
+
+    // Current state
+    H801_RestoreRecord m_record;
+
+    // Journal position, next record is written at m_index in m_sector
+    uint32_t m_sector;
+    uint32_t m_index;
+
+    // Deferred flash write
+    bool m_isFlashPending;
+    unsigned long m_changeTime;
+    unsigned long m_firstChangeTime;
+
+    // Counters
+    struct {
+      uint32_t changes;      // Committed state changes, each written to RTC memory
+      uint32_t flashWrites;  // Journal records written, changes within the delay are merged
+      uint32_t flashErases;
+    } m_stats;
+
+
+    /**
+     * Is the record valid
+     * @param  record Restore record
+     * @return false if invalid
+     */
+    static bool isValid(const H801_RestoreRecord &record) {
+      return record.magic == H801_RESTORE_MAGIC &&
+             record.count <= H801_RESTORE_CHANNELS &&
+             record.crc == calcCRC32(&record, offsetof(H801_RestoreRecord, crc));
+    }
+
+
+    /**
+     * Read record from a journal sector
+     * @param  sector Journal sector
+     * @param  index  Record index
+     * @param  record Output record
+     * @return false if read failed
+     */
+    static bool readFlash(uint32_t sector, uint32_t index, H801_RestoreRecord &record) {
+      return ESP.flashRead((H801_RESTORE_SECTOR + sector) * SPI_FLASH_SEC_SIZE + index * sizeof(record),
+                           (uint32_t*)&record, sizeof(record));
+    }
+
+
+    /**
+     * Find the last valid record in a journal sector, records are
+     * appended so it's the last written one unless that write was interrupted
+     * @param  sector Journal sector
+     * @param  record Output record
+     * @param  next   Output index of the first free record
+     * @return false if no valid record
+     */
+    static bool loadSector(uint32_t sector, H801_RestoreRecord &record, uint32_t &next) {
+      // Binary search for the first erased record
+      uint32_t low = 0, high = H801_RESTORE_SECTOR_RECORDS;
+      while (low < high) {
+        uint32_t mid = (low + high) / 2;
+
+        if (!readFlash(sector, mid, record))
+          return false;
+
+        if (record.magic == 0xFFFF)
+          high = mid;
+        else
+          low = mid + 1;
+      }
+      next = low;
+
+      for (uint32_t index = low; index-- > 0;) {
+        if (readFlash(sector, index, record) && isValid(record))
+          return true;
+      }
+      return false;
+    }
+
+
+    /**
+     * Find the newest record in the journal, the sector written last
+     * is the one whose first record has the highest sequence
+     * @param  record Output record
+     * @return false if no valid record
+     */
+    bool loadFlash(H801_RestoreRecord &record) {
+      uint32_t order[H801_RESTORE_SECTORS];
+      uint32_t sequence[H801_RESTORE_SECTORS];
+      size_t   numSectors = 0;
+
+      // Sectors with a valid first record, newest first
+      for (uint32_t sector = 0; sector < H801_RESTORE_SECTORS; sector++) {
+        if (!readFlash(sector, 0, record) || !isValid(record))
+          continue;
+
+        size_t i = numSectors++;
+        while (i > 0 && (int32_t)(record.sequence - sequence[i - 1]) > 0) {
+          order[i]    = order[i - 1];
+          sequence[i] = sequence[i - 1];
+          i--;
+        }
+        order[i]    = sector;
+        sequence[i] = record.sequence;
+      }
+
+      for (size_t i = 0; i < numSectors; i++) {
+        uint32_t next;
+        if (!loadSector(order[i], record, next))
+          continue;
+
+        // Continue after the newest record, when it's found in an older
+        // sector the next write moves on to a freshly erased sector
+        m_sector = order[i];
+        m_index  = i == 0 ? next : H801_RESTORE_SECTOR_RECORDS;
+        return true;
+      }
+      return false;
+    }
+
+
+    /**
+     * Append current state to the journal. Only the newest record is
+     * needed, so when the current sector is full the next one is erased
+     * and the journal continues there
+     */
+    void writeFlash() {
+      unsigned long start = micros();
+
+      if (m_index >= H801_RESTORE_SECTOR_RECORDS) {
+        uint32_t sector = (m_sector + 1) % H801_RESTORE_SECTORS;
+
+        if (!ESP.flashEraseSector(H801_RESTORE_SECTOR + sector)) {
+          Serial1.printf("Restore: Failed to erase journal sector %u\n", sector);
+          return;
+        }
+        m_sector = sector;
+        m_index = 0;
+        m_stats.flashErases++;
+      }
+
+      m_record.sequence++;
+      m_record.crc = calcCRC32(&m_record, offsetof(H801_RestoreRecord, crc));
+
+      // RTC copy carries the sequence, so it continues after a soft reset
+      ESP.rtcUserMemoryWrite(H801_RESTORE_RTC_OFFSET, (uint32_t*)&m_record, sizeof(m_record));
+
+      if (!ESP.flashWrite((H801_RESTORE_SECTOR + m_sector) * SPI_FLASH_SEC_SIZE + m_index * sizeof(m_record),
+                          (uint32_t*)&m_record, sizeof(m_record))) {
+        Serial1.println("Restore: Failed to write state");
+        return;
+      }
+
+      m_index++;
+      m_stats.flashWrites++;
+
+      Serial1.printf("Restore: Saved state %u to sector %u:%u in %luus\n", m_record.sequence, m_sector, m_index - 1, micros() - start);
+    }
+
+
+  public:
+    /**
+     * H801 Restore constructor
+     */
+    H801_Restore():
+        m_source("none"),
+        m_sector(H801_RESTORE_SECTORS - 1),
+        m_index(H801_RESTORE_SECTOR_RECORDS),
+        m_isFlashPending(false),
+        m_changeTime(0),
+        m_firstChangeTime(0) {
+      memset(&m_record, 0, sizeof(m_record));
+      memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+
+    /**
+     * Read last state, RTC memory is used when valid since it's always
+     * at least as new as the flash record
+     * @param  bri   Output brightness for each channel
+     * @param  count Number of channels
+     * @return false if there is no stored state
+     */
+    bool load(uint8_t *bri, size_t count) {
+      H801_RestoreRecord rtcRecord;
+      H801_RestoreRecord flashRecord;
+
+      bool isRTC   = ESP.rtcUserMemoryRead(H801_RESTORE_RTC_OFFSET, (uint32_t*)&rtcRecord, sizeof(rtcRecord)) &&
+                     isValid(rtcRecord);
+      bool isFlash = this->loadFlash(flashRecord);
+
+      if (isRTC) {
+        m_record = rtcRecord;
+        m_source = "rtc";
+
+        // Changes not yet in the journal are written by the loop
+        if (!isFlash || memcmp(&rtcRecord, &flashRecord, offsetof(H801_RestoreRecord, sequence))) {
+          m_isFlashPending = true;
+          m_changeTime = m_firstChangeTime = millis();
+        }
+
+        // Keep the journal sequence increasing
+        if (isFlash && (int32_t)(flashRecord.sequence - m_record.sequence) > 0)
+          m_record.sequence = flashRecord.sequence;
+      }
+      else if (isFlash) {
+        m_record = flashRecord;
+        m_source = "flash";
+      }
+      else {
+        return false;
+      }
+
+      memset(bri, 0, count);
+      memcpy(bri, m_record.bri, min(count, (size_t)m_record.count));
+      return true;
+    }
+
+
+    /**
+     * Name of the source the state was restored from
+     * @return "rtc", "flash" or "none"
+     */
+    const char *source() {
+      return m_source;
+    }
+
+
+    /**
+     * Track committed state, RTC memory is written directly and
+     * flash once the state has settled
+     * @param time  current millis time
+     * @param bri   Brightness for each channel
+     * @param count Number of channels
+     */
+    void loop(unsigned long time, const uint8_t *bri, size_t count) {
+      count = min(count, (size_t)H801_RESTORE_CHANNELS);
+
+      if (m_record.magic != H801_RESTORE_MAGIC || m_record.count != count ||
+          memcmp(m_record.bri, bri, count)) {
+        m_record.magic = H801_RESTORE_MAGIC;
+        m_record.count = count;
+        memcpy(m_record.bri, bri, count);
+        m_record.crc = calcCRC32(&m_record, offsetof(H801_RestoreRecord, crc));
+
+        ESP.rtcUserMemoryWrite(H801_RESTORE_RTC_OFFSET, (uint32_t*)&m_record, sizeof(m_record));
+        m_stats.changes++;
+
+        if (!m_isFlashPending)
+          m_firstChangeTime = time;
+        m_isFlashPending = true;
+        m_changeTime = time;
+      }
+
+      if (m_isFlashPending &&
+          (time - m_changeTime >= H801_RESTORE_FLASH_DELAY ||
+           time - m_firstChangeTime >= H801_RESTORE_FLASH_MAX_DELAY)) {
+        m_isFlashPending = false;
+        this->writeFlash();
+      }
+    }
+
+
+    /**
+     * Add restore information to JSON object
+     * @param root JSON object
+     * @param time current millis time
+     */
+    void appendInfo(JsonObject& root, unsigned long time) {
+      JsonObject& jsonRestore = root.createNestedObject("restore");
+      jsonRestore["source"]  = m_source;
+      jsonRestore["changes"] = m_stats.changes;
+
+      JsonObject& jsonJournal = jsonRestore.createNestedObject("journal");
+      jsonJournal["sector"] = m_sector;
+      jsonJournal["index"]  = m_index;
+      jsonJournal["writes"] = m_stats.flashWrites;
+      jsonJournal["erases"] = m_stats.flashErases;
+
+      // Sectors are erased in turn, so the lifetime sequence
+      // tells how many times each sector has been erased
+      uint32_t capacity = H801_RESTORE_SECTORS * H801_RESTORE_SECTOR_RECORDS;
+      uint32_t cycles = m_record.sequence / capacity;
+      jsonJournal["cycles"] = cycles;
+
+      // Remaining lifetime at the write rate seen since boot
+      if (m_stats.flashWrites && time && cycles < H801_RESTORE_ENDURANCE) {
+        double writesPerDay = (double)m_stats.flashWrites * 86400000.0 / time;
+        double days = (double)(H801_RESTORE_ENDURANCE - cycles) * capacity / writesPerDay;
+        jsonJournal["writes_per_day"] = writesPerDay;
+        jsonJournal["lifetime_years"] = days / 365.25;
+      }
+    }
+};
@@ -0,0 +1,176 @@
+
+// Scene file
+#define H801_SCENE_FILE "/scenes.bin"
+
+// Scene file magic and version
+#define H801_SCENE_MAGIC    0x43533848 // "H8SC"
+#define H801_SCENE_VERSION  1
+
+// Number of scenes that can be stored
+#define H801_SCENE_MAX 8
+
+// Max number of channels in a scene
+#define H801_SCENE_CHANNELS 5
+
+
+/**
+ * Stored scene, a full channel state and fade duration
+ */
+typedef struct tagH801_Scene {
+  char     name[16];
+  uint32_t duration;                  // Fade duration in ms
+  uint8_t  mask;                      // Channels set by the scene, 0 if slot is empty
+  uint8_t  bri[H801_SCENE_CHANNELS];  // Brightness for each channel
+} H801_Scene;
+
+
+/**
+ * Scene file header
+ */
+typedef struct tagH801_SceneHeader {
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  numScenes;
+  uint8_t  numChannels;
+  uint8_t  sceneSize;
+} H801_SceneHeader;
+
+
+/**
+ * H801 Scene table, stored as binary file
+ */
+class H801_Scenes {
+  private:
+    H801_Storage& m_storage;
+    H801_Scene m_scenes[H801_SCENE_MAX];
+
+  public:
+    /**
+     * H801 Scene table
+     * @param storage Filesystem
+     */
+    H801_Scenes(H801_Storage &storage):
+        m_storage(storage) {
+      this->clear();
+    }
+
+
+    /**
+     * Remove all scenes
+     */
+    void clear(void) {
+      memset(m_scenes, 0, sizeof(m_scenes));
+    }
+
+
+    /**
+     * Get scene
+     * @param  id Scene id
+     * @return Scene or NULL if not stored
+     */
+    const H801_Scene* get(unsigned long id) {
+      if (id >= countof(m_scenes) || !m_scenes[id].mask)
+        return NULL;
+
+      return &m_scenes[id];
+    }
+
+
+    /**
+     * Store scene
+     * @param  id    Scene id
+     * @param  scene New scene, empty mask removes the scene
+     * @return Was the scene modified
+     */
+    bool set(unsigned long id, const H801_Scene &scene) {
+      if (id >= countof(m_scenes))
+        return false;
+
+      if (!memcmp(&m_scenes[id], &scene, sizeof(scene)))
+        return false;
+
+      m_scenes[id] = scene;
+      return true;
+    }
+
+
+    /**
+     * Write scene table to storage
+     * @return false if failure
+     */
+    bool save(void) {
+      Serial1.println("Scenes: Saving scenes");
+
+      File sceneFile = m_storage.open(H801_SCENE_FILE, "w");
+      if (!sceneFile) {
+        Serial1.println("Scenes: Failed to open scene file for writing");
+        return false;
+      }
+
+      H801_SceneHeader header = {
+        .magic       = H801_SCENE_MAGIC,
+        .version     = H801_SCENE_VERSION,
+        .numScenes   = H801_SCENE_MAX,
+        .numChannels = H801_SCENE_CHANNELS,
+        .sceneSize   = sizeof(H801_Scene),
+      };
+
+      bool isWritten =
+        sceneFile.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+        sceneFile.write((const uint8_t*)m_scenes, sizeof(m_scenes)) == sizeof(m_scenes);
+
+      if (!isWritten) {
+        Serial1.println("Scenes: Failed to write scene file");
+      }
+
+      sceneFile.close();
+      return isWritten;
+    }
+
+
+    /**
+     * Read scene table from storage
+     * @return false if failed to read scenes
+     */
+    bool load(void) {
+      this->clear();
+
+      if (!m_storage.exists(H801_SCENE_FILE)) {
+        Serial1.println("Scenes: No scene file");
+        return true;
+      }
+
+      File sceneFile = m_storage.open(H801_SCENE_FILE, "r");
+      if (!sceneFile) {
+        Serial1.println("Scenes: Unable to open " H801_SCENE_FILE);
+        return false;
+      }
+
+      H801_SceneHeader header;
+      bool isRead = sceneFile.readBytes((char*)&header, sizeof(header)) == sizeof(header) &&
+                    header.magic       == H801_SCENE_MAGIC &&
+                    header.version     == H801_SCENE_VERSION &&
+                    header.numScenes   == H801_SCENE_MAX &&
+                    header.numChannels == H801_SCENE_CHANNELS &&
+                    header.sceneSize   == sizeof(H801_Scene) &&
+                    sceneFile.readBytes((char*)m_scenes, sizeof(m_scenes)) == sizeof(m_scenes);
+
+      sceneFile.close();
+
+      if (!isRead) {
+        Serial1.println("Scenes: Invalid scene file, scenes cleared");
+        this->clear();
+        return false;
+      }
+
+      return true;
+    }
+
+
+    /**
+     * Removes scene file from disk
+     */
+    void remove() {
+      m_storage.remove(H801_SCENE_FILE);
+    }
+};
@@ -0,0 +1,245 @@
+
+// Time in a loop tick, tasks that would end after it are postponed
+#define H801_SCHEDULER_FRAME_BUDGET 4000
+
+// Time in a loop tick after which background tasks no longer start
+#define H801_SCHEDULER_BACKGROUND_WINDOW 1000
+
+// Times in a row a task can be postponed before it's run anyway
+#define H801_SCHEDULER_MAX_POSTPONE 100
+
+
+// Task priorities, tasks run in table order and the
+// priority decides which can be postponed
+typedef enum {
+  H801_TASK_CRITICAL,    // Never postponed, fades and button
+  H801_TASK_NORMAL,      // Postponed when the run would exceed the tick budget
+  H801_TASK_BACKGROUND,  // As normal, and only started early in a tick
+} H801_TaskPriority;
+
+typedef void (*H801_TaskFunc)(unsigned long time);
+
+/**
+ * Scheduled task
+ */
+typedef struct tagH801_Task {
+  const char    *name;
+  H801_TaskFunc  func;
+  uint32_t       period;    // ms between runs, 0 for every loop tick
+  uint8_t        priority;  // H801_TaskPriority
+  uint16_t       budget;    // Expected max run time in us
+
+  // State
+  unsigned long  due;
+  uint8_t        postponedRuns;
+
+  // Counters
+  struct {
+    uint32_t runs;
+    uint32_t overruns;      // Runs longer than the budget
+    uint32_t postponed;     // Runs moved to a later tick
+    uint32_t maxTime;       // Longest run in us
+    uint32_t maxLate;       // Longest delay after due in ms
+  } stats;
+} H801_Task;
+
+#define H801_TASK(name, func, period, priority, budget) \
+  { name, func, period, priority, budget, 0, 0, { 0, 0, 0, 0, 0 } }
+
+
+/**
+ * H801 Scheduler, runs the due tasks of each loop tick in table order.
+ * Critical tasks always run, the others are postponed to the next tick
+ * when the tick has used its budget, so a slow network task delays
+ * the other network tasks instead of the fades
+ */
+class H801_Scheduler {
+  private:
+    H801_Task *m_tasks;
+    size_t m_numTasks;
+
+    // Counters
+    struct {
+      uint32_t ticks;
+      uint32_t maxTick;     // Longest tick in us
+    } m_stats;
+    H801_Histogram m_tickTime;
+
+  public:
+    /**
+     * H801 Scheduler
+     * @param tasks    Task table
+     * @param numTasks Number of tasks
+     */
+    H801_Scheduler(H801_Task *tasks, size_t numTasks):
+        m_tasks(tasks),
+        m_numTasks(numTasks) {
+      memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+
+    /**
+     * Start all tasks
+     * @param time current millis time
+     */
+    void begin(unsigned long time) {
+      for (size_t i = 0; i < m_numTasks; i++) {
+        m_tasks[i].due = time;
+      }
+    }
+
+
+    /**
+     * Delay the next run of a task, called by the task
+     * while it runs to add to its period
+     * @param name Task name
+     * @param ms   Additional delay
+     */
+    void defer(const char *name, unsigned long ms) {
+      H801_Task *task = this->find(name);
+      if (task)
+        task->due += ms;
+    }
+
+
+    /**
+     * Find task
+     * @param  name Task name
+     * @return Task, NULL if not found
+     */
+    H801_Task* find(const char *name) {
+      for (size_t i = 0; i < m_numTasks; i++) {
+        if (!strcmp(m_tasks[i].name, name))
+          return &m_tasks[i];
+      }
+      return NULL;
+    }
+
+
+    /**
+     * Run task in the next loop tick
+     * @param name Task name
+     */
+    void wake(const char *name) {
+      H801_Task *task = this->find(name);
+      if (task)
+        task->due = millis();
+    }
+
+
+    /**
+     * Restart the period of a task, it runs one period from now
+     * @param name Task name
+     */
+    void restart(const char *name) {
+      H801_Task *task = this->find(name);
+      if (task)
+        task->due = millis() + task->period;
+    }
+
+
+    /**
+     * Time until the next task with a period is due,
+     * tasks run every loop tick are not included
+     * @param  time current millis time
+     * @return ms, 0 if a task is due
+     */
+    unsigned long nextDue(unsigned long time) {
+      unsigned long next = ULONG_MAX;
+      for (size_t i = 0; i < m_numTasks; i++) {
+        if (!m_tasks[i].period)
+          continue;
+
+        long wait = (long)(m_tasks[i].due - time);
+        if (wait <= 0)
+          return 0;
+        if ((unsigned long)wait < next)
+          next = wait;
+      }
+      return next;
+    }
+
+
+    /**
+     * Run the due tasks
+     * @param time current millis time
+     */
+    void loop(unsigned long time) {
+      uint32_t start = micros();
+
+      for (size_t i = 0; i < m_numTasks; i++) {
+        H801_Task &task = m_tasks[i];
+
+        long late = (long)(time - task.due);
+        if (late < 0)
+          continue;
+
+        // Run doesn't fit in the rest of the tick, try again next tick
+        uint32_t used = micros() - start;
+        if (task.postponedRuns < H801_SCHEDULER_MAX_POSTPONE &&
+            task.priority != H801_TASK_CRITICAL &&
+            (used + task.budget > H801_SCHEDULER_FRAME_BUDGET ||
+             (task.priority == H801_TASK_BACKGROUND && used > H801_SCHEDULER_BACKGROUND_WINDOW))) {
+          task.postponedRuns++;
+          task.stats.postponed++;
+          continue;
+        }
+        task.postponedRuns = 0;
+
+        uint32_t taskStart = micros();
+        task.func(time);
+        uint32_t taskTime = micros() - taskStart;
+
+        task.stats.runs++;
+        if (taskTime > task.budget)
+          task.stats.overruns++;
+        if (taskTime > task.stats.maxTime)
+          task.stats.maxTime = taskTime;
+        if ((uint32_t)late > task.stats.maxLate)
+          task.stats.maxLate = late;
+
+        // Keep the rate, unless a period or more behind
+        task.due += task.period;
+        if ((long)(time - task.due) >= 0)
+          task.due = time + task.period;
+      }
+
+      uint32_t tickTime = micros() - start;
+      m_stats.ticks++;
+      if (tickTime > m_stats.maxTick)
+        m_stats.maxTick = tickTime;
+      m_tickTime.observe(tickTime);
+    }
+
+
+    /**
+     * Time of the loop ticks
+     */
+    const H801_Histogram& tickTime() {
+      return m_tickTime;
+    }
+
+
+    /**
+     * Add task information to JSON object, each task as
+     * [runs, overruns, postponed, max us, max late ms]
+     * @param root JSON object
+     */
+    void appendInfo(JsonObject& root) {
+      JsonObject& jsonScheduler = root.createNestedObject("scheduler");
+      jsonScheduler["ticks"]    = m_stats.ticks;
+      jsonScheduler["max_tick"] = m_stats.maxTick;
+
+      JsonObject& jsonTasks = jsonScheduler.createNestedObject("tasks");
+      for (size_t i = 0; i < m_numTasks; i++) {
+        const H801_Task &task = m_tasks[i];
+
+        JsonArray& jsonTask = jsonTasks.createNestedArray(task.name);
+        jsonTask.add(task.stats.runs);
+        jsonTask.add(task.stats.overruns);
+        jsonTask.add(task.stats.postponed);
+        jsonTask.add(task.stats.maxTime);
+        jsonTask.add(task.stats.maxLate);
+      }
+    }
+};
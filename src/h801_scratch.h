@@ -0,0 +1,143 @@
+
+// Size of the scratch arena, fits the largest request: a parsed
+// config body, the new config and the JSON string returned for it
+#define H801_SCRATCH_SIZE 4096
+
+
+/**
+ * H801 Scratch arena, shared by the JSON buffers and strings that are
+ * only needed while a command is handled. Allocations are released
+ * together, by a scope when the command is done and by the main loop
+ */
+class H801_Scratch {
+  private:
+    uint32_t m_buffer[H801_SCRATCH_SIZE / sizeof(uint32_t)];
+    size_t m_used;
+
+    // Stats
+    size_t m_peak;
+    uint32_t m_failed;
+
+  public:
+    /**
+     * H801 Scratch
+     */
+    H801_Scratch():
+        m_used(0),
+        m_peak(0),
+        m_failed(0) {
+    }
+
+
+    /**
+     * Allocate memory that lives until released
+     * @param  size Number of bytes
+     * @return Memory aligned to 4 bytes, NULL if the arena is full
+     */
+    void* alloc(size_t size) {
+      size = (size + 3) & ~3;
+      if (size > sizeof(m_buffer) - m_used) {
+        Serial1.printf("Scratch: Out of memory, %u bytes requested with %u used\n", (unsigned)size, (unsigned)m_used);
+        m_failed++;
+        return NULL;
+      }
+
+      void *ptr = (uint8_t*)m_buffer + m_used;
+      m_used += size;
+      if (m_used > m_peak)
+        m_peak = m_used;
+      return ptr;
+    }
+
+
+    /**
+     * Allocate JSON buffer
+     * @return JSON buffer, NULL if the arena is full
+     */
+    template <size_t N>
+    StaticJsonBuffer<N>* jsonBuffer() {
+      void *ptr = this->alloc(sizeof(StaticJsonBuffer<N>));
+      if (!ptr)
+        return NULL;
+
+      return new (ptr) StaticJsonBuffer<N>();
+    }
+
+
+    /**
+     * Serialize JSON into a string of the exact length
+     * @param  json JSON object or array
+     * @return JSON string, NULL if the arena is full
+     */
+    template <typename T>
+    char* printTo(const T &json) {
+      size_t length = json.measureLength() + 1;
+      char *buffer = (char*)this->alloc(length);
+      if (!buffer)
+        return NULL;
+
+      json.printTo(buffer, length);
+      return buffer;
+    }
+
+
+    /**
+     * Current position, allocations after it are released by release()
+     */
+    size_t mark() {
+      return m_used;
+    }
+
+
+    /**
+     * Release everything allocated after the mark
+     * @param mark Position from mark()
+     */
+    void release(size_t mark) {
+      m_used = mark;
+    }
+
+
+    /**
+     * Release everything
+     */
+    void reset() {
+      m_used = 0;
+    }
+
+
+    /**
+     * Add scratch information to JSON object
+     * @param root JSON object
+     */
+    void appendInfo(JsonObject& root) {
+      JsonObject& jsonScratch = root.createNestedObject("scratch");
+      jsonScratch["size"]   = sizeof(m_buffer);
+      jsonScratch["peak"]   = m_peak;
+      jsonScratch["failed"] = m_failed;
+    }
+};
+
+
+/**
+ * Releases the scratch memory allocated during its lifetime
+ */
+class H801_ScratchScope {
+  private:
+    H801_Scratch &m_scratch;
+    size_t m_mark;
+
+  public:
+    /**
+     * H801 Scratch scope
+     * @param scratch Scratch arena
+     */
+    H801_ScratchScope(H801_Scratch &scratch):
+        m_scratch(scratch),
+        m_mark(scratch.mark()) {
+    }
+
+    ~H801_ScratchScope() {
+      m_scratch.release(m_mark);
+    }
+};
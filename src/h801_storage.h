@@ -0,0 +1,193 @@
+// Chunk size of the benchmark, same as the HTTP server uses
+#define H801_STORAGE_BENCH_CHUNK 512
+
+
+/**
+ * H801 Storage, owns the filesystem and keeps it mounted
+ * Uses LittleFS when built with H801_LITTLEFS, otherwise SPIFFS
+ */
+class H801_Storage {
+  private:
+    bool m_isMounted;
+
+    // Time taken by mount, in us
+    unsigned long m_mountTime;
+
+    /**
+     * Filesystem backend
+     */
+    fs::FS& backend() {
+#ifdef H801_LITTLEFS
+      return LittleFS;
+#else
+      return SPIFFS;
+#endif
+    }
+
+  public:
+    /**
+     * H801 Storage
+     */
+    H801_Storage():
+        m_isMounted(false),
+        m_mountTime(0) {
+    }
+
+
+    /**
+     * Name of filesystem backend
+     * @return name
+     */
+    const char* name() {
+#ifdef H801_LITTLEFS
+      return "LittleFS";
+#else
+      return "SPIFFS";
+#endif
+    }
+
+
+    /**
+     * Mount filesystem, only the first call mounts
+     * @return false if filesystem could not be mounted
+     */
+    bool begin() {
+      if (m_isMounted)
+        return true;
+
+      unsigned long start = micros();
+      m_isMounted = this->backend().begin();
+      m_mountTime = micros() - start;
+
+      if (!m_isMounted) {
+        Serial1.printf("Storage: Failed to mount %s\n", this->name());
+        return false;
+      }
+
+      Serial1.printf("Storage: Mounted %s in %luus\n", this->name(), m_mountTime);
+      return true;
+    }
+
+
+    /**
+     * Is the filesystem mounted
+     */
+    bool isMounted() {
+      return m_isMounted;
+    }
+
+
+    /**
+     * Open file, mounts filesystem if needed
+     * @param  path File path
+     * @param  mode Open mode, "r" or "w"
+     * @return File, false if it could not be opened
+     */
+    File open(const char *path, const char *mode) {
+      if (!this->begin())
+        return File();
+
+      return this->backend().open(path, mode);
+    }
+
+
+    /**
+     * Does the file exist
+     * @param  path File path
+     * @return false if not found or filesystem unavailable
+     */
+    bool exists(const char *path) {
+      return this->begin() && this->backend().exists(path);
+    }
+
+
+    /**
+     * Remove file
+     * @param  path File path
+     * @return false if failure
+     */
+    bool remove(const char *path) {
+      return this->begin() && this->backend().remove(path);
+    }
+
+
+    /**
+     * Get filesystem usage
+     * @param  info Output information
+     * @return false if failure
+     */
+    bool info(FSInfo &info) {
+      return this->begin() && this->backend().info(info);
+    }
+
+
+    /**
+     * Open directory
+     * @param  path Directory path
+     * @return Directory iterator
+     */
+    Dir openDir(const char *path) {
+      this->begin();
+      return this->backend().openDir(path);
+    }
+
+
+    /**
+     * Time taken to mount filesystem
+     * @return Time in us
+     */
+    unsigned long mountTime() {
+      return m_mountTime;
+    }
+
+
+#ifdef H801_STORAGE_BENCH
+    /**
+     * Time writing a file and reading it back in chunks, the way files
+     * are saved, loaded and served. Result is written to the serial log
+     * @param name    Name of the measurement
+     * @param content File content, may be in PROGMEM
+     * @param length  Length of content
+     * @param runs    Number of runs
+     */
+    void benchmark(const char *name, PGM_P content, size_t length, int runs) {
+      static const char path[] = "/bench.tmp";
+      uint8_t buffer[H801_STORAGE_BENCH_CHUNK];
+
+      unsigned long saveTime = 0, saveMax = 0;
+      unsigned long loadTime = 0, loadMax = 0;
+      for (int run = 0; run < runs; run++) {
+        // Copying the content from flash is not counted
+        unsigned long start = micros();
+        File file = this->open(path, "w");
+        for (size_t offset = 0; file && offset < length; offset += sizeof(buffer)) {
+          size_t chunk = min(length - offset, sizeof(buffer));
+          unsigned long copyStart = micros();
+          memcpy_P(buffer, content + offset, chunk);
+          start += micros() - copyStart;
+          file.write(buffer, chunk);
+        }
+        file.close();
+        unsigned long time = micros() - start;
+        saveTime += time;
+        saveMax = max(saveMax, time);
+
+        start = micros();
+        file = this->open(path, "r");
+        while (file && file.read(buffer, sizeof(buffer)) > 0)
+          ;
+        file.close();
+        time = micros() - start;
+        loadTime += time;
+        loadMax = max(loadMax, time);
+
+        yield();
+      }
+      this->remove(path);
+
+      Serial1.printf("Storage: %s %s %u bytes, save avg %luus max %luus, load avg %luus max %luus\n",
+                     this->name(), name, (unsigned)length,
+                     saveTime / runs, saveMax, loadTime / runs, loadMax);
+    }
+#endif//H801_STORAGE_BENCH
+};
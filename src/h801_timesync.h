@@ -0,0 +1,215 @@
+
+// Number of beacon samples used for the offset estimate
+#define H801_TIMESYNC_SAMPLES 16
+
+// Number of earlier sample blocks used for the drift estimate
+#define H801_TIMESYNC_HISTORY 4
+
+// Max accepted clock drift, crystals are well within this
+#define H801_TIMESYNC_MAX_DRIFT 200e-6
+
+// Clock is considered unsynchronized if no beacon was received in this time
+#define H801_TIMESYNC_TIMEOUT (15*60*1000)
+
+
+/**
+ * H801 Time synchronization
+ *
+ * Estimates offset and drift between local millis() and the time in
+ * the beacons. Network delay can only make a beacon look older than it
+ * is, so the estimate follows the least delayed samples: drift is fitted
+ * through the least delayed sample of each block of beacons, and the
+ * offset is taken from the least delayed of the recent samples.
+ */
+class H801_TimeSync {
+  private:
+    typedef struct tagSample {
+      double   server;  // Time in beacon
+      uint32_t local;   // millis() when received
+    } Sample;
+
+    Sample   m_samples[H801_TIMESYNC_SAMPLES];
+    uint8_t  m_numSamples;
+    uint8_t  m_nextSample;
+
+    Sample   m_history[H801_TIMESYNC_HISTORY];
+    uint8_t  m_numHistory;
+    uint8_t  m_nextHistory;
+
+    uint32_t m_numBeacons;
+
+    // server(local) = m_refServer + (local - m_refLocal) * (1 + m_drift)
+    uint32_t m_refLocal;
+    double   m_refServer;
+    double   m_drift;
+
+    // Spread of sample offsets, network jitter seen by the estimate
+    double   m_jitter;
+
+    /**
+     * Offset of sample relative to reference sample
+     * Handles millis() wrapping as long as samples are less than 24 days apart
+     */
+    double offsetOf(const Sample &sample, const Sample &ref) {
+      return (sample.server - ref.server) - (double)(int32_t)(sample.local - ref.local);
+    }
+
+    /**
+     * Find least delayed sample, the one with largest offset
+     */
+    const Sample& leastDelayed(const Sample *samples, uint8_t numSamples, const Sample &ref) {
+      uint8_t best = 0;
+      for (uint8_t i = 1; i < numSamples; i++) {
+        if (offsetOf(samples[i], ref) > offsetOf(samples[best], ref))
+          best = i;
+      }
+      return samples[best];
+    }
+
+    /**
+     * Estimate offset and drift from the current samples
+     */
+    void estimate() {
+      // Newest sample is reference, keeps the values small
+      const Sample &ref = m_samples[(m_nextSample + H801_TIMESYNC_SAMPLES - 1) % H801_TIMESYNC_SAMPLES];
+
+      // Drift, least squares through the least delayed sample of each block
+      Sample points[H801_TIMESYNC_HISTORY + 1];
+      uint8_t numPoints = 0;
+      for (uint8_t i = 0; i < m_numHistory; i++)
+        points[numPoints++] = m_history[i];
+      points[numPoints++] = leastDelayed(m_samples, m_numSamples, ref);
+
+      double drift = 0;
+      if (numPoints >= 2) {
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        for (uint8_t i = 0; i < numPoints; i++) {
+          double x = (int32_t)(points[i].local - ref.local);
+          double y = offsetOf(points[i], ref);
+          sx  += x;
+          sy  += y;
+          sxx += x * x;
+          sxy += x * y;
+        }
+
+        double denom = numPoints * sxx - sx * sx;
+        if (denom > 0)
+          drift = (numPoints * sxy - sx * sy) / denom;
+      }
+      drift = constrain(drift, -H801_TIMESYNC_MAX_DRIFT, H801_TIMESYNC_MAX_DRIFT);
+
+      // Offset, drift corrected least delayed recent sample
+      double maxOffset = -1e12, minOffset = 1e12;
+      for (uint8_t i = 0; i < m_numSamples; i++) {
+        double x = (int32_t)(m_samples[i].local - ref.local);
+        double offset = offsetOf(m_samples[i], ref) - drift * x;
+        maxOffset = max(maxOffset, offset);
+        minOffset = min(minOffset, offset);
+      }
+
+      m_refLocal  = ref.local;
+      m_refServer = ref.server + maxOffset;
+      m_drift     = drift;
+      m_jitter    = maxOffset - minOffset;
+    }
+
+  public:
+    /**
+     * H801 Time synchronization
+     */
+    H801_TimeSync():
+        m_numSamples(0),
+        m_nextSample(0),
+        m_numHistory(0),
+        m_nextHistory(0),
+        m_numBeacons(0),
+        m_refLocal(0),
+        m_refServer(0),
+        m_drift(0),
+        m_jitter(0) {
+    }
+
+
+    /**
+     * Add time beacon
+     * @param serverTime Time in beacon (ms)
+     * @param localTime  millis() when beacon was received
+     */
+    void addSample(double serverTime, uint32_t localTime) {
+      // Block of samples complete, keep least delayed one for drift estimate
+      if (m_numSamples == H801_TIMESYNC_SAMPLES && m_nextSample == 0) {
+        m_history[m_nextHistory] = leastDelayed(m_samples, m_numSamples, m_samples[H801_TIMESYNC_SAMPLES - 1]);
+        m_nextHistory = (m_nextHistory + 1) % H801_TIMESYNC_HISTORY;
+        if (m_numHistory < H801_TIMESYNC_HISTORY)
+          m_numHistory++;
+      }
+
+      m_samples[m_nextSample].server = serverTime;
+      m_samples[m_nextSample].local  = localTime;
+      m_nextSample = (m_nextSample + 1) % H801_TIMESYNC_SAMPLES;
+      if (m_numSamples < H801_TIMESYNC_SAMPLES)
+        m_numSamples++;
+
+      m_numBeacons++;
+      this->estimate();
+    }
+
+
+    /**
+     * Is the clock synchronized
+     * @param  localTime Current millis()
+     * @return true if recent beacons have been received
+     */
+    bool isSynced(uint32_t localTime) {
+      return m_numSamples >= 2 && (localTime - m_refLocal) < H801_TIMESYNC_TIMEOUT;
+    }
+
+
+    /**
+     * Convert local time to server time
+     * @param  localTime millis() value
+     * @return Server time (ms)
+     */
+    double toServer(uint32_t localTime) {
+      double x = (int32_t)(localTime - m_refLocal);
+      return m_refServer + x * (1.0 + m_drift);
+    }
+
+
+    /**
+     * Convert server time to local time, times more than 24 days from
+     * the reference are clamped to it
+     * @param  serverTime Server time (ms)
+     * @return millis() value
+     */
+    uint32_t toLocal(double serverTime) {
+      double dt = (serverTime - m_refServer) / (1.0 + m_drift);
+
+      // Also catches NaN
+      if (!(dt > INT32_MIN))
+        dt = INT32_MIN;
+      else if (dt > INT32_MAX)
+        dt = INT32_MAX;
+
+      return m_refLocal + (int32_t)dt;
+    }
+
+
+    /**
+     * Add time sync information to JSON object
+     * @param root      JSON object
+     * @param localTime Current millis()
+     */
+    void appendInfo(JsonObject& root, uint32_t localTime) {
+      JsonObject& jsonTime = root.createNestedObject("time");
+
+      jsonTime["synced"]  = this->isSynced(localTime);
+      jsonTime["beacons"] = m_numBeacons;
+
+      if (m_numSamples) {
+        jsonTime["offset"]    = m_refServer - (double)m_refLocal;
+        jsonTime["drift_ppm"] = m_drift * 1e6;
+        jsonTime["jitter"]    = m_jitter;
+      }
+    }
+};
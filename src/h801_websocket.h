@@ -0,0 +1,193 @@
+
+// WebSocket port
+#define H801_WEBSOCKET_PORT 81
+
+// Min time between state pushes to the clients
+#define H801_WEBSOCKET_PUSH_INTERVAL 50
+
+// Min time between pushes of current values during fading
+#define H801_WEBSOCKET_FADE_INTERVAL 100
+
+
+/**
+ * H801 WebSocket, clients send commands over a persistent connection
+ * and every client receives the state when it changes
+ */
+class H801_WebSocket {
+  private:
+    WebSocketsServer m_webSocket;
+    H801_Scratch &m_scratch;
+    PH801_Functions m_functions;
+
+    bool m_isStateChanged;
+    bool m_wasFading;
+    unsigned long m_lastPush;
+    unsigned long m_lastFadePush;
+
+    // Counters
+    struct {
+      uint32_t commands;  // Commands received
+      uint32_t pushes;    // Messages broadcast to the clients
+      uint32_t parseFailed;  // Messages that weren't valid JSON
+    } m_stats;
+
+
+    /**
+     * WebSocket event
+     * @param num     Client number
+     * @param type    Event type
+     * @param payload Data
+     * @param length  Data length
+     */
+    void event(uint8_t num, WStype_t type, uint8_t *payload, size_t length) {
+      // Several events can be handled by one loop
+      H801_ScratchScope scope(m_scratch);
+
+      switch (type) {
+        case WStype_CONNECTED: {
+          Serial1.printf("WebSocket: Client %u connected from %s\n", num, m_webSocket.remoteIP(num).toString().c_str());
+
+          // Initial state
+          const char *jsonString = m_functions->get_Status();
+          if (jsonString)
+            m_webSocket.sendTXT(num, jsonString);
+          break;
+        }
+
+        case WStype_DISCONNECTED:
+          Serial1.printf("WebSocket: Client %u disconnected\n", num);
+          break;
+
+        case WStype_TEXT: {
+          // Room for per channel objects
+          StaticJsonBuffer<512> jsonBuffer;
+
+          // Payload is NULL terminated by the library
+          JsonObject& json = jsonBuffer.parseObject((char*)payload);
+          if (!json.success()) {
+            m_stats.parseFailed++;
+            m_webSocket.sendTXT(num, "{ \"message\": \"invalid JSON\"}");
+            return;
+          }
+
+          m_stats.commands++;
+
+          // State is pushed to all clients when the command is committed
+          m_functions->set_Status("WebSocket", json);
+          break;
+        }
+
+        default:
+          break;
+      }
+    }
+
+
+  public:
+    /**
+     * H801 WebSocket constructor
+     * @param scratch   Scratch arena, released after each event
+     * @param functions External functions
+     */
+    H801_WebSocket(H801_Scratch &scratch, PH801_Functions functions):
+        m_webSocket(H801_WEBSOCKET_PORT),
+        m_scratch(scratch),
+        m_functions(functions),
+        m_isStateChanged(false),
+        m_wasFading(false),
+        m_lastPush(0),
+        m_lastFadePush(0) {
+      memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+
+    /**
+     * Setup WebSocket server
+     */
+    void setup() {
+      m_webSocket.onEvent([&](uint8_t num, WStype_t type, uint8_t *payload, size_t length) {
+        this->event(num, type, payload, length);
+      });
+      m_webSocket.begin();
+
+      MDNS.addService("ws", "tcp", H801_WEBSOCKET_PORT);
+    }
+
+
+    /**
+     * State has changed, pushed to the clients by the next loop
+     */
+    void notifyState() {
+      m_isStateChanged = true;
+    }
+
+
+    /**
+     * WebSocket loop, pushes state at a throttled rate
+     * @param time      current millis time
+     * @param isFading  Are any channels fading
+     */
+    void loop(unsigned long time, bool isFading) {
+      m_webSocket.loop();
+
+      if (!m_webSocket.connectedClients()) {
+        m_isStateChanged = false;
+        m_wasFading = false;
+        return;
+      }
+
+      // Committed state
+      if (m_isStateChanged && time - m_lastPush >= H801_WEBSOCKET_PUSH_INTERVAL) {
+        m_isStateChanged = false;
+        m_lastPush = time;
+
+        H801_ScratchScope scope(m_scratch);
+        const char *jsonString = m_functions->get_Status();
+        if (jsonString) {
+          m_webSocket.broadcastTXT(jsonString);
+          m_stats.pushes++;
+        }
+      }
+
+      // In-progress values, including the final values when the fade ends
+      if ((isFading || m_wasFading) && time - m_lastFadePush >= H801_WEBSOCKET_FADE_INTERVAL) {
+        m_wasFading = isFading;
+        m_lastFadePush = time;
+
+        H801_ScratchScope scope(m_scratch);
+        const char *jsonString = m_functions->get_Current();
+        if (jsonString) {
+          m_webSocket.broadcastTXT(jsonString);
+          m_stats.pushes++;
+        }
+      }
+    }
+
+
+    /**
+     * Has connected clients
+     */
+    bool hasClients() {
+      return m_webSocket.connectedClients() > 0;
+    }
+
+
+    /**
+     * Number of messages that weren't valid JSON
+     */
+    uint32_t parseFailures() {
+      return m_stats.parseFailed;
+    }
+
+
+    /**
+     * Add WebSocket information to JSON object
+     * @param root JSON object
+     */
+    void appendInfo(JsonObject& root) {
+      JsonObject& jsonWebSocket = root.createNestedObject("websocket");
+      jsonWebSocket["clients"]  = m_webSocket.connectedClients();
+      jsonWebSocket["commands"] = m_stats.commands;
+      jsonWebSocket["pushes"]   = m_stats.pushes;
+    }
+};
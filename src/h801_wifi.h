@@ -0,0 +1,314 @@
+
+// Time to wait for the cached access point before connecting normally
+#define H801_WIFI_FAST_TIMEOUT 3000
+
+// Time to wait for a normal connect before starting the config portal,
+// or before connecting again when the connection was lost
+#define H801_WIFI_CONNECT_TIMEOUT 30000
+
+// Time to wait for the DHCP lease after connecting with the cached address
+#define H801_WIFI_LEASE_TIMEOUT 30000
+
+
+/**
+ * H801 WiFi, connects in the background so the loop keeps running.
+ * The BSSID, channel and IP of the last connection are cached in the
+ * config, which lets the next boot connect without scanning and without
+ * waiting for DHCP. The lease is renewed once connected and updates the cache
+ */
+class H801_WiFi {
+  public:
+    typedef enum {
+      EVENT_NONE,
+      EVENT_CONNECTED,   // Connected or reconnected, services should be (re)started
+      EVENT_PORTAL,      // No connection, WiFiManager config portal is needed
+    } Event;
+
+  private:
+    typedef enum {
+      STATE_FAST,        // Connecting to cached access point with cached IP
+      STATE_CONNECT,     // Connecting with scan and DHCP
+      STATE_LEASE,       // Connected with cached IP, waiting for the DHCP lease
+      STATE_CONNECTED,
+      STATE_LOST,        // Connection lost, the SDK reconnects
+      STATE_PORTAL,
+    } State;
+
+    H801_Config& m_config;
+
+    State m_state;
+    unsigned long m_startTime;
+
+    // Connection info
+    bool m_hasConnected;
+    const char *m_method;
+    unsigned long m_connectTime;
+    uint32_t m_reconnects;
+
+    // DHCP lease after connecting with the cached address
+    WiFiEventHandler m_gotIPHandler;
+    volatile bool m_isLeased;
+
+
+    /**
+     * Connect with scan and DHCP using the stored credentials
+     * @param time current millis time
+     */
+    void beginConnect(unsigned long time) {
+      WiFi.config(IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0));
+      WiFi.begin(WiFi.SSID().c_str(), WiFi.psk().c_str());
+
+      m_state = STATE_CONNECT;
+      m_startTime = time;
+    }
+
+
+    /**
+     * Renew the DHCP lease while staying connected with the cached address
+     * @param time current millis time
+     */
+    void beginLease(unsigned long time) {
+      m_isLeased = false;
+      m_gotIPHandler = WiFi.onStationModeGotIP([this](const WiFiEventStationModeGotIP &event) {
+        m_isLeased = true;
+      });
+
+      // Starts the DHCP client, the connection is kept
+      WiFi.config(IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0));
+
+      m_state = STATE_LEASE;
+      m_startTime = time;
+    }
+
+
+    /**
+     * Update cached connection, the config is only written when it changed
+     */
+    void updateCache() {
+      uint8_t *bssid = WiFi.BSSID();
+      uint8_t channel = WiFi.channel();
+
+      if (!bssid ||
+          (!memcmp(m_config.m_WiFiCache.bssid, bssid, sizeof(m_config.m_WiFiCache.bssid)) &&
+           m_config.m_WiFiCache.channel == channel &&
+           m_config.m_WiFiCache.ip      == (uint32_t)WiFi.localIP() &&
+           m_config.m_WiFiCache.gateway == (uint32_t)WiFi.gatewayIP() &&
+           m_config.m_WiFiCache.subnet  == (uint32_t)WiFi.subnetMask() &&
+           m_config.m_WiFiCache.dns     == (uint32_t)WiFi.dnsIP()))
+        return;
+
+      memcpy(m_config.m_WiFiCache.bssid, bssid, sizeof(m_config.m_WiFiCache.bssid));
+      m_config.m_WiFiCache.channel = channel;
+      m_config.m_WiFiCache.ip      = WiFi.localIP();
+      m_config.m_WiFiCache.gateway = WiFi.gatewayIP();
+      m_config.m_WiFiCache.subnet  = WiFi.subnetMask();
+      m_config.m_WiFiCache.dns     = WiFi.dnsIP();
+
+      Serial1.println("WiFi: Updated cached connection");
+      m_config.save();
+    }
+
+
+  public:
+    /**
+     * H801 WiFi constructor
+     * @param config Configuration, holds the cached connection
+     */
+    H801_WiFi(H801_Config &config):
+        m_config(config),
+        m_state(STATE_CONNECT),
+        m_startTime(0),
+        m_hasConnected(false),
+        m_method("none"),
+        m_connectTime(0),
+        m_reconnects(0),
+        m_isLeased(false) {
+    }
+
+
+    /**
+     * Start connecting, progress is handled by the loop
+     */
+    void begin() {
+      unsigned long time = millis();
+
+      // Credentials are kept by the SDK, only use them for this connect
+      // so the cached BSSID isn't stored as a fixed access point
+      WiFi.persistent(false);
+      WiFi.mode(WIFI_STA);
+
+      // Already connected by the config portal
+      if (WiFi.status() == WL_CONNECTED) {
+        m_method = "portal";
+        m_state = STATE_CONNECT;
+        m_startTime = time;
+        return;
+      }
+
+      // No credentials
+      if (!WiFi.SSID().length()) {
+        Serial1.println("WiFi: No stored credentials");
+        m_state = STATE_PORTAL;
+        return;
+      }
+
+      // Cached connection
+      if (m_config.m_WiFiCache.channel && m_config.m_WiFiCache.ip) {
+        Serial1.printf("WiFi: Connecting to cached access point on channel %u\n", m_config.m_WiFiCache.channel);
+
+        WiFi.config(IPAddress(m_config.m_WiFiCache.ip), IPAddress(m_config.m_WiFiCache.gateway),
+                    IPAddress(m_config.m_WiFiCache.subnet), IPAddress(m_config.m_WiFiCache.dns));
+        WiFi.begin(WiFi.SSID().c_str(), WiFi.psk().c_str(), m_config.m_WiFiCache.channel, m_config.m_WiFiCache.bssid);
+
+        m_method = "cached";
+        m_state = STATE_FAST;
+        m_startTime = time;
+        return;
+      }
+
+      Serial1.println("WiFi: Connecting");
+      m_method = "scan";
+      this->beginConnect(time);
+    }
+
+
+    /**
+     * Config portal is done, continue as connected or keep trying
+     */
+    void endPortal() {
+      WiFi.persistent(false);
+
+      m_method = "portal";
+      m_state = STATE_CONNECT;
+      m_startTime = millis();
+    }
+
+
+    /**
+     * Is WiFi connected
+     */
+    bool isConnected() {
+      return m_state == STATE_CONNECTED || m_state == STATE_LEASE;
+    }
+
+
+    /**
+     * Track connection progress
+     * @param time current millis time
+     * @return Event for the caller to handle
+     */
+    Event loop(unsigned long time) {
+      bool isConnected = WiFi.status() == WL_CONNECTED;
+
+      switch (m_state) {
+        case STATE_FAST:
+        case STATE_CONNECT:
+          if (isConnected) {
+            bool isCached = m_state == STATE_FAST;
+            m_state = STATE_CONNECTED;
+
+            if (!m_hasConnected) {
+              m_hasConnected = true;
+              m_connectTime = time - m_startTime;
+              Serial1.printf("WiFi: Connected (%s) in %lums\n", m_method, m_connectTime);
+            }
+            else {
+              Serial1.println("WiFi: Reconnected");
+              m_reconnects++;
+            }
+
+            // Cached address may no longer be ours, services start on it
+            // while the lease is requested
+            if (isCached)
+              this->beginLease(time);
+            else
+              this->updateCache();
+            return EVENT_CONNECTED;
+          }
+
+          // Cached access point or address no longer valid
+          if (m_state == STATE_FAST && time - m_startTime >= H801_WIFI_FAST_TIMEOUT) {
+            Serial1.println("WiFi: Cached access point not found, scanning");
+            m_method = "scan";
+            this->beginConnect(time);
+            return EVENT_NONE;
+          }
+
+          if (m_state == STATE_CONNECT && time - m_startTime >= H801_WIFI_CONNECT_TIMEOUT) {
+            // Keep trying when the network has been working
+            if (m_hasConnected) {
+              this->beginConnect(time);
+              return EVENT_NONE;
+            }
+
+            Serial1.println("WiFi: Failed to connect");
+            m_state = STATE_PORTAL;
+          }
+          return EVENT_NONE;
+
+        case STATE_LEASE:
+          if (isConnected && (m_isLeased || time - m_startTime >= H801_WIFI_LEASE_TIMEOUT)) {
+            m_gotIPHandler = NULL;
+            m_state = STATE_CONNECTED;
+
+            if (!m_isLeased) {
+              Serial1.println("WiFi: No DHCP lease, keeping cached address");
+              return EVENT_NONE;
+            }
+
+            // Services are restarted on the leased address
+            bool isChanged = m_config.m_WiFiCache.ip != (uint32_t)WiFi.localIP();
+            this->updateCache();
+            if (isChanged) {
+              Serial1.printf("WiFi: DHCP leased %s\n", WiFi.localIP().toString().c_str());
+              return EVENT_CONNECTED;
+            }
+            return EVENT_NONE;
+          }
+
+          // Connection lost or still waiting for the lease
+          // fall through
+
+        case STATE_CONNECTED:
+          if (!isConnected) {
+            m_gotIPHandler = NULL;
+            Serial1.println("WiFi: Connection lost");
+            m_state = STATE_LOST;
+            m_startTime = time;
+          }
+          return EVENT_NONE;
+
+        case STATE_LOST:
+          if (isConnected) {
+            Serial1.println("WiFi: Reconnected");
+            m_state = STATE_CONNECTED;
+            m_reconnects++;
+            return EVENT_CONNECTED;
+          }
+
+          // SDK reconnects to the same access point, scan
+          // in case it was the cached one that disappeared
+          if (time - m_startTime >= H801_WIFI_CONNECT_TIMEOUT) {
+            Serial1.println("WiFi: Reconnect failed, scanning");
+            this->beginConnect(time);
+          }
+          return EVENT_NONE;
+
+        case STATE_PORTAL:
+          return EVENT_PORTAL;
+      }
+      return EVENT_NONE;
+    }
+
+
+    /**
+     * Add connection information to JSON object
+     * @param jsonWiFi WiFi JSON object
+     */
+    void appendInfo(JsonObject& jsonWiFi) {
+      jsonWiFi["connected"]  = this->isConnected();
+      jsonWiFi["method"]     = m_method;
+      jsonWiFi["connect_ms"] = m_connectTime;
+      jsonWiFi["reconnects"] = m_reconnects;
+    }
+};
@@ -0,0 +1,107 @@
+/**
+ * Fade engine benchmark, counts fade task runs, PWM writes and commits
+ * of a long fade when stepping every 10ms against skipping to the next
+ * duty change, and checks both give the same duty sequence
+ */
+#include <vector>
+#include "h801_host.h"
+#include "h801_board.h"
+#include "h801_led.h"
+
+// Fade step, the period of the fade task
+#define FADE_STEP_MS 10
+
+// Duty written and the step it was written on
+struct DutyChange {
+  uint32_t step;
+  uint32_t duty;
+};
+
+struct Result {
+  uint32_t runs;
+  uint32_t writes;
+  uint32_t commits;
+  std::vector<DutyChange> changes;
+};
+
+
+/**
+ * Fade one channel
+ * @param from     Start brightness
+ * @param to       End brightness
+ * @param ms       Duration
+ * @param isSkip   Skip to the next duty change instead of every step
+ * @param result   Counts and duties written
+ */
+static void fade(uint8_t from, uint8_t to, uint32_t ms, bool isSkip, Result &result) {
+  H801_Led led;
+  led.setup(0, H801_Board::channels[0]);
+  led.set_Bri(from, 0);
+  led.set_Bri(to, ms / FADE_STEP_MS);
+
+  H801_PWM::writes = H801_PWM::commits = 0;
+  result.runs = 0;
+  result.changes.clear();
+
+  uint32_t step = 0, skip = 1;
+  while (led.is_Fading()) {
+    bool isWritten = false;
+    step += skip;
+    led.do_Fade(skip, isWritten);
+    result.runs++;
+
+    // The per step engine committed every run
+    if (isWritten || !isSkip)
+      H801_PWM::commit();
+    if (isWritten)
+      result.changes.push_back({ step, H801_PWM::duty[0] });
+
+    if (isSkip && led.is_Fading())
+      skip = led.next_Change();
+  }
+
+  result.writes  = H801_PWM::writes;
+  result.commits = H801_PWM::commits;
+}
+
+
+/**
+ * Compare engines on one fade and print the counts
+ */
+static void bench(const char *name, uint8_t from, uint8_t to, uint32_t ms) {
+  Result step, skip;
+  fade(from, to, ms, false, step);
+  fade(from, to, ms, true, skip);
+
+  // Same duties, float rounding may move one by a step
+  CHECK(step.changes.size() == skip.changes.size());
+  uint32_t maxShift = 0;
+  for (size_t i = 0; i < min(step.changes.size(), skip.changes.size()); i++) {
+    CHECK(step.changes[i].duty == skip.changes[i].duty);
+    maxShift = max(maxShift, (uint32_t)abs((int)(step.changes[i].step - skip.changes[i].step)));
+  }
+  CHECK(maxShift <= 1);
+
+  printf("%-16s per step: %6u runs %6u commits | on change: %4u runs %4u writes %4u commits\n",
+         name, step.runs, step.commits, skip.runs, skip.writes, skip.commits);
+}
+
+
+int main() {
+  H801_PWM::begin(H801_Board::channels, 1, s_gammaTable[countof(s_gammaTable) - 1]);
+
+  bench("1h 0->255",      0,   255, 3600000);
+  bench("1h 255->0",      255, 0,   3600000);
+  bench("10min 20->200",  20,  200, 600000);
+  bench("1s 0->255",      0,   255, 1000);
+  bench("5s 255->10",     255, 10,  5000);
+
+  // Long fade runs once per duty change instead of every step
+  Result result;
+  fade(0, 255, 3600000, false, result);
+  CHECK(result.runs == 360001);
+  fade(0, 255, 3600000, true, result);
+  CHECK(result.runs == 654);
+
+  return s_failed ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+#pragma once
+/**
+ * Host shim of the Arduino core, only what the headers under test use.
+ * Time is driven by the test through hostSetMillis()
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+#define PROGMEM
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+
+#define OUTPUT 1
+#define INPUT  0
+#define CHANGE 3
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+typedef uint8_t byte;
+
+
+// Time
+inline unsigned long& hostMillis() {
+  static unsigned long time = 0;
+  return time;
+}
+
+inline void hostSetMillis(unsigned long time) {
+  hostMillis() = time;
+}
+
+inline unsigned long millis() {
+  return hostMillis();
+}
+
+inline unsigned long micros() {
+  return hostMillis() * 1000;
+}
+
+inline void delay(unsigned long ms) {
+  hostMillis() += ms;
+}
+
+
+// Pins, outputs are not simulated
+inline void pinMode(uint8_t pin, uint8_t mode) {}
+inline void digitalWrite(uint8_t pin, uint8_t value) {}
+inline int digitalRead(uint8_t pin) { return 1; }
+
+
+inline size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t length = strlen(src);
+  if (size) {
+    size_t count = length < size - 1 ? length : size - 1;
+    memcpy(dst, src, count);
+    dst[count] = '\0';
+  }
+  return length;
+}
+
+
+/**
+ * Arduino String
+ */
+class String {
+  private:
+    std::string m_value;
+
+  public:
+    String() {}
+    String(const char *value): m_value(value ? value : "") {}
+
+    const char* c_str() const { return m_value.c_str(); }
+    size_t length() const { return m_value.size(); }
+    bool operator==(const char *other) const { return m_value == other; }
+};
+
+
+/**
+ * Serial port, output is dropped unless H801_HOST_VERBOSE is set
+ */
+class HostSerial {
+  public:
+    void begin(unsigned long baud) {}
+
+    size_t printf(const char *format, ...) {
+      if (!getenv("H801_HOST_VERBOSE"))
+        return 0;
+
+      va_list args;
+      va_start(args, format);
+      int length = vfprintf(stderr, format, args);
+      va_end(args);
+      return length > 0 ? length : 0;
+    }
+
+    size_t print(const char *text)   { return this->printf("%s", text); }
+    size_t println(const char *text) { return this->printf("%s\n", text); }
+    size_t println()                 { return this->printf("\n"); }
+};
+
+static HostSerial Serial1 __attribute__((unused));
+
+
+/**
+ * IPv4 address
+ */
+class IPAddress {
+  private:
+    uint8_t m_bytes[4];
+
+  public:
+    IPAddress() { memset(m_bytes, 0, sizeof(m_bytes)); }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+      m_bytes[0] = a; m_bytes[1] = b; m_bytes[2] = c; m_bytes[3] = d;
+    }
+
+    uint8_t operator[](int index) const { return m_bytes[index]; }
+    operator uint32_t() const { uint32_t value; memcpy(&value, m_bytes, 4); return value; }
+};
@@ -0,0 +1,65 @@
+#pragma once
+/**
+ * Host shim of ArduinoJson 5, only what the headers under test use.
+ * A variant holds an integer or a string, numbers are kept as integers.
+ * Nested objects share the keys of their parent
+ */
+#include <map>
+#include <type_traits>
+#include "Arduino.h"
+
+
+class JsonVariant {
+  private:
+    enum { TYPE_NONE, TYPE_INT, TYPE_STRING } m_type;
+    long        m_int;
+    const char *m_string;
+
+  public:
+    JsonVariant(): m_type(TYPE_NONE), m_int(0), m_string(NULL) {}
+    JsonVariant(int value): m_type(TYPE_INT), m_int(value), m_string(NULL) {}
+    JsonVariant(const char *value): m_type(TYPE_STRING), m_int(0), m_string(value) {}
+
+    template <typename T> bool is() const;
+    template <typename T> T as() const;
+
+    // Other values assigned to objects are dropped
+    template <typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, JsonVariant&>::type operator=(const T &value) {
+      m_type = TYPE_INT;
+      m_int = (long)value;
+      return *this;
+    }
+
+    JsonVariant& operator=(const char *value) {
+      m_type = TYPE_STRING;
+      m_string = value;
+      return *this;
+    }
+
+    template <typename T>
+    typename std::enable_if<!std::is_arithmetic<T>::value, JsonVariant&>::type operator=(const T &value) {
+      return *this;
+    }
+};
+
+template <> inline bool JsonVariant::is<int>() const   { return m_type == TYPE_INT; }
+template <> inline bool JsonVariant::is<long>() const  { return m_type == TYPE_INT; }
+template <> inline bool JsonVariant::is<char*>() const { return m_type == TYPE_STRING; }
+template <> inline bool JsonVariant::is<const char*>() const { return m_type == TYPE_STRING; }
+template <> inline int   JsonVariant::as<int>() const   { return (int)m_int; }
+template <> inline long  JsonVariant::as<long>() const  { return m_int; }
+template <> inline char* JsonVariant::as<char*>() const { return (char*)m_string; }
+template <> inline const char* JsonVariant::as<const char*>() const { return m_string; }
+
+
+class JsonObject {
+  private:
+    std::map<std::string, JsonVariant> m_values;
+
+  public:
+    JsonObject& createNestedObject(const char *key) { return *this; }
+
+    JsonVariant& operator[](const char *key)    { return m_values[key]; }
+    JsonVariant& operator[](const String &key)  { return m_values[key.c_str()]; }
+};
@@ -0,0 +1,14 @@
+#pragma once
+/**
+ * Host shim of the ESP8266 WiFi station, the host is on loopback
+ */
+#include "Arduino.h"
+#include "WiFiUdp.h"
+
+
+class HostWiFi {
+  public:
+    IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+};
+
+static HostWiFi WiFi __attribute__((unused));
@@ -0,0 +1,84 @@
+#pragma once
+/**
+ * Host shim of WiFiUDP on a POSIX socket, receives on all local addresses
+ * so tests can send to the port over loopback. Multicast groups are not
+ * joined, packets are sent to the port directly
+ */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "Arduino.h"
+
+
+class WiFiUDP {
+  private:
+    int     m_socket;
+    uint8_t m_packet[1500];
+    size_t  m_length;
+    size_t  m_position;
+
+  public:
+    WiFiUDP():
+        m_socket(-1),
+        m_length(0),
+        m_position(0) {
+    }
+
+    ~WiFiUDP() {
+      this->stop();
+    }
+
+    uint8_t begin(uint16_t port) {
+      this->stop();
+
+      m_socket = socket(AF_INET, SOCK_DGRAM, 0);
+      if (m_socket < 0)
+        return 0;
+
+      int reuse = 1;
+      setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      addr.sin_port = htons(port);
+      if (bind(m_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        this->stop();
+        return 0;
+      }
+      return 1;
+    }
+
+    uint8_t beginMulticast(IPAddress interfaceAddr, IPAddress multicast, uint16_t port) {
+      return this->begin(port);
+    }
+
+    void stop() {
+      if (m_socket >= 0)
+        close(m_socket);
+      m_socket = -1;
+      m_length = m_position = 0;
+    }
+
+    int parsePacket() {
+      if (m_socket < 0)
+        return 0;
+
+      ssize_t length = recv(m_socket, m_packet, sizeof(m_packet), MSG_DONTWAIT);
+      m_length = length > 0 ? length : 0;
+      m_position = 0;
+      return m_length;
+    }
+
+    int available() {
+      return m_length - m_position;
+    }
+
+    size_t read(uint8_t *buffer, size_t length) {
+      length = min(length, m_length - m_position);
+      memcpy(buffer, m_packet + m_position, length);
+      m_position += length;
+      return length;
+    }
+};
@@ -0,0 +1,34 @@
+#pragma once
+/**
+ * Definitions h801.cpp provides ahead of the headers,
+ * included first by every host test
+ */
+#include "Arduino.h"
+#include "ArduinoJson.h"
+
+// countof
+template <typename T, std::size_t N>
+constexpr std::size_t countof(T const (&)[N]) noexcept {
+  return N;
+}
+
+inline bool stringToUnsignedLong(const char *psz, unsigned long *dest) {
+  char *end = NULL;
+  unsigned long value = strtoul(psz, &end, 10);
+  if (!*psz || *end)
+    return false;
+
+  *dest = value;
+  return true;
+}
+
+
+// Test result, failed checks are printed and make the test exit non-zero
+static int s_failed = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+      s_failed++; \
+    } \
+  } while (0)
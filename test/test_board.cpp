@@ -0,0 +1,63 @@
+/**
+ * Board descriptor and led core built for a host with the mock PWM
+ * driver, checks that the outputs get the gamma corrected duties
+ */
+#include "h801_host.h"
+#include "h801_board.h"
+#include "h801_led.h"
+
+
+int main() {
+  H801_Led leds[H801_BOARD_CHANNELS];
+  for (size_t i = 0; i < countof(leds); i++)
+    leds[i].setup(i, H801_Board::channels[i]);
+  H801_PWM::begin(H801_Board::channels, countof(leds), s_gammaTable[countof(s_gammaTable) - 1]);
+
+  // Channel table
+  CHECK(countof(H801_Board::channels) == H801_BOARD_CHANNELS);
+  for (size_t i = 0; i < countof(leds); i++)
+    CHECK(leds[i].get_ID() == H801_Board::channels[i].id);
+
+  // Direct set writes the gamma corrected duty
+  CHECK(leds[0].set_Bri(255, 0));
+  CHECK(H801_PWMMock::duty[0] == s_gammaTable[0x3FF]);
+  CHECK(leds[0].is_Static());
+  CHECK(!leds[0].set_Bri(255, 0));
+
+  CHECK(leds[0].set_Bri(128, 0));
+  CHECK(H801_PWMMock::duty[0] == s_gammaTable[128 << 2 | 0x3]);
+  CHECK(leds[0].get_CurrBri() == 128);
+
+  // Fade reports the target and reaches it on the last step
+  size_t last = countof(leds) - 1;
+  CHECK(leds[last].set_Bri(200, 50));
+  CHECK(leds[last].get_Bri() == 200);
+  CHECK(leds[last].is_Fading());
+
+  // Restore keeps the end value while the output fades
+  uint32_t steps = 0;
+  bool isWritten = false;
+  while (leds[last].do_Fade(1, isWritten)) {
+    CHECK(leds[last].get_TargetBri() == 200);
+    steps++;
+  }
+  CHECK(steps + 1 == 51);
+  CHECK(leds[last].get_TargetBri() == 200);
+
+  // The fade takes one step more than requested, so it ends at most one step past the target
+  CHECK(leds[last].get_CurrBri() >= 200 && leds[last].get_CurrBri() <= 200 + 200 / 50);
+  CHECK(!leds[last].is_Fading());
+
+  // Button fade level is what the restore journals
+  CHECK(leds[0].do_ButtonFade(false));
+  CHECK(leds[0].do_ButtonFade(false));
+  CHECK(leds[0].get_TargetBri() == leds[0].get_Bri());
+  CHECK(leds[0].get_TargetBri() < 128);
+
+  // Other channels untouched
+  for (size_t i = 1; i < last; i++)
+    CHECK(H801_PWMMock::duty[i] == 0);
+
+  printf("%s: %u channels, %s\n", H801_Board::name, (unsigned)H801_BOARD_CHANNELS, s_failed ? "FAILED" : "ok");
+  return s_failed ? 1 : 0;
+}
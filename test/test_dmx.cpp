@@ -0,0 +1,295 @@
+/**
+ * E1.31 and Art-Net receiver, packets are sent to the receiver over
+ * loopback and the channel values handed to set_Channels are checked
+ */
+#include <arpa/inet.h>
+#include "h801_host.h"
+#include "ESP8266WiFi.h"
+
+// What h801_dmx.h uses of the configuration and the callbacks
+struct H801_Config {
+  struct {
+    char     protocol[8];
+    uint16_t universe;
+    uint16_t address;
+  } m_DMX;
+};
+
+typedef struct tagH801_Functions {
+  void (*set_Channels)(const char *eventSource, const uint8_t *values, size_t count);
+} H801_Functions, *PH801_Functions;
+
+#include "h801_dmx.h"
+
+
+// Last values set by the receiver
+static uint8_t s_values[H801_DMX_CHANNELS];
+static size_t  s_numValues;
+static int     s_numCalls;
+
+static void setChannels(const char *eventSource, const uint8_t *values, size_t count) {
+  memcpy(s_values, values, count);
+  s_numValues = count;
+  s_numCalls++;
+}
+
+static H801_Functions s_functions = { setChannels };
+
+static const uint8_t s_cidA[16] = { 0xA };
+static const uint8_t s_cidB[16] = { 0xB };
+
+
+/**
+ * Build E1.31 data packet, the slots are 1, 2, 3... plus base
+ * @return Packet length
+ */
+static size_t makeE131(uint8_t *packet, const uint8_t *cid, uint16_t universe, uint8_t sequence,
+                       uint8_t priority, uint8_t base, uint16_t slots, bool isTerminated = false) {
+  static const uint8_t acnId[12] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+
+  memset(packet, 0, 126 + slots);
+  packet[1] = 0x10;
+  memcpy(packet + 4, acnId, sizeof(acnId));
+  packet[21] = 0x04;
+  memcpy(packet + 22, cid, 16);
+  packet[43] = 0x02;
+  packet[108] = priority;
+  packet[111] = sequence;
+  packet[112] = isTerminated ? 0x40 : 0x00;
+  packet[113] = universe >> 8;
+  packet[114] = universe & 0xFF;
+  packet[117] = 0x02;
+  packet[123] = (slots + 1) >> 8;
+  packet[124] = (slots + 1) & 0xFF;
+  for (uint16_t i = 0; i < slots; i++)
+    packet[126 + i] = base + i + 1;
+  return 126 + slots;
+}
+
+
+/**
+ * Build ArtDmx packet, the slots are 1, 2, 3... plus base
+ * @return Packet length
+ */
+static size_t makeArtNet(uint8_t *packet, uint16_t universe, uint8_t sequence, uint8_t base, uint16_t slots) {
+  memset(packet, 0, 18 + slots);
+  memcpy(packet, "Art-Net", 8);
+  packet[9] = 0x50;
+  packet[11] = 14;
+  packet[12] = sequence;
+  packet[14] = universe & 0xFF;
+  packet[15] = universe >> 8;
+  packet[16] = slots >> 8;
+  packet[17] = slots & 0xFF;
+  for (uint16_t i = 0; i < slots; i++)
+    packet[18 + i] = base + i + 1;
+  return 18 + slots;
+}
+
+
+/**
+ * Send packet to the receiver over loopback
+ */
+static void sendPacket(uint16_t port, const uint8_t *packet, size_t length) {
+  static int sender = socket(AF_INET, SOCK_DGRAM, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  CHECK(sendto(sender, packet, length, 0, (struct sockaddr*)&addr, sizeof(addr)) == (ssize_t)length);
+}
+
+
+/**
+ * Send E1.31 packet and run the receiver
+ * @return Was a new value set
+ */
+static bool receiveE131(H801_DMX &dmx, unsigned long time, const uint8_t *cid, uint8_t sequence,
+                        uint8_t priority, uint8_t base, bool isTerminated = false) {
+  uint8_t packet[H801_DMX_PACKET_MAX];
+  sendPacket(H801_DMX_E131_PORT, packet, makeE131(packet, cid, 1, sequence, priority, base, 16, isTerminated));
+
+  int numCalls = s_numCalls;
+  dmx.loop(time);
+  return s_numCalls != numCalls;
+}
+
+
+/**
+ * Frames parsed from packets built here
+ */
+static void testParse() {
+  uint8_t packet[H801_DMX_PACKET_MAX];
+  H801_DMXFrame frame;
+
+  size_t length = makeE131(packet, s_cidA, 300, 7, 150, 0, 512, true);
+  CHECK(H801_DMX::parseE131(packet, length, &frame));
+  CHECK(frame.universe == 300 && frame.sequence == 7 && frame.priority == 150);
+  CHECK(frame.isTerminated && !memcmp(frame.cid, s_cidA, 16));
+  CHECK(frame.length == 512 && frame.data[0] == 1 && frame.data[511] == (uint8_t)512);
+
+  // Truncated, other vector or start code
+  CHECK(!H801_DMX::parseE131(packet, length - 1, &frame));
+  CHECK(!H801_DMX::parseE131(packet, 125, &frame));
+  packet[43] = 0x03;
+  CHECK(!H801_DMX::parseE131(packet, length, &frame));
+  makeE131(packet, s_cidA, 300, 7, 150, 0, 512);
+  packet[125] = 0xCC;
+  CHECK(!H801_DMX::parseE131(packet, length, &frame));
+
+  length = makeArtNet(packet, 0x8123, 9, 0, 24);
+  CHECK(H801_DMX::parseArtNet(packet, length, &frame));
+  CHECK(frame.universe == 0x0123 && frame.sequence == 9 && frame.cid == NULL);
+  CHECK(frame.priority == H801_DMX_E131_PRIORITY && !frame.isTerminated);
+  CHECK(frame.length == 24 && frame.data[23] == 24);
+
+  // Truncated, other opcode or old protocol
+  CHECK(!H801_DMX::parseArtNet(packet, length - 1, &frame));
+  packet[9] = 0x21;
+  CHECK(!H801_DMX::parseArtNet(packet, length, &frame));
+  makeArtNet(packet, 0x8123, 9, 0, 24);
+  packet[11] = 13;
+  CHECK(!H801_DMX::parseArtNet(packet, length, &frame));
+}
+
+
+/**
+ * Sequence numbers and priority of E1.31 sources
+ */
+static void testE131() {
+  H801_Config config = { { "e131", 1, 3 } };
+  H801_DMX dmx(config, &s_functions);
+  dmx.setup();
+  unsigned long time = 1000;
+
+  // Start address 3 maps slots 3-7 onto the channels
+  CHECK(receiveE131(dmx, time, s_cidA, 1, 100, 0));
+  CHECK(s_numValues == H801_DMX_CHANNELS && s_values[0] == 3 && s_values[4] == 7);
+  CHECK(dmx.isReceiving(time));
+
+  // Late, repeated and dropped frames
+  CHECK(receiveE131(dmx, time += 25, s_cidA, 2, 100, 10));
+  CHECK(!receiveE131(dmx, time += 25, s_cidA, 1, 100, 20));
+  CHECK(!receiveE131(dmx, time += 25, s_cidA, 2, 100, 20));
+  CHECK(receiveE131(dmx, time += 25, s_cidA, 5, 100, 30));
+  CHECK(s_values[0] == 33);
+
+  // Sequence restarted far behind
+  CHECK(receiveE131(dmx, time += 25, s_cidA, 200, 100, 40));
+
+  // Only the newest frame of a loop is applied
+  uint8_t packet[H801_DMX_PACKET_MAX];
+  for (uint8_t sequence = 201; sequence <= 203; sequence++)
+    sendPacket(H801_DMX_E131_PORT, packet, makeE131(packet, s_cidA, 1, sequence, 100, (sequence - 199) * 10, 16));
+  int numCalls = s_numCalls;
+  dmx.loop(time += 25);
+  CHECK(s_numCalls == numCalls + 1 && s_values[0] == 43);
+
+  // Other universe
+  sendPacket(H801_DMX_E131_PORT, packet, makeE131(packet, s_cidA, 2, 5, 100, 0, 16));
+  dmx.loop(time += 25);
+  CHECK(s_numCalls == numCalls + 1);
+
+  // Lower priority source is ignored, higher takes over
+  CHECK(!receiveE131(dmx, time += 25, s_cidB, 1, 50, 60));
+  CHECK(receiveE131(dmx, time += 25, s_cidB, 2, 150, 70));
+  CHECK(!receiveE131(dmx, time += 25, s_cidA, 5, 100, 80));
+
+  // Source gone, lower priority source takes over after the timeout
+  CHECK(!receiveE131(dmx, time += H801_DMX_SOURCE_TIMEOUT - 100, s_cidA, 6, 100, 90));
+  CHECK(receiveE131(dmx, time += 200, s_cidA, 7, 100, 90));
+  CHECK(!dmx.isReceiving(time + H801_DMX_SOURCE_TIMEOUT));
+
+  // Terminated source lets the other one take over directly
+  CHECK(!receiveE131(dmx, time += 25, s_cidA, 8, 100, 100, true));
+  CHECK(receiveE131(dmx, time += 25, s_cidB, 3, 50, 110));
+
+  JsonObject info;
+  dmx.appendInfo(info);
+  CHECK(info["late"].as<long>() == 2);
+  CHECK(info["dropped"].as<long>() == 2);
+  CHECK(info["ignored"].as<long>() == 4);
+  CHECK(info["packets"].as<long>() == 10);
+}
+
+
+/**
+ * Sequence wrap, E1.31 wraps from 255 to 0 and Art-Net from 255 to 1
+ */
+static void testWrap() {
+  H801_Config config = { { "e131", 1, 1 } };
+  H801_DMX dmx(config, &s_functions);
+  dmx.setup();
+  unsigned long time = 1000;
+
+  // Sequence 0 is a frame like any other, a late 0 is still late
+  CHECK(receiveE131(dmx, time, s_cidA, 254, 100, 0));
+  CHECK(receiveE131(dmx, time += 25, s_cidA, 255, 100, 10));
+  CHECK(receiveE131(dmx, time += 25, s_cidA, 0, 100, 20));
+  CHECK(receiveE131(dmx, time += 25, s_cidA, 1, 100, 30));
+  CHECK(!receiveE131(dmx, time += 25, s_cidA, 0, 100, 40));
+
+  JsonObject info;
+  dmx.appendInfo(info);
+  CHECK(info["dropped"].as<long>() == 0);
+  CHECK(info["late"].as<long>() == 1);
+
+  strcpy(config.m_DMX.protocol, "artnet");
+  H801_DMX artNet(config, &s_functions);
+  artNet.setup();
+
+  uint8_t packet[H801_DMX_PACKET_MAX];
+  int numCalls = s_numCalls;
+  for (uint8_t sequence : { 254, 255, 1 }) {
+    sendPacket(H801_DMX_ARTNET_PORT, packet, makeArtNet(packet, 1, sequence, 0, 16));
+    artNet.loop(time += 25);
+  }
+  CHECK(s_numCalls == numCalls + 3);
+
+  artNet.appendInfo(info);
+  CHECK(info["dropped"].as<long>() == 0);
+  CHECK(info["late"].as<long>() == 0);
+}
+
+
+/**
+ * Art-Net receiver, no source id or priority
+ */
+static void testArtNet() {
+  H801_Config config = { { "artnet", 5, 510 } };
+  H801_DMX dmx(config, &s_functions);
+  dmx.setup();
+
+  // Start address near the end, only the slots that exist are mapped
+  uint8_t packet[H801_DMX_PACKET_MAX];
+  sendPacket(H801_DMX_ARTNET_PORT, packet, makeArtNet(packet, 5, 1, 0, 512));
+  int numCalls = s_numCalls;
+  dmx.loop(1000);
+  CHECK(s_numCalls == numCalls + 1);
+  CHECK(s_numValues == 3 && s_values[0] == (uint8_t)510 && s_values[2] == (uint8_t)512);
+
+  // Sequence 0 disables the sequence check
+  sendPacket(H801_DMX_ARTNET_PORT, packet, makeArtNet(packet, 5, 0, 0, 512));
+  dmx.loop(1025);
+  sendPacket(H801_DMX_ARTNET_PORT, packet, makeArtNet(packet, 5, 0, 0, 512));
+  dmx.loop(1050);
+  CHECK(s_numCalls == numCalls + 3);
+
+  // E1.31 packet on the Art-Net port
+  sendPacket(H801_DMX_ARTNET_PORT, packet, makeE131(packet, s_cidA, 5, 1, 100, 0, 16));
+  dmx.loop(1075);
+  CHECK(s_numCalls == numCalls + 3);
+}
+
+
+int main() {
+  testParse();
+  testE131();
+  testWrap();
+  testArtNet();
+
+  printf("dmx: %s\n", s_failed ? "failed" : "ok");
+  return s_failed ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+/**
+ * Clock synchronization under network jitter. Simulates devices with
+ * drifting clocks receiving the time beacon with random delays, and
+ * measures when each one starts a command scheduled with "at"
+ */
+#include "h801_host.h"
+#include "h801_timesync.h"
+
+// Simulated devices and beacons
+#define NUM_DEVICES      40
+#define NUM_TRIALS       20
+#define BEACON_INTERVAL  2000.0
+#define NUM_BEACONS      300
+
+// Max accepted start skew between devices and error against "at",
+// with 5ms mean network jitter
+#define MAX_SKEW  10.0
+#define MAX_ERROR 10.0
+
+
+// Repeatable random numbers
+static uint64_t s_random = 88172645463325252ULL;
+
+static double randomUniform() {
+  s_random ^= s_random << 13;
+  s_random ^= s_random >> 7;
+  s_random ^= s_random << 17;
+  return (s_random >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Network delay of a beacon: 2ms, exponential jitter and 5% of the
+ * beacons delayed a further 0-200ms
+ * @param jitter Mean of the jitter (ms)
+ */
+static double networkDelay(double jitter) {
+  double delay = 2 - jitter * log(1 - randomUniform());
+  if (randomUniform() < 0.05)
+    delay += 200 * randomUniform();
+  return delay;
+}
+
+
+/**
+ * Device clock, millis() runs at 1 + drift against the server
+ */
+struct Device {
+  H801_TimeSync sync;
+  double boot;        // Server time at local millis() 0
+  double drift;
+
+  uint32_t localAt(double server) {
+    return (uint32_t)(uint64_t)floor((server - boot) * (1 + drift));
+  }
+
+  double serverAt(uint32_t local, uint32_t reference, double referenceServer) {
+    return referenceServer + (double)(int32_t)(local - reference) / (1 + drift);
+  }
+};
+
+
+/**
+ * Run trials, devices start a command when the loop sees millis()
+ * reach the due time, the loop ticks every 1ms
+ * @param jitter     Mean network jitter (ms)
+ * @param worstSkew  Worst start skew between devices (ms)
+ * @param worstError Worst start error against "at" (ms)
+ */
+static void simulate(double jitter, double &worstSkew, double &worstError) {
+  double sumSkew = 0;
+  worstSkew = worstError = 0;
+
+  for (int trial = 0; trial < NUM_TRIALS; trial++) {
+    static Device devices[NUM_DEVICES];
+    double start = 1539936000000.0;
+
+    for (Device &device : devices) {
+      device.sync = H801_TimeSync();
+      device.drift = (randomUniform() * 2 - 1) * 100e-6;
+
+      // Booted up to 50 days ago, millis() wraps for some of them
+      device.boot = start - randomUniform() * 50.0 * 24 * 3600 * 1000;
+    }
+
+    // Beacons, each device receives them with its own delay
+    double server = start;
+    for (int i = 0; i < NUM_BEACONS; i++, server += BEACON_INTERVAL) {
+      for (Device &device : devices)
+        device.sync.addSample(server, device.localAt(server + networkDelay(jitter)));
+    }
+
+    // Command scheduled 2 seconds after the last beacon
+    double now = server - BEACON_INTERVAL + 1000;
+    double at = now + 2000;
+
+    double first = 1e300, last = -1e300, maxError = 0;
+    for (Device &device : devices) {
+      uint32_t local = device.localAt(now);
+      CHECK(device.sync.isSynced(local));
+
+      // Server time when millis() reaches the due time
+      uint32_t due = device.sync.toLocal(at);
+      double fire = device.serverAt(due, local, now) + randomUniform();
+
+      first = min(first, fire);
+      last  = max(last, fire);
+      maxError = max(maxError, fabs(fire - at));
+    }
+
+    double skew = last - first;
+    sumSkew += skew;
+    worstSkew = max(worstSkew, skew);
+    worstError = max(worstError, maxError);
+  }
+
+  printf("timesync: jitter %2.0fms, start skew avg %4.1fms max %4.1fms, max error %4.1fms\n",
+         jitter, sumSkew / NUM_TRIALS, worstSkew, worstError);
+}
+
+
+int main() {
+  double worstSkew, worstError;
+
+  simulate(5, worstSkew, worstError);
+  CHECK(worstSkew < MAX_SKEW);
+  CHECK(worstError < MAX_ERROR);
+
+  // Reported only, skew grows with the jitter
+  simulate(20, worstSkew, worstError);
+  simulate(50, worstSkew, worstError);
+
+  // Times far from the reference are clamped instead of overflowing
+  H801_TimeSync sync;
+  sync.addSample(1000000.0, 5000);
+  sync.addSample(1001000.0, 6000);
+  CHECK(sync.toLocal(1001500.0) == 6500);
+  CHECK(sync.toLocal(1e18) == 6000 + (uint32_t)INT32_MAX);
+  CHECK(sync.toLocal(-1e18) == 6000 + (uint32_t)INT32_MIN);
+  CHECK(sync.toLocal(NAN) == 6000 + (uint32_t)INT32_MIN);
+
+  // Timestamps keep their milliseconds as doubles
+  CHECK(strtod("1539936000001", NULL) - 1539936000000.0 == 1.0);
+
+  return s_failed ? 1 : 0;
+}